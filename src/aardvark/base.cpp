@@ -3,7 +3,11 @@
 
 #include "vendor/aardvark.h"
 #include <aardvark/base.hpp>
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <thread>
+#include <utility>
 
 #if 0
 //TODO?
@@ -23,37 +27,565 @@ inline constexpr static std::array<uint8_t, AARDVARK_IO_COUNT> aardvarkIO = {0x0
 
 void aardvarkAdapter::start_() noexcept
 {
-	started_refcnt_++;
+	attach();
+}
+
+void aardvarkAdapter::stop_() noexcept
+{
+	detach();
+}
+
+void aardvarkAdapter::attach() noexcept
+{
+	// Client drivers attach and detach from their own threads. The reference count and the
+	// handle change together under the lock, so the adapter is opened exactly once and never
+	// closed while another client still holds a reference.
+	std::lock_guard<aardvarkAdapter> lock(*this);
 
-	if(!started())
+	if(started_refcnt_++ == 0)
 	{
 		handle_ = aa_open(port_);
 		assert((handle_ > 0) && "Could not find Aardvark Device");
+		unique_id_ = aa_unique_id(handle_);
 
-		mode(mode_);
+		// Apply everything requested so far, including settings made before start
+		applied_fields_ = 0;
+		flush_();
 	}
 }
 
-void aardvarkAdapter::stop_() noexcept
+void aardvarkAdapter::detach() noexcept
 {
-	started_refcnt_--;
+	std::lock_guard<aardvarkAdapter> lock(*this);
+
+	assert(started_refcnt_ > 0);
 
-	if(started() && (started_refcnt_ == 0))
+	if(--started_refcnt_ == 0)
 	{
 		aa_close(handle_);
 		handle_ = 0;
 	}
 }
 
+int aardvarkAdapter::attached() noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(*this);
+	return started_refcnt_;
+}
+
+void aardvarkAdapter::lockContended_() noexcept
+{
+	auto start = std::chrono::steady_clock::now();
+	lock_.lock();
+	auto us = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+										std::chrono::steady_clock::now() - start)
+										.count());
+
+	lock_contended_.fetch_add(1, std::memory_order_relaxed);
+	lock_wait_us_.fetch_add(us, std::memory_order_relaxed);
+
+	auto max = lock_max_wait_us_.load(std::memory_order_relaxed);
+	while(us > max && !lock_max_wait_us_.compare_exchange_weak(max, us, std::memory_order_relaxed))
+	{
+	}
+}
+
 aardvarkMode aardvarkAdapter::mode(aardvarkMode m) noexcept
 {
-	mode_ = m;
+	std::lock_guard<aardvarkAdapter> lock(*this);
+
+	requested_.mode = m;
+	request_(CONFIG_MODE);
+
+	return m;
+}
+
+void aardvarkAdapter::beginConfig() noexcept
+{
+	lock();
+	batch_depth_++;
+}
+
+void aardvarkAdapter::commitConfig() noexcept
+{
+	assert(batch_depth_ > 0);
+
+	if(--batch_depth_ == 0)
+	{
+		commit_();
+	}
+
+	unlock();
+}
+
+aardvarkConfigStats aardvarkAdapter::configStats() const noexcept
+{
+	return {config_issued_.load(std::memory_order_relaxed),
+			config_elided_.load(std::memory_order_relaxed)};
+}
+
+int aardvarkAdapter::request_(uint16_t field) noexcept
+{
+	requested_fields_ |= field;
+	pending_requests_++;
+
+	return (batch_depth_ == 0) ? commit_() : AA_OK;
+}
+
+int aardvarkAdapter::commit_() noexcept
+{
+	int r = flush_();
+
+	if(connectionLost(r) && reconnect())
+	{
+		// The reconnect replayed every requested setting
+		r = ((requested_fields_ & ~applied_fields_) == 0) ? AA_OK : AA_COMMUNICATION_ERROR;
+	}
+
+	return r;
+}
+
+int aardvarkAdapter::flush_() noexcept
+{
+	if(handle_ <= 0)
+	{
+		// Not open yet, or being reconnected: the requests are applied once it is open
+		return AA_OK;
+	}
+
+	// The mode is applied first, since it changes the pin functions. GPIO outputs are
+	// set before the direction so pins do not glitch when they become outputs.
+	constexpr std::array<uint16_t, 10> order = {
+		CONFIG_MODE,		 CONFIG_TARGET_POWER, CONFIG_I2C_PULLUPS,	 CONFIG_I2C_BITRATE,
+		CONFIG_I2C_BUS_TIMEOUT, CONFIG_SPI_BITRATE,	 CONFIG_SPI_CONFIG,	 CONFIG_GPIO_PULLUP,
+		CONFIG_GPIO_OUTPUT,	 CONFIG_GPIO_DIRECTION};
+
+	int result = AA_OK;
+	uint32_t issued = 0;
+
+	for(auto field : order)
+	{
+		if((requested_fields_ & field) == 0 ||
+		   (((applied_fields_ & field) != 0) && !differs_(field)))
+		{
+			continue;
+		}
+
+		int r = apply_(field);
+		issued++;
+
+		if(r < 0)
+		{
+			// Leave the field unapplied so the next flush tries again
+			applied_fields_ &= static_cast<uint16_t>(~field);
+			result = (result == AA_OK) ? r : result;
+		}
+		else
+		{
+			applied_fields_ |= field;
+		}
+	}
+
+	config_issued_.fetch_add(issued, std::memory_order_relaxed);
+	if(pending_requests_ > issued)
+	{
+		config_elided_.fetch_add(pending_requests_ - issued, std::memory_order_relaxed);
+	}
+	pending_requests_ = 0;
+
+	return result;
+}
+
+bool aardvarkAdapter::differs_(uint16_t field) const noexcept
+{
+	switch(field)
+	{
+		case CONFIG_MODE:
+			return requested_.mode != applied_.mode;
+		case CONFIG_TARGET_POWER:
+			return requested_.target_power != applied_.target_power;
+		case CONFIG_I2C_PULLUPS:
+			return requested_.i2c_pullups != applied_.i2c_pullups;
+		case CONFIG_I2C_BITRATE:
+			return requested_.i2c_bitrate_khz != applied_.i2c_bitrate_khz;
+		case CONFIG_I2C_BUS_TIMEOUT:
+			return requested_.i2c_bus_timeout_ms != applied_.i2c_bus_timeout_ms;
+		case CONFIG_SPI_BITRATE:
+			return requested_.spi_bitrate_khz != applied_.spi_bitrate_khz;
+		case CONFIG_SPI_CONFIG:
+			return requested_.spi_mode != applied_.spi_mode ||
+				   requested_.spi_order != applied_.spi_order;
+		case CONFIG_GPIO_PULLUP:
+			return requested_.gpio_pullup_mask != applied_.gpio_pullup_mask;
+		case CONFIG_GPIO_OUTPUT:
+			return requested_.gpio_output_mask != applied_.gpio_output_mask;
+		case CONFIG_GPIO_DIRECTION:
+			return requested_.gpio_direction_mask != applied_.gpio_direction_mask;
+		default:
+			return true;
+	}
+}
+
+int aardvarkAdapter::apply_(uint16_t field) noexcept
+{
+	int r = AA_OK;
+
+	switch(field)
+	{
+		case CONFIG_MODE:
+			r = aa_configure(handle_, static_cast<AardvarkConfig>(requested_.mode));
+			applied_.mode = requested_.mode;
+			break;
+		case CONFIG_TARGET_POWER:
+			r = aa_target_power(handle_, requested_.target_power ? AA_TARGET_POWER_BOTH
+																 : AA_TARGET_POWER_NONE);
+			applied_.target_power = requested_.target_power;
+			break;
+		case CONFIG_I2C_PULLUPS:
+			r = aa_i2c_pullup(handle_,
+							  requested_.i2c_pullups ? AA_I2C_PULLUP_BOTH : AA_I2C_PULLUP_NONE);
+			applied_.i2c_pullups = requested_.i2c_pullups;
+			break;
+		case CONFIG_I2C_BITRATE:
+			r = aa_i2c_bitrate(handle_, requested_.i2c_bitrate_khz);
+			r = (r > 0) ? (i2c_bitrate_actual_ = r) : (r == 0 ? AA_COMMUNICATION_ERROR : r);
+			applied_.i2c_bitrate_khz = requested_.i2c_bitrate_khz;
+			break;
+		case CONFIG_I2C_BUS_TIMEOUT:
+			r = aa_i2c_bus_timeout(handle_, requested_.i2c_bus_timeout_ms);
+			i2c_bus_timeout_actual_ = (r > 0) ? r : i2c_bus_timeout_actual_;
+			applied_.i2c_bus_timeout_ms = requested_.i2c_bus_timeout_ms;
+			break;
+		case CONFIG_SPI_BITRATE:
+			r = aa_spi_bitrate(handle_, requested_.spi_bitrate_khz);
+			r = (r > 0) ? (spi_bitrate_actual_ = r) : (r == 0 ? AA_COMMUNICATION_ERROR : r);
+			applied_.spi_bitrate_khz = requested_.spi_bitrate_khz;
+			break;
+		case CONFIG_SPI_CONFIG:
+			r = aa_spi_configure(
+				handle_, static_cast<AardvarkSpiPolarity>(static_cast<int>(requested_.spi_mode) >> 1),
+				static_cast<AardvarkSpiPhase>(static_cast<int>(requested_.spi_mode) & 1),
+				requested_.spi_order == embvm::spi::order::msbFirst ? AA_SPI_BITORDER_MSB
+																	: AA_SPI_BITORDER_LSB);
+			applied_.spi_mode = requested_.spi_mode;
+			applied_.spi_order = requested_.spi_order;
+			break;
+		case CONFIG_GPIO_PULLUP:
+			r = aa_gpio_pullup(handle_, requested_.gpio_pullup_mask);
+			applied_.gpio_pullup_mask = requested_.gpio_pullup_mask;
+			break;
+		case CONFIG_GPIO_OUTPUT:
+			r = aa_gpio_set(handle_, requested_.gpio_output_mask);
+			applied_.gpio_output_mask = requested_.gpio_output_mask;
+			break;
+		case CONFIG_GPIO_DIRECTION:
+			r = aa_gpio_direction(handle_, requested_.gpio_direction_mask);
+			applied_.gpio_direction_mask = requested_.gpio_direction_mask;
+			break;
+		default:
+			assert(0 && "Unknown configuration field");
+	}
+
+	return r;
+}
+
+void aardvarkAdapter::acquire(std::chrono::steady_clock::time_point deadline) noexcept
+{
+	std::unique_lock<std::mutex> lock(arbiter_lock_);
+
+	const std::pair<std::chrono::steady_clock::time_point, uint32_t> me{deadline, ticket_++};
+	waiters_.push_back(me);
+
+	max_waiters_ = std::max(max_waiters_, static_cast<uint32_t>(waiters_.size()));
+	const bool waits = granted_ || waiters_.size() > 1;
+	const auto start = std::chrono::steady_clock::now();
+
+	arbiter_cv_.wait(lock, [&] {
+		return !granted_ && *std::min_element(waiters_.begin(), waiters_.end(),
+											  [](const auto& a, const auto& b) {
+												  if(a.first != b.first)
+												  {
+													  return a.first < b.first;
+												  }
+
+												  // Wrap-safe ticket comparison
+												  return static_cast<int32_t>(a.second - b.second) < 0;
+											  }) == me;
+	});
+
+	waiters_.erase(std::find(waiters_.begin(), waiters_.end(), me));
+	granted_ = true;
+
+	if(waits)
+	{
+		auto us = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+											std::chrono::steady_clock::now() - start)
+											.count());
+		arbitration_waits_++;
+		arbitration_wait_us_ += us;
+		max_arbitration_wait_us_ = std::max(max_arbitration_wait_us_, us);
+	}
+
+	lock.unlock();
+
+	this->lock();
+}
+
+void aardvarkAdapter::release() noexcept
+{
+	unlock();
+
+	arbiter_lock_.lock();
+	granted_ = false;
+	arbiter_lock_.unlock();
+
+	arbiter_cv_.notify_all();
+}
+
+void aardvarkAdapter::recordLatency(aardvarkPriority p,
+									std::chrono::steady_clock::time_point submitted,
+									std::chrono::steady_clock::time_point deadline) noexcept
+{
+	auto now = std::chrono::steady_clock::now();
+	auto us = static_cast<uint32_t>(
+		std::chrono::duration_cast<std::chrono::microseconds>(now - submitted).count());
+	auto& c = latency_.at(static_cast<size_t>(p));
+
+	c.count.fetch_add(1, std::memory_order_relaxed);
+	c.total_us.fetch_add(us, std::memory_order_relaxed);
+
+	if(now > deadline)
+	{
+		c.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	auto max = c.max_us.load(std::memory_order_relaxed);
+	while(us > max && !c.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed))
+	{
+	}
+}
+
+aardvarkLatencyStats aardvarkAdapter::latencyStats(aardvarkPriority p) const noexcept
+{
+	const auto& c = latency_.at(static_cast<size_t>(p));
+	auto count = c.count.load(std::memory_order_relaxed);
+	auto total = c.total_us.load(std::memory_order_relaxed);
+
+	return {count, c.deadline_misses.load(std::memory_order_relaxed),
+			count ? static_cast<uint32_t>(total / count) : 0, c.max_us.load(std::memory_order_relaxed)};
+}
+
+aardvarkLockStats aardvarkAdapter::lockStats() const noexcept
+{
+	aardvarkLockStats s{};
+	s.acquisitions = lock_acquisitions_.load(std::memory_order_relaxed);
+	s.contended = lock_contended_.load(std::memory_order_relaxed);
+	s.wait_us = lock_wait_us_.load(std::memory_order_relaxed);
+	s.max_wait_us = lock_max_wait_us_.load(std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(arbiter_lock_);
+	s.arbitration_waits = arbitration_waits_;
+	s.arbitration_wait_us = arbitration_wait_us_;
+	s.max_arbitration_wait_us = max_arbitration_wait_us_;
+	s.max_waiters = max_waiters_;
+
+	return s;
+}
+
+bool aardvarkAdapter::connectionLost(int r) noexcept
+{
+	return r == AA_COMMUNICATION_ERROR || r == AA_INVALID_HANDLE;
+}
+
+bool aardvarkAdapter::reconnect() noexcept
+{
+	auto start = std::chrono::steady_clock::now();
+
+	lock();
+
+	auto generation = generation_.load(std::memory_order_acquire);
+	auto unique_id = unique_id_;
+
+	if(handle_ > 0)
+	{
+		aa_close(handle_);
+		handle_ = 0;
+	}
+
+	// Release only the level taken above. A caller holding the lock for the failed operation
+	// keeps its critical section, so other drivers stay blocked until this search ends.
+	// Callers that do not hold the lock let other drivers run: their operations fail on the
+	// closed handle and end up waiting for this search.
+	unlock();
+
+	{
+		std::lock_guard<std::mutex> search(reconnect_lock_);
+
+		// Skip the search if another thread found the adapter while this one waited
+		if(generation_.load(std::memory_order_acquire) == generation)
+		{
+			found_handle_ = search_(unique_id, start, found_port_);
+			if(found_handle_ > 0)
+			{
+				generation_.fetch_add(1, std::memory_order_release);
+			}
+		}
+	}
 
 	lock();
-	aa_configure(handle_, static_cast<AardvarkConfig>(m));
+
+	// Whichever thread gets the lock first installs the handle found by the search
+	int h = 0;
+	uint8_t port = 0;
+
+	{
+		std::lock_guard<std::mutex> search(reconnect_lock_);
+		h = std::exchange(found_handle_, 0);
+		port = found_port_;
+	}
+
+	bool connected = false;
+
+	if(h > 0 && started_refcnt_ == 0)
+	{
+		// The last driver stopped while the adapter was searched for
+		aa_close(h);
+	}
+	else if(h > 0)
+	{
+		handle_ = h;
+		port_ = port;
+		replay_();
+		connected = true;
+
+		auto ms = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+											std::chrono::steady_clock::now() - start)
+											.count());
+		last_recovery_ms_ = ms;
+		if(ms > max_recovery_ms_)
+		{
+			max_recovery_ms_ = ms;
+		}
+		reconnects_++;
+	}
+	else if(generation_.load(std::memory_order_acquire) != generation)
+	{
+		connected = (handle_ > 0);
+	}
+	else
+	{
+		reconnect_failures_++;
+	}
+
 	unlock();
 
-	return mode_;
+	return connected;
+}
+
+int aardvarkAdapter::search_(uint32_t unique_id, std::chrono::steady_clock::time_point start,
+							 uint8_t& port) noexcept
+{
+	constexpr int MAX_DEVICES = 16;
+	constexpr std::chrono::milliseconds poll_interval{50};
+
+	while(true)
+	{
+		std::array<u16, MAX_DEVICES> ports{};
+		std::array<u32, MAX_DEVICES> ids{};
+		int count = aa_find_devices_ext(MAX_DEVICES, ports.data(), MAX_DEVICES, ids.data());
+
+		for(int i = 0; i < std::min(count, MAX_DEVICES); i++)
+		{
+			if(ids[static_cast<size_t>(i)] == unique_id &&
+			   (ports[static_cast<size_t>(i)] & AA_PORT_NOT_FREE) == 0)
+			{
+				auto h = aa_open(ports[static_cast<size_t>(i)]);
+				if(h > 0)
+				{
+					port = static_cast<uint8_t>(ports[static_cast<size_t>(i)]);
+					return h;
+				}
+			}
+		}
+
+		if((std::chrono::steady_clock::now() - start) >
+		   reconnect_timeout_.load(std::memory_order_relaxed))
+		{
+			return 0;
+		}
+
+		std::this_thread::sleep_for(poll_interval);
+	}
+}
+
+void aardvarkAdapter::replay_() noexcept
+{
+	// Nothing is known to be applied to the freshly opened adapter
+	applied_fields_ = 0;
+	flush_();
+}
+
+aardvarkReconnectStats aardvarkAdapter::reconnectStats() const noexcept
+{
+	return {reconnects_.load(), reconnect_failures_.load(), last_recovery_ms_.load(),
+			max_recovery_ms_.load()};
+}
+
+int aardvarkAdapter::i2cBitrate(int khz) noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(*this);
+
+	requested_.i2c_bitrate_khz = khz;
+	int r = request_(CONFIG_I2C_BITRATE);
+
+	if(r < 0)
+	{
+		return r;
+	}
+
+	return (batch_depth_ > 0) ? khz : i2c_bitrate_actual_;
+}
+
+int aardvarkAdapter::i2cBusTimeout(uint16_t ms) noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(*this);
+
+	requested_.i2c_bus_timeout_ms = ms;
+	int r = request_(CONFIG_I2C_BUS_TIMEOUT);
+
+	if(r < 0)
+	{
+		return r;
+	}
+
+	return (batch_depth_ > 0) ? ms : i2c_bus_timeout_actual_;
+}
+
+int aardvarkAdapter::spiBitrate(int khz) noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(*this);
+
+	requested_.spi_bitrate_khz = khz;
+	int r = request_(CONFIG_SPI_BITRATE);
+
+	if(r < 0)
+	{
+		return r;
+	}
+
+	return (batch_depth_ > 0) ? khz : spi_bitrate_actual_;
+}
+
+void aardvarkAdapter::spiConfigure(embvm::spi::mode m, embvm::spi::order o) noexcept
+{
+	assert(((m == embvm::spi::mode::mode0) || (m == embvm::spi::mode::mode3)) &&
+		   "Aardvark only supports SPI mode 3 and 0");
+
+	std::lock_guard<aardvarkAdapter> lock(*this);
+
+	requested_.spi_mode = m;
+	requested_.spi_order = o;
+	request_(CONFIG_SPI_CONFIG);
 }
 
 bool aardvarkAdapter::i2cPullups() noexcept
@@ -75,7 +607,8 @@ bool aardvarkAdapter::i2cPullups() noexcept
 bool aardvarkAdapter::i2cPullups(bool en) noexcept
 {
 	lock();
-	aa_i2c_pullup(handle_, en ? AA_I2C_PULLUP_BOTH : AA_I2C_PULLUP_NONE);
+	requested_.i2c_pullups = en;
+	request_(CONFIG_I2C_PULLUPS);
 	unlock();
 
 	return en;
@@ -100,7 +633,8 @@ bool aardvarkAdapter::targetPower() noexcept
 bool aardvarkAdapter::targetPower(bool en) noexcept
 {
 	lock();
-	aa_i2c_pullup(handle_, en ? AA_TARGET_POWER_BOTH : AA_TARGET_POWER_NONE);
+	requested_.target_power = en;
+	request_(CONFIG_TARGET_POWER);
 	unlock();
 
 	return en;
@@ -108,25 +642,22 @@ bool aardvarkAdapter::targetPower(bool en) noexcept
 
 void aardvarkAdapter::pullup(uint8_t id, bool en) noexcept
 {
-	uint8_t value = 0;
+	lock();
 
 	if(en)
 	{
-		value = aardvarkIO.at(id);
+		requested_.gpio_pullup_mask |= aardvarkIO.at(id);
 	}
 	else
 	{
 		// ~ converts to an int, and we need uint8_t. Preventing an inadvertant conversion warning.
-		value = static_cast<uint8_t>(~aardvarkIO.at(id));
+		requested_.gpio_pullup_mask &= static_cast<uint8_t>(~aardvarkIO.at(id));
 	}
 
-	pullup_mask_ &= value;
-
-	lock();
-	int r = aa_gpio_pullup(handle_, pullup_mask_);
+	int r = request_(CONFIG_GPIO_PULLUP);
 	unlock();
 
-	assert(r == AA_OK); // Failure to set pullup
+	assert(r == AA_OK || connectionLost(r)); // Failure to set pullup
 }
 
 void aardvarkAdapter::setGPIOMode(uint8_t pin, embvm::gpio::mode m) noexcept
@@ -134,58 +665,72 @@ void aardvarkAdapter::setGPIOMode(uint8_t pin, embvm::gpio::mode m) noexcept
 	// Only modes supported by Aardvark
 	assert(m == embvm::gpio::mode::output || m == embvm::gpio::mode::input);
 	assert(pin < AARDVARK_IO_COUNT);
-	assert(started());
 
 	uint8_t pin_mask_ = aardvarkIO[pin];
 
 	lock();
 	if(m == embvm::gpio::mode::output)
 	{
-		direction_mask_ |= pin_mask_;
+		requested_.gpio_direction_mask |= pin_mask_;
 	}
 	else
 	{
-		direction_mask_ &= ~pin_mask_;
+		requested_.gpio_direction_mask &= ~pin_mask_;
 	}
 
-	int r = aa_gpio_direction(handle_, direction_mask_);
+	int r = request_(CONFIG_GPIO_DIRECTION);
 	unlock();
-	assert(r == AA_OK); // failure to change direction
+	assert(r == AA_OK || connectionLost(r)); // failure to change direction
 }
 
 void aardvarkAdapter::setGPIOOutput(uint8_t pin, bool v) noexcept
 {
 	assert(pin < AARDVARK_IO_COUNT);
-	assert(started());
 	uint8_t pin_mask_ = aardvarkIO[pin];
 
 	lock();
 
 	if(v)
 	{
-		output_mask_ |= pin_mask_;
+		requested_.gpio_output_mask |= pin_mask_;
 	}
 	else
 	{
-		output_mask_ &= ~pin_mask_;
+		requested_.gpio_output_mask &= ~pin_mask_;
 	}
 
-	int r = aa_gpio_set(handle_, output_mask_);
+	int r = request_(CONFIG_GPIO_OUTPUT);
 	unlock();
 
-	assert(r == AA_OK); // failure to change direction
+	assert(r == AA_OK || connectionLost(r)); // failure to change direction
 }
 
-bool aardvarkAdapter::readGPIO(uint8_t pin) noexcept
+void aardvarkAdapter::toggleGPIO(uint8_t pin) noexcept
 {
 	assert(pin < AARDVARK_IO_COUNT);
-	assert(started());
+	lock();
+	assert(started_refcnt_ > 0);
+	requested_.gpio_output_mask ^= aardvarkIO[pin];
+	int r = request_(CONFIG_GPIO_OUTPUT);
+	unlock();
+
+	assert(r == AA_OK || connectionLost(r)); // failure to change output
+}
 
+bool aardvarkAdapter::readGPIO(uint8_t pin) noexcept
+{
+	assert(pin < AARDVARK_IO_COUNT);
 	lock();
+	assert(started_refcnt_ > 0);
 	int set = aa_gpio_get(handle_);
+	if(connectionLost(set) && reconnect())
+	{
+		set = aa_gpio_get(handle_);
+	}
 	unlock();
 
-	assert(set > AA_OK);
+	// 0 is a valid reading: all pins low. A lost adapter that could not be reopened reads low.
+	assert(set >= AA_OK || connectionLost(set));
 
-	return set & aardvarkIO[pin];
+	return (set > 0) && (set & aardvarkIO[pin]);
 }
@@ -4,11 +4,16 @@
 #ifndef AARDVARK_BASE_HPP_
 #define AARDVARK_BASE_HPP_
 
+#include "metrics.hpp"
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <driver/driver.hpp>
 #include <driver/gpio.hpp>
+#include <driver/spi.hpp>
 #include <mutex>
+#include <vector>
 
 namespace embdrv
 {
@@ -37,6 +42,144 @@ enum class aardvarkMode
 	Query = 0x80
 };
 
+/// Priority classes for Aardvark bus requests
+enum class aardvarkPriority : uint8_t
+{
+	/// Latency-critical requests, such as interrupt status reads.
+	critical = 0,
+	/// Requests that should be serviced ahead of regular traffic.
+	high,
+	/// Regular traffic. This is the class used by the standard transfer() APIs.
+	normal,
+	/// Throughput-oriented requests, such as memory dumps or firmware updates.
+	bulk,
+	/// The number of priority classes.
+	count
+};
+
+/// Get the implicit deadline budget for a priority class.
+/// Requests submitted without an explicit deadline must complete within this budget.
+/// @param p The priority class.
+/// @returns The deadline budget, relative to the submission time.
+constexpr std::chrono::microseconds aardvarkDefaultBudget(aardvarkPriority p) noexcept
+{
+	switch(p)
+	{
+		case aardvarkPriority::critical:
+			return std::chrono::microseconds(1000);
+		case aardvarkPriority::high:
+			return std::chrono::microseconds(10000);
+		case aardvarkPriority::bulk:
+			return std::chrono::microseconds(1000000);
+		case aardvarkPriority::normal:
+		default:
+			return std::chrono::microseconds(100000);
+	}
+}
+
+/// Scheduling parameters for an Aardvark bus request
+struct aardvarkSchedule
+{
+	/// The priority class of the request.
+	aardvarkPriority priority = aardvarkPriority::normal;
+	/// Absolute deadline for the request. If unset, aardvarkDefaultBudget() is used.
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	/// SPI only: split transfers longer than this many bytes into separately scheduled
+	/// chunks, so other requests can preempt the transfer between chunks. The chip select
+	/// is released between chunks, so only use this with devices that tolerate it.
+	/// 0 disables splitting.
+	size_t chunk = 0;
+	/// Affinity group. When the SPI master's affinity window is enabled, requests that share
+	/// a non-zero group with the previously dispatched request are dispatched next if their
+	/// deadline is within the window of the most urgent request. 0 disables grouping.
+	uint8_t group = 0;
+};
+
+/// Latency statistics for one priority class
+struct aardvarkLatencyStats
+{
+	/// Number of completed requests.
+	uint32_t count;
+	/// Number of requests that completed after their deadline.
+	uint32_t deadline_misses;
+	/// Mean submission-to-completion latency, in microseconds.
+	uint32_t mean_us;
+	/// Maximum submission-to-completion latency, in microseconds.
+	uint32_t max_us;
+};
+
+/// Configuration settings shadowed by the aardvarkAdapter
+struct aardvarkConfig
+{
+	/// Adapter operational mode.
+	aardvarkMode mode = aardvarkMode::SpiI2C;
+	/// 5V target power enable.
+	bool target_power = false;
+	/// I2C pullup enable.
+	bool i2c_pullups = false;
+	/// I2C bitrate, in kHz.
+	int i2c_bitrate_khz = 0;
+	/// I2C bus lock timeout, in ms.
+	uint16_t i2c_bus_timeout_ms = 0;
+	/// SPI bitrate, in kHz.
+	int spi_bitrate_khz = 0;
+	/// SPI clock mode.
+	embvm::spi::mode spi_mode = embvm::spi::mode::mode0;
+	/// SPI bit order.
+	embvm::spi::order spi_order = embvm::spi::order::msbFirst;
+	/// GPIO pullup mask.
+	uint8_t gpio_pullup_mask = 0;
+	/// GPIO output value mask.
+	uint8_t gpio_output_mask = 0;
+	/// GPIO direction mask (1 = output).
+	uint8_t gpio_direction_mask = 0;
+};
+
+/// Counters describing configuration command traffic
+struct aardvarkConfigStats
+{
+	/// Number of configuration commands sent to the adapter.
+	uint32_t issued;
+	/// Number of configuration requests that did not need a command, because the setting
+	/// was already applied or was merged with another request in the same batch.
+	uint32_t elided;
+};
+
+/// Counters describing USB reconnect activity
+struct aardvarkReconnectStats
+{
+	/// Number of successful reconnects.
+	uint32_t reconnects;
+	/// Number of reconnect attempts that timed out.
+	uint32_t failures;
+	/// Time from detecting the lost connection to replaying the configuration, for the most
+	/// recent reconnect, in milliseconds.
+	uint32_t last_recovery_ms;
+	/// Maximum time to recover, in milliseconds.
+	uint32_t max_recovery_ms;
+};
+
+/// Contention counters for the adapter lock and the bus arbitration
+struct aardvarkLockStats
+{
+	/// Number of times the adapter lock was taken.
+	uint32_t acquisitions;
+	/// Number of times the adapter lock was held by another thread and had to be waited for.
+	uint32_t contended;
+	/// Total time spent waiting for the adapter lock, in microseconds.
+	uint64_t wait_us;
+	/// Maximum time spent waiting for the adapter lock, in microseconds.
+	uint32_t max_wait_us;
+	/// Number of acquire() calls that had to wait for another request.
+	uint32_t arbitration_waits;
+	/// Total time requests waited in acquire(), in microseconds.
+	uint64_t arbitration_wait_us;
+	/// Maximum time a request waited in acquire(), in microseconds.
+	uint32_t max_arbitration_wait_us;
+	/// Maximum number of requests waiting in acquire() at once.
+	uint32_t max_waiters;
+};
+
 /** Driver to control the Aardvark Adapter
  *
  * This class must always be declared for use with Aardvark drivers. The aardvarkAdapter
@@ -51,6 +194,26 @@ enum class aardvarkMode
  * embdrv::aardvarkGPIOInput<4> gpio4{aardvark};
  * embdrv::aardvarkGPIOInput<3> gpio3{aardvark};
  * @endcode
+ *
+ * The adapter keeps an authoritative shadow of its configuration. Each setting records both
+ * the requested value and the value last applied to the hardware, and a configuration
+ * command is only issued when the two differ. Several changes can be merged into a single
+ * flush with aardvarkConfigBatch:
+ *
+ * @code
+ * {
+ *	embdrv::aardvarkConfigBatch batch{aardvark};
+ *	aardvark.i2cPullups(true);
+ *	aardvark.i2cBitrate(400);
+ *	aardvark.targetPower(true);
+ * } // Changed settings are applied here
+ * @endcode
+ *
+ * The cached configuration is also used to recover from USB disconnects. If the adapter drops
+ * off USB, the bus masters and the GPIO functions detect the failed handle and call
+ * reconnect(), which reopens the adapter by its unique ID and replays the cached
+ * configuration. The bus master that detected the loss keeps the adapter lock while the
+ * adapter is searched for, so other drivers pause rather than fail.
  */
 class aardvarkAdapter final : public embvm::DriverBase
 {
@@ -61,8 +224,10 @@ class aardvarkAdapter final : public embvm::DriverBase
 	 * @param USBPort The id of the USB port the aardvarkAdapter is connected to.
 	 */
 	explicit aardvarkAdapter(aardvarkMode m = aardvarkMode::SpiI2C, uint8_t USBPort = 0) noexcept
-		: embvm::DriverBase(embvm::DriverType::Undefined), port_(USBPort), mode_(m)
+		: embvm::DriverBase(embvm::DriverType::Undefined), port_(USBPort)
 	{
+		requested_.mode = m;
+		requested_fields_ = CONFIG_MODE;
 	}
 
 	/// Default destructor
@@ -78,9 +243,42 @@ class aardvarkAdapter final : public embvm::DriverBase
 	/// @returns the configured aardvark operational mode.
 	aardvarkMode mode() const noexcept
 	{
-		return mode_;
+		return requested_.mode;
 	}
 
+	/** Take a reference to the adapter on behalf of a client driver
+	 *
+	 * The first reference opens the adapter and applies the requested configuration. Client
+	 * drivers call this from their start_() instead of start(), because DriverBase::start()
+	 * only runs once no matter how many clients share the adapter. Starting the adapter
+	 * directly takes one reference as well.
+	 */
+	void attach() noexcept;
+
+	/// Release a reference taken by attach(). The last reference closes the adapter.
+	/// @pre attach() was called.
+	void detach() noexcept;
+
+	/// Get the number of references taken by attach() and start().
+	/// @returns the number of attached clients.
+	int attached() noexcept;
+
+	/** Defer configuration commands until commitConfig()
+	 *
+	 * The adapter lock is held until the matching commitConfig() call. Calls may be nested.
+	 * While deferred, setters that normally return a value reported by the adapter return
+	 * the requested value instead.
+	 */
+	void beginConfig() noexcept;
+
+	/// Apply all configuration changes requested since beginConfig().
+	/// @pre beginConfig() was called by this thread.
+	void commitConfig() noexcept;
+
+	/// Get the configuration command counters.
+	/// @returns a snapshot of the configuration counters.
+	aardvarkConfigStats configStats() const noexcept;
+
 	/// Get the handle for the Aardvark Master
 	/// The handle is used by related drivers to work with the Aardvark library APIs.
 	/// @returns the Aardvark master handle.
@@ -93,7 +291,12 @@ class aardvarkAdapter final : public embvm::DriverBase
 	/// @post The aardvarkAdapter is locked for the client's exclusive use.
 	void lock() noexcept
 	{
-		lock_.lock();
+		if(!lock_.try_lock())
+		{
+			lockContended_();
+		}
+
+		lock_acquisitions_.fetch_add(1, std::memory_order_relaxed);
 	}
 
 	/// Unlock the Aardvark Master
@@ -104,6 +307,103 @@ class aardvarkAdapter final : public embvm::DriverBase
 		lock_.unlock();
 	}
 
+	/** Acquire the adapter on behalf of a scheduled bus request
+	 *
+	 * Bus masters sharing this adapter arbitrate through this function. When multiple
+	 * requests are waiting, the adapter is granted to the one with the earliest deadline.
+	 *
+	 * @param deadline The deadline of the request that needs the adapter.
+	 * @post The aardvarkAdapter is locked for the client's exclusive use.
+	 */
+	void acquire(std::chrono::steady_clock::time_point deadline) noexcept;
+
+	/// Release the adapter after acquire().
+	/// @pre The adapter was acquired with acquire().
+	/// @post The adapter is granted to the next waiting request, if any.
+	void release() noexcept;
+
+	/** Record the completion of a scheduled bus request
+	 *
+	 * @param p The priority class of the request.
+	 * @param submitted The time the request was submitted.
+	 * @param deadline The effective deadline of the request.
+	 */
+	void recordLatency(aardvarkPriority p, std::chrono::steady_clock::time_point submitted,
+					   std::chrono::steady_clock::time_point deadline) noexcept;
+
+	/// Get the latency statistics for a priority class, across all drivers using this adapter.
+	/// @param p The priority class.
+	/// @returns a snapshot of the latency statistics.
+	aardvarkLatencyStats latencyStats(aardvarkPriority p) const noexcept;
+
+	/// Get the contention counters of the adapter lock and the bus arbitration.
+	/// @returns a snapshot of the contention counters.
+	aardvarkLockStats lockStats() const noexcept;
+
+	/// Get the per-target bus metrics, recorded by all bus masters using this adapter.
+	aardvarkBusMetrics& metrics() noexcept
+	{
+		return metrics_;
+	}
+
+	/// Get the per-target bus metrics, recorded by all bus masters using this adapter.
+	const aardvarkBusMetrics& metrics() const noexcept
+	{
+		return metrics_;
+	}
+
+	/** Check whether an Aardvark API result indicates that the USB connection was lost
+	 *
+	 * @param r The value returned by an aa_* API call.
+	 * @returns true if the adapter handle is no longer usable.
+	 */
+	static bool connectionLost(int r) noexcept;
+
+	/** Reopen the adapter after the USB connection was lost
+	 *
+	 * The adapter is located by its unique ID, so it may come back on a different port.
+	 * Once reopened, the cached configuration is replayed. Levels of the adapter lock held
+	 * by the caller stay held during the search, so the caller's critical section is not
+	 * broken. Concurrent callers wait for the search in progress instead of starting another
+	 * one, and the first of them to hold the lock installs the handle it found.
+	 *
+	 * @pre The caller holds the adapter lock taken for the failed operation, so the handle
+	 *	closed here is the one that failed.
+	 * @returns true if the adapter was reopened, false if reconnectTimeout() expired.
+	 */
+	bool reconnect() noexcept;
+
+	/// Set how long reconnect() keeps searching for the adapter.
+	/// @param timeout The maximum time to spend in reconnect().
+	void reconnectTimeout(std::chrono::milliseconds timeout) noexcept
+	{
+		reconnect_timeout_.store(timeout, std::memory_order_relaxed);
+	}
+
+	/// Get the reconnect counters.
+	/// @returns a snapshot of the reconnect counters.
+	aardvarkReconnectStats reconnectStats() const noexcept;
+
+	/// Set the I2C bitrate
+	/// @param khz The requested bitrate, in kHz.
+	/// @returns the bitrate selected by the adapter in kHz, or a negative error code.
+	int i2cBitrate(int khz) noexcept;
+
+	/// Set the I2C bus lock timeout
+	/// @param ms The timeout, in milliseconds.
+	/// @returns the timeout selected by the adapter in ms, or a negative error code.
+	int i2cBusTimeout(uint16_t ms) noexcept;
+
+	/// Set the SPI bitrate
+	/// @param khz The requested bitrate, in kHz.
+	/// @returns the bitrate selected by the adapter in kHz, or a negative error code.
+	int spiBitrate(int khz) noexcept;
+
+	/// Configure the SPI clock mode and bit order
+	/// @param m The SPI mode. The Aardvark supports mode 0 and mode 3.
+	/// @param o The SPI bit order.
+	void spiConfigure(embvm::spi::mode m, embvm::spi::order o) noexcept;
+
 	/// Query the current i2c pullup setting
 	/// @returns true if I2C pullups are enabled, false if disabled.
 	bool i2cPullups() noexcept;
@@ -129,7 +429,8 @@ class aardvarkAdapter final : public embvm::DriverBase
 
 	/// Configure a pin as a GPIO input or output
 	///
-	/// @precondition Aardvark base class is started
+	/// If the adapter is not started yet, the direction is applied when it starts.
+	///
 	/// @precondition pin is an integer < AARDVARK_IO_COUNT
 	///
 	/// @param [in] pin The pin to set
@@ -138,7 +439,8 @@ class aardvarkAdapter final : public embvm::DriverBase
 
 	/// Set GPIO output
 	///
-	/// @precondition Aardvark base class is started
+	/// If the adapter is not started yet, the output level is applied when it starts.
+	///
 	/// @precondition pin is an integer < AARDVARK_IO_COUNT
 	/// @postcondition GPIO mode for the pin is set to output
 	///
@@ -146,9 +448,20 @@ class aardvarkAdapter final : public embvm::DriverBase
 	/// @param [in] v The pin output state; high = true, low = false
 	void setGPIOOutput(uint8_t pin, bool v) noexcept;
 
+	/// Invert the output state of a GPIO
+	///
+	/// The new state is derived from the adapter's output state while the adapter is locked,
+	/// so concurrent toggles of the same pin are not lost.
+	///
+	/// @preconditon The adapter is attached
+	/// @precondition pin is an integer < AARDVARK_IO_COUNT
+	///
+	/// @param [in] pin The pin to toggle
+	void toggleGPIO(uint8_t pin) noexcept;
+
 	/// Read the current GPIO state
 	///
-	/// @preconditon Aardvark base class is started
+	/// @preconditon The adapter is attached
 	/// @precondition pin is an integer < AARDVARK_IO_COUNT
 	/// @precondition pin is set to input
 	///
@@ -160,32 +473,213 @@ class aardvarkAdapter final : public embvm::DriverBase
 	void start_() noexcept final;
 	void stop_() noexcept final;
 
+	/// Wait for the adapter lock while another thread holds it, and record the wait.
+	void lockContended_() noexcept;
+
+	/// Re-apply the cached configuration to a freshly opened adapter.
+	/// @pre The adapter lock is held.
+	void replay_() noexcept;
+
+	/** Search for the adapter until it is found or reconnectTimeout() expires
+	 *
+	 * @pre reconnect_lock_ is held.
+	 * @param unique_id The unique ID of the adapter.
+	 * @param start The time the connection loss was detected.
+	 * @param port Receives the port the adapter was found on.
+	 * @returns the handle of the reopened adapter, or 0 if the timeout expired.
+	 */
+	int search_(uint32_t unique_id, std::chrono::steady_clock::time_point start,
+				uint8_t& port) noexcept;
+
+	/// Flush the configuration requests, reconnecting if the adapter dropped off USB.
+	/// @pre The adapter lock is held.
+	/// @returns AA_OK, or the first error reported by the adapter.
+	int commit_() noexcept;
+
+	/// Configuration shadow fields
+	enum configField : uint16_t
+	{
+		CONFIG_MODE = (1 << 0),
+		CONFIG_TARGET_POWER = (1 << 1),
+		CONFIG_I2C_PULLUPS = (1 << 2),
+		CONFIG_I2C_BITRATE = (1 << 3),
+		CONFIG_I2C_BUS_TIMEOUT = (1 << 4),
+		CONFIG_SPI_BITRATE = (1 << 5),
+		CONFIG_SPI_CONFIG = (1 << 6),
+		CONFIG_GPIO_PULLUP = (1 << 7),
+		CONFIG_GPIO_OUTPUT = (1 << 8),
+		CONFIG_GPIO_DIRECTION = (1 << 9),
+	};
+
+	/// Record a configuration request, and flush it unless a batch is open.
+	/// @pre The adapter lock is held.
+	/// @returns AA_OK, or the first error reported by the adapter.
+	int request_(uint16_t field) noexcept;
+
+	/// Issue commands for every requested field that differs from the applied value.
+	/// @pre The adapter lock is held.
+	/// @returns AA_OK, or the first error reported by the adapter.
+	int flush_() noexcept;
+
+	/// Issue the command for a single field.
+	/// @returns the Aardvark API result.
+	int apply_(uint16_t field) noexcept;
+
+	/// Check whether a field's requested value differs from the applied value.
+	bool differs_(uint16_t field) const noexcept;
+
   private:
 	/// The aardvark adapter lock.
-	std::mutex lock_{};
+	/// Recursive so that configuration functions can be called from within a locked region,
+	/// such as a bus master adjusting the bitrate or reconnecting mid-transfer.
+	std::recursive_mutex lock_{};
+
+	/// Serializes the adapter searches of concurrent reconnect() calls, and guards
+	/// found_handle_ and found_port_.
+	std::mutex reconnect_lock_{};
+
+	/// Incremented each time a reconnect() search finds the adapter.
+	std::atomic<uint32_t> generation_ = 0;
+
+	/// Handle opened by the last successful search, until a reconnect() installs it.
+	int found_handle_ = 0;
+
+	/// The port found_handle_ was opened on.
+	uint8_t found_port_ = 0;
+
+	/// The unique ID of the opened adapter, used to find it again after a reconnect.
+	uint32_t unique_id_ = 0;
+
+	/// Maximum time to spend in reconnect().
+	std::atomic<std::chrono::milliseconds> reconnect_timeout_{std::chrono::milliseconds(5000)};
+
+	/// Requested configuration.
+	aardvarkConfig requested_{};
+
+	/// Configuration last applied to the hardware.
+	aardvarkConfig applied_{};
+
+	/// Fields that have been requested at least once (configField bitmask).
+	uint16_t requested_fields_ = 0;
+
+	/// Fields whose applied_ value matches the hardware (configField bitmask).
+	uint16_t applied_fields_ = 0;
+
+	/// Nesting depth of beginConfig() calls.
+	int batch_depth_ = 0;
+
+	/// Number of configuration requests since the last flush.
+	uint32_t pending_requests_ = 0;
+
+	/// I2C bitrate reported by the adapter, in kHz.
+	int i2c_bitrate_actual_ = 0;
+
+	/// I2C bus timeout reported by the adapter, in ms.
+	int i2c_bus_timeout_actual_ = 0;
+
+	/// SPI bitrate reported by the adapter, in kHz.
+	int spi_bitrate_actual_ = 0;
+
+	/// Number of configuration commands sent to the adapter.
+	std::atomic<uint32_t> config_issued_ = 0;
+
+	/// Number of configuration requests that did not need a command.
+	std::atomic<uint32_t> config_elided_ = 0;
+
+	/// Number of successful reconnects.
+	std::atomic<uint32_t> reconnects_ = 0;
+
+	/// Number of reconnect attempts that timed out.
+	std::atomic<uint32_t> reconnect_failures_ = 0;
+
+	/// Recovery time of the last reconnect, in ms.
+	std::atomic<uint32_t> last_recovery_ms_ = 0;
+
+	/// Maximum recovery time, in ms.
+	std::atomic<uint32_t> max_recovery_ms_ = 0;
 
 	/// The USB port the adapter is connected to.
 	uint8_t port_;
 
-	/// Mask representing the pullups currently enabled.
-	uint8_t pullup_mask_ = 0;
-
 	/// The handle for the aardvark Adapter (provided by the aardvark API).
 	int handle_ = 0;
 
-	/// The currently configured Aardvark Adapter mode.
-	aardvarkMode mode_;
-
-	/// Reference count for the number of times this driver has been started.
+	/// Reference count of attach() calls.
 	/// Since multiple client drivers can be created, we don't want to stop the
 	/// aardvarkAdapter base until all client drivers have been stopped.
-	std::atomic<int> started_refcnt_ = 0;
+	/// Protected by the adapter lock, together with handle_.
+	int started_refcnt_ = 0;
+
+	/// Adapter lock counters.
+	std::atomic<uint32_t> lock_acquisitions_ = 0;
+	std::atomic<uint32_t> lock_contended_ = 0;
+	std::atomic<uint64_t> lock_wait_us_ = 0;
+	std::atomic<uint32_t> lock_max_wait_us_ = 0;
+
+	/// Protects the arbitration state.
+	mutable std::mutex arbiter_lock_{};
+
+	/// Signals waiting requests when the adapter is released.
+	std::condition_variable arbiter_cv_{};
 
-	/// Bitmask for GPIO input/output directions
-	uint8_t direction_mask_ = 0;
+	/// Deadlines and arrival tickets of the requests waiting for the adapter.
+	std::vector<std::pair<std::chrono::steady_clock::time_point, uint32_t>> waiters_{};
 
-	/// Bitmask for GPIO output settings
-	uint8_t output_mask_ = 0;
+	/// Next arrival ticket, used to keep requests with equal deadlines in FIFO order.
+	uint32_t ticket_ = 0;
+
+	/// True while the adapter is granted to a scheduled request.
+	bool granted_ = false;
+
+	/// Arbitration counters. Protected by arbiter_lock_.
+	uint32_t arbitration_waits_ = 0;
+	uint64_t arbitration_wait_us_ = 0;
+	uint32_t max_arbitration_wait_us_ = 0;
+	uint32_t max_waiters_ = 0;
+
+	/// Per-class latency counters.
+	struct latencyCounters
+	{
+		std::atomic<uint32_t> count{0};
+		std::atomic<uint32_t> deadline_misses{0};
+		std::atomic<uint64_t> total_us{0};
+		std::atomic<uint32_t> max_us{0};
+	};
+
+	/// Latency counters, indexed by aardvarkPriority.
+	std::array<latencyCounters, static_cast<size_t>(aardvarkPriority::count)> latency_{};
+
+	/// Per-target bus metrics.
+	aardvarkBusMetrics metrics_{};
+};
+
+/** Scoped configuration batch for an aardvarkAdapter
+ *
+ * Configuration changes made while the batch is alive are merged and applied when it is
+ * destroyed. See aardvarkAdapter::beginConfig().
+ */
+class aardvarkConfigBatch
+{
+  public:
+	/// Begin a configuration batch.
+	/// @param adapter The adapter to configure.
+	explicit aardvarkConfigBatch(aardvarkAdapter& adapter) noexcept : adapter_(adapter)
+	{
+		adapter_.beginConfig();
+	}
+
+	/// Apply the batched configuration changes.
+	~aardvarkConfigBatch() noexcept
+	{
+		adapter_.commitConfig();
+	}
+
+	aardvarkConfigBatch(const aardvarkConfigBatch&) = delete;
+	aardvarkConfigBatch& operator=(const aardvarkConfigBatch&) = delete;
+
+  private:
+	/// The adapter being configured.
+	aardvarkAdapter& adapter_;
 };
 
 /// @}
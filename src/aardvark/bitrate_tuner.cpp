@@ -0,0 +1,158 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/bitrate_tuner.hpp>
+#include <algorithm>
+#include <cassert>
+
+using namespace embdrv;
+
+constexpr uint64_t PPM = 1000000;
+
+uint32_t aardvarkBitrateTuner::reset(const config& cfg) noexcept
+{
+	assert(cfg.min_khz > 0 && cfg.min_khz <= cfg.max_khz);
+	assert(cfg.window > 0);
+
+	cfg_ = cfg;
+	stats_ = {};
+	current_khz_ = 0;
+	window_count_ = 0;
+	window_errors_ = 0;
+
+	// Optimistically probe the top of the range first: on a clean bus the search
+	// converges after a single window.
+	return search(cfg_.min_khz, cfg_.max_khz, cfg_.max_khz);
+}
+
+uint32_t aardvarkBitrateTuner::search(uint32_t lo, uint32_t hi, uint32_t probe) noexcept
+{
+	lo_khz_ = lo;
+	hi_khz_ = hi;
+	settled_ = false;
+	passing_windows_ = 0;
+
+	return select(probe);
+}
+
+uint32_t aardvarkBitrateTuner::select(uint32_t khz) noexcept
+{
+	requested_khz_ = khz;
+
+	if(khz == current_khz_)
+	{
+		return 0;
+	}
+
+	current_khz_ = khz;
+	stats_.adjustments++;
+
+	return khz;
+}
+
+void aardvarkBitrateTuner::applied(uint32_t khz) noexcept
+{
+	current_khz_ = khz;
+}
+
+uint32_t aardvarkBitrateTuner::record(bool error) noexcept
+{
+	if(cfg_.max_khz == 0)
+	{
+		return 0; // reset() has not been called
+	}
+
+	stats_.transactions++;
+	window_count_++;
+
+	if(error)
+	{
+		stats_.errors++;
+		window_errors_++;
+	}
+
+	if(window_count_ < cfg_.window)
+	{
+		return 0;
+	}
+
+	bool pass = (static_cast<uint64_t>(window_errors_) * PPM) <=
+				(static_cast<uint64_t>(cfg_.target_error_ppm) * window_count_);
+	window_count_ = 0;
+	window_errors_ = 0;
+
+	if(!pass)
+	{
+		stats_.failed_windows++;
+	}
+
+	if(settled_)
+	{
+		if(!pass)
+		{
+			if(current_khz_ <= cfg_.min_khz)
+			{
+				return 0; // Nowhere lower to go
+			}
+
+			// Step down one resolution unit first; keep bisecting if that fails too.
+			auto lower = std::max(cfg_.min_khz, current_khz_ - std::min(current_khz_, cfg_.resolution_khz));
+			return search(cfg_.min_khz, lower, lower);
+		}
+
+		passing_windows_++;
+
+		if(cfg_.reprobe_windows != 0 && passing_windows_ >= cfg_.reprobe_windows &&
+		   current_khz_ < cfg_.max_khz)
+		{
+			auto higher = std::min(cfg_.max_khz, current_khz_ + cfg_.resolution_khz);
+			return search(current_khz_, cfg_.max_khz, higher);
+		}
+
+		return 0;
+	}
+
+	return next(pass);
+}
+
+uint32_t aardvarkBitrateTuner::next(bool pass) noexcept
+{
+	if(pass)
+	{
+		if(current_khz_ > lo_khz_)
+		{
+			lo_khz_ = current_khz_;
+		}
+		else
+		{
+			// The adapter quantized our request down to a bitrate we already know passes.
+			// Shrink the upper bound instead so the search still makes progress.
+			hi_khz_ = (requested_khz_ > lo_khz_ + cfg_.resolution_khz)
+						  ? requested_khz_ - cfg_.resolution_khz
+						  : lo_khz_;
+		}
+	}
+	else
+	{
+		if(current_khz_ <= lo_khz_)
+		{
+			// The lower bound itself is failing and there is nowhere lower to search.
+			lo_khz_ = std::max(cfg_.min_khz, current_khz_);
+			hi_khz_ = lo_khz_;
+		}
+		else
+		{
+			hi_khz_ = std::max(lo_khz_, current_khz_ - std::min(current_khz_, cfg_.resolution_khz));
+		}
+	}
+
+	if(hi_khz_ <= lo_khz_ + cfg_.resolution_khz)
+	{
+		settled_ = true;
+		passing_windows_ = 0;
+		return select(lo_khz_);
+	}
+
+	// Bias the midpoint upward so the probe is never the (already known) lower bound.
+	return select(lo_khz_ + ((hi_khz_ - lo_khz_ + 1) / 2));
+}
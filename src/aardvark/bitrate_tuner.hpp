@@ -0,0 +1,154 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_BITRATE_TUNER_HPP_
+#define AARDVARK_BITRATE_TUNER_HPP_
+
+#include <cstdint>
+
+namespace embdrv
+{
+/** Automatic bus bitrate tuning based on the observed transaction error rate
+ *
+ * The tuner is fed the outcome of every bus transaction. Outcomes are grouped into
+ * fixed-size windows, and each window is judged against the target error rate.
+ *
+ * While searching, the tuner binary-searches the [min_khz, max_khz] range for the highest
+ * bitrate whose windows stay at or below the target error rate. Once the search converges,
+ * the tuner keeps monitoring: a failing window restarts the search below the current
+ * bitrate, and a long run of passing windows restarts the search above it.
+ *
+ * The tuner does not talk to the hardware. When record() returns a non-zero value, the
+ * owning driver applies that bitrate and reports the value the adapter actually selected
+ * through applied().
+ *
+ * This class is not thread-safe; the owning driver serializes access.
+ *
+ * @ingroup AardvarkDrivers
+ */
+class aardvarkBitrateTuner
+{
+  public:
+	/// Tuning parameters
+	struct config
+	{
+		/// Lowest bitrate the tuner is allowed to select, in kHz.
+		uint32_t min_khz;
+		/// Highest bitrate the tuner is allowed to select, in kHz.
+		uint32_t max_khz;
+		/// Maximum acceptable error rate, in errors per million transactions.
+		uint32_t target_error_ppm = 1000;
+		/// Number of transactions evaluated per decision window.
+		uint32_t window = 256;
+		/// The search stops once the bounds are closer than this value, in kHz.
+		uint32_t resolution_khz = 5;
+		/// Number of consecutive passing windows before probing for a higher bitrate.
+		/// Set to 0 to never probe upward after the initial search converges.
+		uint32_t reprobe_windows = 64;
+	};
+
+	/// Counters describing the tuner's activity
+	struct stats
+	{
+		/// Total transactions recorded.
+		uint32_t transactions;
+		/// Total errors recorded.
+		uint32_t errors;
+		/// Number of windows that exceeded the target error rate.
+		uint32_t failed_windows;
+		/// Number of bitrate changes requested.
+		uint32_t adjustments;
+	};
+
+	/// Default constructor. The tuner is inactive until reset() is called.
+	aardvarkBitrateTuner() noexcept = default;
+
+	/// Default destructor
+	~aardvarkBitrateTuner() noexcept = default;
+
+	/** Restart tuning with a new configuration
+	 *
+	 * @param cfg The tuning parameters to use.
+	 * @returns The bitrate (in kHz) the driver should apply to begin the search.
+	 */
+	uint32_t reset(const config& cfg) noexcept;
+
+	/** Record the outcome of a bus transaction
+	 *
+	 * @param error True if the transaction failed in a way that indicates a signal integrity
+	 *	problem (e.g. a NACK or bus error), false otherwise.
+	 * @returns The new bitrate (in kHz) to apply, or 0 if no change is requested.
+	 */
+	uint32_t record(bool error) noexcept;
+
+	/// Report the bitrate the adapter actually selected after a change was requested.
+	/// @param khz The bitrate reported by the adapter, in kHz.
+	void applied(uint32_t khz) noexcept;
+
+	/// Get the bitrate the tuner believes is currently applied.
+	/// @returns the current bitrate, in kHz.
+	uint32_t bitrate() const noexcept
+	{
+		return current_khz_;
+	}
+
+	/// Check whether the search has converged.
+	/// @returns true if the tuner is monitoring a settled bitrate, false while searching.
+	bool settled() const noexcept
+	{
+		return settled_;
+	}
+
+	/// Get the tuner's activity counters.
+	/// @returns a copy of the current counters.
+	stats statistics() const noexcept
+	{
+		return stats_;
+	}
+
+  private:
+	/// Narrow the search bounds using the last window result, then pick the next bitrate
+	/// to evaluate (or settle if the bounds have converged).
+	uint32_t next(bool pass) noexcept;
+
+	/// Begin a new search within the supplied bounds, evaluating the probe bitrate first.
+	uint32_t search(uint32_t lo, uint32_t hi, uint32_t probe) noexcept;
+
+	/// Switch to a new bitrate, returning the value to apply (or 0 if unchanged).
+	uint32_t select(uint32_t khz) noexcept;
+
+  private:
+	/// The active tuning parameters.
+	config cfg_{0, 0};
+
+	/// Lower search bound: the highest bitrate known to pass.
+	uint32_t lo_khz_ = 0;
+
+	/// Upper search bound: the highest bitrate that has not been proven to fail.
+	uint32_t hi_khz_ = 0;
+
+	/// The bitrate currently under evaluation (or the settled bitrate).
+	uint32_t current_khz_ = 0;
+
+	/// The bitrate most recently requested from the adapter.
+	uint32_t requested_khz_ = 0;
+
+	/// Transactions recorded in the current window.
+	uint32_t window_count_ = 0;
+
+	/// Errors recorded in the current window.
+	uint32_t window_errors_ = 0;
+
+	/// Consecutive passing windows while settled.
+	uint32_t passing_windows_ = 0;
+
+	/// True once the search has converged.
+	bool settled_ = false;
+
+	/// Activity counters.
+	stats stats_{};
+};
+
+} // namespace embdrv
+
+#endif // AARDVARK_BITRATE_TUNER_HPP_
@@ -0,0 +1,680 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_CORO_HPP_
+#define AARDVARK_CORO_HPP_
+
+/** @file
+ *
+ * C++20 coroutine interface for the Aardvark I2C and SPI masters.
+ *
+ * The rest of the driver set builds as C++17. Translation units that include this header must
+ * be compiled with coroutine support (e.g. -std=c++20).
+ *
+ * @code
+ * embdrv::aardvarkTask<uint8_t> readStatus(embdrv::aardvarkI2CMaster& i2c)
+ * {
+ *	uint8_t reg = 0x00;
+ *	uint8_t value = 0;
+ *	auto status = co_await embdrv::writeReadAsync(i2c, 0x40, &reg, 1, &value, 1);
+ *	co_return (status == embvm::i2c::status::ok) ? value : 0;
+ * }
+ * @endcode
+ *
+ * Awaiting a transfer submits it to the master and suspends the coroutine. The coroutine is
+ * resumed inline on the master's worker thread when the transfer completes, so a chain of
+ * dependent transfers does not need an extra queue hop per step. The worker thread is
+ * blocked while the coroutine runs: coroutines must not block between co_await points, and
+ * may only await aardvark transfers and other aardvarkTasks.
+ *
+ * A top-level task may be destroyed while it waits for a transfer. Its continuation is
+ * cancelled: the coroutine is not resumed, and its frame (including any buffers it lends to
+ * the transfer) is released when the transfer completes. Destroying a task while its
+ * coroutine runs on the worker thread waits until it suspends again.
+ *
+ * Coroutine frames are allocated from a fixed pool, never from the heap. The pool is sized
+ * with AARDVARK_CORO_FRAME_SIZE and AARDVARK_CORO_FRAME_COUNT. If a frame does not fit or the
+ * pool is exhausted, the returned task is invalid (aardvarkTask::valid() returns false).
+ */
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "aardvark/coro.hpp requires C++20 coroutine support (e.g. -std=c++20)"
+#endif
+
+#include "i2c.hpp"
+#include "spi.hpp"
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+/// Maximum size of a coroutine frame allocated from the default frame pool, in bytes.
+#ifndef AARDVARK_CORO_FRAME_SIZE
+#define AARDVARK_CORO_FRAME_SIZE 512
+#endif
+
+/// Number of coroutine frames in the default frame pool.
+#ifndef AARDVARK_CORO_FRAME_COUNT
+#define AARDVARK_CORO_FRAME_COUNT 16
+#endif
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/** Fixed-capacity allocator for coroutine frames
+ *
+ * @tparam TFrameSize The maximum size of a frame, in bytes.
+ * @tparam TFrameCount The number of frames in the pool.
+ */
+template<size_t TFrameSize, size_t TFrameCount>
+class aardvarkFramePool
+{
+  public:
+	/// Construct the pool with all frames free.
+	aardvarkFramePool() noexcept
+	{
+		for(size_t i = 0; i < TFrameCount; i++)
+		{
+			free_[i] = i;
+		}
+	}
+
+	/// Default destructor
+	~aardvarkFramePool() noexcept = default;
+
+	/// Allocate a frame.
+	/// @param size The required frame size, in bytes.
+	/// @returns a pointer to the frame, or nullptr if size is too large or the pool is exhausted.
+	/// Not inlined: GCC would see that frames point into the pool and report the frame
+	/// operator delete as freeing a non-heap object (-Wfree-nonheap-object).
+	[[gnu::noinline]] void* allocate(size_t size) noexcept
+	{
+		if(size > TFrameSize)
+		{
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(lock_);
+
+		if(free_count_ == 0)
+		{
+			return nullptr;
+		}
+
+		return frames_[free_[--free_count_]].bytes.data();
+	}
+
+	/// Return a frame to the pool.
+	/// @param p A frame previously returned by allocate().
+	void deallocate(void* p) noexcept
+	{
+		auto index = static_cast<size_t>(static_cast<frame*>(p) - frames_.data());
+		assert(index < TFrameCount);
+
+		std::lock_guard<std::mutex> lock(lock_);
+		free_[free_count_++] = index;
+	}
+
+  private:
+	/// Storage for a single frame.
+	struct alignas(std::max_align_t) frame
+	{
+		std::array<std::byte, TFrameSize> bytes;
+	};
+
+	/// Protects the free list.
+	std::mutex lock_;
+
+	/// Frame storage.
+	std::array<frame, TFrameCount> frames_{};
+
+	/// Indices of the free frames.
+	std::array<size_t, TFrameCount> free_{};
+
+	/// Number of valid entries in free_.
+	size_t free_count_ = TFrameCount;
+};
+
+/// Get the frame pool used by aardvarkTask.
+/// @returns the default coroutine frame pool.
+inline aardvarkFramePool<AARDVARK_CORO_FRAME_SIZE, AARDVARK_CORO_FRAME_COUNT>&
+	aardvarkCoroFramePool() noexcept
+{
+	static aardvarkFramePool<AARDVARK_CORO_FRAME_SIZE, AARDVARK_CORO_FRAME_COUNT> pool;
+	return pool;
+}
+
+template<typename T>
+class aardvarkTask;
+
+/** Resumption state of a task chain
+ *
+ * A chain is a top-level task and the tasks it awaits, directly or indirectly. At most one
+ * frame of a chain runs at a time, so a single state tells whether the chain is running,
+ * suspended on a transfer, or can be destroyed right away. The state lives in the
+ * top-level frame.
+ */
+struct aardvarkTaskChain
+{
+	/// Chain states
+	enum : uint8_t
+	{
+		/// Not started, finished, or suspended outside a transfer.
+		idle,
+		/// A frame of the chain is running.
+		running,
+		/// Suspended on a transfer.
+		pending,
+		/// The top-level task was destroyed while suspended on a transfer. The transfer
+		/// completion destroys the chain instead of resuming it.
+		abandoned,
+	};
+
+	/// The current state.
+	std::atomic<uint8_t> state{idle};
+
+	/// The top-level coroutine.
+	std::coroutine_handle<> root{};
+};
+
+/// Called from a transfer completion: resume the chain suspended on the transfer, or destroy
+/// it if its top-level task was destroyed in the meantime.
+/// @param chain The chain of the coroutine that awaited the transfer.
+/// @param h The coroutine that awaited the transfer.
+inline void aardvarkResumeChain(aardvarkTaskChain& chain, std::coroutine_handle<> h) noexcept
+{
+	uint8_t expected = aardvarkTaskChain::pending;
+
+	if(chain.state.compare_exchange_strong(expected, aardvarkTaskChain::running,
+										   std::memory_order_acq_rel))
+	{
+		h.resume();
+	}
+	else
+	{
+		assert(expected == aardvarkTaskChain::abandoned);
+
+		// The chain state lives in the frame being destroyed
+		auto root = chain.root;
+		root.destroy();
+	}
+}
+
+/// Promise members shared by all aardvarkTask result types.
+template<typename TTask>
+struct aardvarkPromiseBase
+{
+	/// Resumes the awaiting coroutine (if any) when the task finishes.
+	struct finalAwaiter
+	{
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		template<typename TPromise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> h) noexcept
+		{
+			auto continuation = h.promise().continuation;
+			if(continuation)
+			{
+				return continuation;
+			}
+
+			// A top-level task finished: the frame may be destroyed as soon as this is visible
+			h.promise().chain->state.store(aardvarkTaskChain::idle, std::memory_order_release);
+			return std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	static void* operator new(size_t size) noexcept
+	{
+		return aardvarkCoroFramePool().allocate(size);
+	}
+
+	static void operator delete(void* p) noexcept
+	{
+		aardvarkCoroFramePool().deallocate(p);
+	}
+
+	static TTask get_return_object_on_allocation_failure() noexcept
+	{
+		return TTask{};
+	}
+
+	std::suspend_always initial_suspend() const noexcept
+	{
+		return {};
+	}
+
+	finalAwaiter final_suspend() const noexcept
+	{
+		return {};
+	}
+
+	void unhandled_exception() const noexcept
+	{
+		std::terminate();
+	}
+
+	/// The coroutine awaiting this task.
+	std::coroutine_handle<> continuation{};
+
+	/// Chain state used while this task is the top-level task.
+	aardvarkTaskChain own_chain{};
+
+	/// The chain this task belongs to: own_chain, or the chain of the awaiting task.
+	aardvarkTaskChain* chain = &own_chain;
+};
+
+/// Promise type for tasks that produce a value.
+template<typename TTask, typename T>
+struct aardvarkPromise : aardvarkPromiseBase<TTask>
+{
+	TTask get_return_object() noexcept
+	{
+		auto h = std::coroutine_handle<aardvarkPromise>::from_promise(*this);
+		this->own_chain.root = h;
+		return TTask{h};
+	}
+
+	void return_value(T v) noexcept
+	{
+		value = std::move(v);
+	}
+
+	/// The result of the task.
+	T value{};
+};
+
+/// Promise type for tasks that do not produce a value.
+template<typename TTask>
+struct aardvarkPromise<TTask, void> : aardvarkPromiseBase<TTask>
+{
+	TTask get_return_object() noexcept
+	{
+		auto h = std::coroutine_handle<aardvarkPromise>::from_promise(*this);
+		this->own_chain.root = h;
+		return TTask{h};
+	}
+
+	void return_void() const noexcept {}
+};
+
+/** Lazily-started coroutine task
+ *
+ * A task does not run until it is awaited by another coroutine, or until start() is called
+ * on a top-level task. The task object owns the coroutine frame. If a top-level task is
+ * destroyed while it waits for a transfer, the frame is released once the transfer completes.
+ *
+ * @tparam T The result type of the coroutine.
+ */
+template<typename T = void>
+class aardvarkTask
+{
+  public:
+	using promise_type = aardvarkPromise<aardvarkTask, T>;
+
+	/// Awaiter returned by operator co_await.
+	struct awaiter
+	{
+		std::coroutine_handle<promise_type> handle;
+
+		bool await_ready() const noexcept
+		{
+			return !handle || handle.done();
+		}
+
+		template<typename TPromise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> awaiting) noexcept
+		{
+			// The awaited task joins the chain of the awaiting task
+			handle.promise().continuation = awaiting;
+			handle.promise().chain = awaiting.promise().chain;
+			return handle;
+		}
+
+		T await_resume() const noexcept
+		{
+			assert(handle && "Awaited a task whose frame could not be allocated");
+
+			if constexpr(!std::is_void_v<T>)
+			{
+				return std::move(handle.promise().value);
+			}
+		}
+	};
+
+	/// Construct an invalid task.
+	aardvarkTask() noexcept = default;
+
+	/// Construct a task from a coroutine handle.
+	explicit aardvarkTask(std::coroutine_handle<promise_type> h) noexcept : handle_(h) {}
+
+	aardvarkTask(aardvarkTask&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+	aardvarkTask& operator=(aardvarkTask&& other) noexcept
+	{
+		if(this != &other)
+		{
+			destroy();
+			handle_ = std::exchange(other.handle_, {});
+		}
+
+		return *this;
+	}
+
+	aardvarkTask(const aardvarkTask&) = delete;
+	aardvarkTask& operator=(const aardvarkTask&) = delete;
+
+	/// Destroys the coroutine frame, or cancels its continuation if it waits for a transfer.
+	~aardvarkTask() noexcept
+	{
+		destroy();
+	}
+
+	/// Check whether the coroutine frame was allocated.
+	/// @returns false if the frame pool could not satisfy the allocation.
+	bool valid() const noexcept
+	{
+		return static_cast<bool>(handle_);
+	}
+
+	/// Run a top-level task until its first suspension point.
+	/// @pre The task is valid and has not been started.
+	void start() noexcept
+	{
+		assert(valid());
+		handle_.promise().chain->state.store(aardvarkTaskChain::running, std::memory_order_relaxed);
+		handle_.resume();
+	}
+
+	/// Check whether the coroutine has finished.
+	bool done() const noexcept
+	{
+		return handle_ &&
+			   handle_.promise().chain->state.load(std::memory_order_acquire) ==
+				   aardvarkTaskChain::idle &&
+			   handle_.done();
+	}
+
+	/// Get the task's result.
+	/// @pre done() returns true.
+	template<typename U = T>
+	std::enable_if_t<!std::is_void_v<U>, const U&> result() const noexcept
+	{
+		assert(done());
+		return handle_.promise().value;
+	}
+
+	/// Awaiting a task starts it and resumes the awaiting coroutine when it finishes.
+	awaiter operator co_await() const noexcept
+	{
+		return awaiter{handle_};
+	}
+
+  private:
+	void destroy() noexcept
+	{
+		if(!handle_)
+		{
+			return;
+		}
+
+		auto& promise = handle_.promise();
+
+		// Awaited tasks are destroyed by their parent frame, never while their chain runs
+		if(promise.chain == &promise.own_chain)
+		{
+			auto& state = promise.own_chain.state;
+			auto s = state.load(std::memory_order_acquire);
+
+			while(true)
+			{
+				if(s == aardvarkTaskChain::pending)
+				{
+					if(state.compare_exchange_weak(s, aardvarkTaskChain::abandoned,
+												   std::memory_order_acq_rel))
+					{
+						// The transfer completion destroys the frame
+						handle_ = {};
+						return;
+					}
+				}
+				else if(s == aardvarkTaskChain::running)
+				{
+					std::this_thread::yield();
+					s = state.load(std::memory_order_acquire);
+				}
+				else
+				{
+					break;
+				}
+			}
+		}
+
+		handle_.destroy();
+		handle_ = {};
+	}
+
+  private:
+	/// The owned coroutine.
+	std::coroutine_handle<promise_type> handle_{};
+};
+
+/** Awaitable single transfer on an Aardvark bus master
+ *
+ * @tparam TMaster aardvarkI2CMaster or aardvarkSPIMaster.
+ * @tparam TOp The master's op type.
+ * @tparam TStatus The master's status type.
+ */
+template<typename TMaster, typename TOp, typename TStatus>
+class aardvarkTransferAwaiter
+{
+  public:
+	/** Prepare a transfer
+	 *
+	 * @param master The master that performs the transfer.
+	 * @param op The transfer. Buffers must remain valid until the transfer completes.
+	 * @param schedule The scheduling parameters for the transfer.
+	 */
+	aardvarkTransferAwaiter(TMaster& master, const TOp& op, const aardvarkSchedule& schedule) noexcept
+		: master_(master), op_(op), schedule_(schedule)
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	template<typename TPromise>
+	void await_suspend(std::coroutine_handle<TPromise> h) noexcept
+	{
+		handle_ = h;
+		chain_ = h.promise().chain;
+		chain_->state.store(aardvarkTaskChain::pending, std::memory_order_release);
+
+		// Nothing may touch *this after submitting: the completion callback can resume the
+		// coroutine (and destroy this awaiter) before transfer() returns.
+		master_.transfer(op_, schedule_, [this](TOp op, TStatus status) {
+			(void)op;
+			status_ = status;
+			aardvarkResumeChain(*chain_, handle_);
+		});
+	}
+
+	TStatus await_resume() const noexcept
+	{
+		return status_;
+	}
+
+  private:
+	TMaster& master_;
+	const TOp op_;
+	const aardvarkSchedule schedule_;
+	std::coroutine_handle<> handle_{};
+	aardvarkTaskChain* chain_ = nullptr;
+	TStatus status_{};
+};
+
+/// Result of an awaited batch of transfers.
+template<typename TStatus>
+struct aardvarkBatchResult
+{
+	/// Status of the last transfer attempted.
+	TStatus status;
+	/// Number of transfers that completed successfully.
+	size_t completed;
+};
+
+/** Awaitable batch of transfers on an Aardvark bus master
+ *
+ * @tparam TMaster aardvarkI2CMaster or aardvarkSPIMaster.
+ * @tparam TOp The master's op type.
+ * @tparam TStatus The master's status type.
+ */
+template<typename TMaster, typename TOp, typename TStatus>
+class aardvarkBatchAwaiter
+{
+  public:
+	/** Prepare a batch
+	 *
+	 * @param master The master that performs the batch.
+	 * @param ops The transfers. Must remain valid until the batch completes.
+	 * @param count The number of transfers in ops.
+	 * @param schedule The scheduling parameters for the batch.
+	 */
+	aardvarkBatchAwaiter(TMaster& master, const TOp* ops, size_t count,
+						 const aardvarkSchedule& schedule) noexcept
+		: master_(master), ops_(ops), count_(count), schedule_(schedule)
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	template<typename TPromise>
+	void await_suspend(std::coroutine_handle<TPromise> h) noexcept
+	{
+		handle_ = h;
+		chain_ = h.promise().chain;
+		chain_->state.store(aardvarkTaskChain::pending, std::memory_order_release);
+
+		master_.transfer(
+			ops_, count_,
+			[this](TStatus status, size_t completed) {
+				result_ = {status, completed};
+				aardvarkResumeChain(*chain_, handle_);
+			},
+			schedule_);
+	}
+
+	aardvarkBatchResult<TStatus> await_resume() const noexcept
+	{
+		return result_;
+	}
+
+  private:
+	TMaster& master_;
+	const TOp* ops_;
+	const size_t count_;
+	const aardvarkSchedule schedule_;
+	std::coroutine_handle<> handle_{};
+	aardvarkTaskChain* chain_ = nullptr;
+	aardvarkBatchResult<TStatus> result_{};
+};
+
+/// Awaitable I2C transaction.
+using aardvarkI2CAwaiter =
+	aardvarkTransferAwaiter<aardvarkI2CMaster, embvm::i2c::op_t, embvm::i2c::status>;
+
+/// Awaitable SPI transfer.
+using aardvarkSPIAwaiter =
+	aardvarkTransferAwaiter<aardvarkSPIMaster, embvm::spi::op_t, embvm::comm::status>;
+
+/// Awaitable batch of I2C transactions.
+using aardvarkI2CBatchAwaiter =
+	aardvarkBatchAwaiter<aardvarkI2CMaster, embvm::i2c::op_t, embvm::i2c::status>;
+
+/// Awaitable batch of SPI transfers.
+using aardvarkSPIBatchAwaiter =
+	aardvarkBatchAwaiter<aardvarkSPIMaster, embvm::spi::op_t, embvm::comm::status>;
+
+/// Awaitable scatter-gather SPI transfer. The result reports the number of bytes transferred.
+using aardvarkSPIVectorAwaiter =
+	aardvarkBatchAwaiter<aardvarkSPIMaster, aardvarkSPISegment, embvm::comm::status>;
+
+/// co_await an I2C transaction.
+inline aardvarkI2CAwaiter transferAsync(aardvarkI2CMaster& i2c, const embvm::i2c::op_t& op,
+										const aardvarkSchedule& schedule = {}) noexcept
+{
+	return {i2c, op, schedule};
+}
+
+/// co_await an I2C write followed by a repeated-start read.
+inline aardvarkI2CAwaiter writeReadAsync(aardvarkI2CMaster& i2c, uint8_t address,
+										 const uint8_t* tx, size_t tx_size, uint8_t* rx,
+										 size_t rx_size,
+										 const aardvarkSchedule& schedule = {}) noexcept
+{
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::writeRead;
+	op.address = address;
+	op.tx_buffer = tx;
+	op.tx_size = tx_size;
+	op.rx_buffer = rx;
+	op.rx_size = rx_size;
+
+	return {i2c, op, schedule};
+}
+
+/// co_await a batch of I2C transactions.
+inline aardvarkI2CBatchAwaiter transferAsync(aardvarkI2CMaster& i2c, const embvm::i2c::op_t* ops,
+											 size_t count,
+											 const aardvarkSchedule& schedule = {}) noexcept
+{
+	return {i2c, ops, count, schedule};
+}
+
+/// co_await an SPI transfer.
+inline aardvarkSPIAwaiter transferAsync(aardvarkSPIMaster& spi, const embvm::spi::op_t& op,
+										const aardvarkSchedule& schedule = {}) noexcept
+{
+	return {spi, op, schedule};
+}
+
+/// co_await a batch of SPI transfers.
+inline aardvarkSPIBatchAwaiter transferAsync(aardvarkSPIMaster& spi, const embvm::spi::op_t* ops,
+											 size_t count,
+											 const aardvarkSchedule& schedule = {}) noexcept
+{
+	return {spi, ops, count, schedule};
+}
+
+/// co_await a scatter-gather SPI transfer.
+inline aardvarkSPIVectorAwaiter transferAsync(aardvarkSPIMaster& spi,
+											  const aardvarkSPISegment* segments, size_t count,
+											  const aardvarkSchedule& schedule = {}) noexcept
+{
+	return {spi, segments, count, schedule};
+}
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_CORO_HPP_
@@ -23,7 +23,6 @@ aardvarkGPIO::aardvarkGPIO(aardvarkAdapter& master, uint8_t pin, gpio::mode mode
 void aardvarkGPIO::set(bool v) noexcept
 {
 	master_.setGPIOOutput(pin_, v);
-	output_ = v;
 }
 
 bool aardvarkGPIO::get() noexcept
@@ -33,7 +32,7 @@ bool aardvarkGPIO::get() noexcept
 
 void aardvarkGPIO::toggle() noexcept
 {
-	set(!output_);
+	master_.toggleGPIO(pin_);
 }
 
 void aardvarkGPIO::setMode(embvm::gpio::mode mode) noexcept
@@ -48,12 +47,12 @@ embvm::gpio::mode aardvarkGPIO::mode() noexcept
 
 void aardvarkGPIO::aardvarkGPIO::start_() noexcept
 {
-	master_.start();
+	master_.attach();
 	setMode(mode_);
 }
 
 void aardvarkGPIO::aardvarkGPIO::stop_() noexcept
 {
 	setMode(gpio::mode::input);
-	master_.stop();
+	master_.detach();
 }
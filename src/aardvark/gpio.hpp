@@ -65,10 +65,6 @@ class aardvarkGPIO final : public embvm::gpio::base
 
 	/// Currently configured GPIO mode
 	embvm::gpio::mode mode_;
-
-	/// Currently configured output state (high/low)
-	/// A toggle API isn't provided, so we manually track this for the toggle() implementation.
-	bool output_ = false;
 };
 
 } // namespace embdrv
@@ -3,6 +3,7 @@
 
 #include "vendor/aardvark.h"
 #include <aardvark/i2c.hpp>
+#include <algorithm>
 
 using namespace embdrv;
 
@@ -15,7 +16,23 @@ static embvm::i2c::status convertI2CTransactionErrorCode(int r) noexcept
 
 	if(r > 0)
 	{
-		status = embvm::i2c::status::ok;
+		// The *_ext and write_read APIs report an AardvarkI2cStatus code
+		switch(r)
+		{
+			case AA_I2C_STATUS_SLA_NACK:
+				status = embvm::i2c::status::addrNACK;
+				break;
+			case AA_I2C_STATUS_DATA_NACK:
+				status = embvm::i2c::status::dataNACK;
+				break;
+			case AA_I2C_STATUS_BUS_ERROR:
+			case AA_I2C_STATUS_ARB_LOST:
+			case AA_I2C_STATUS_BUS_LOCKED:
+				status = embvm::i2c::status::bus;
+				break;
+			default:
+				status = embvm::i2c::status::error;
+		}
 	}
 	else
 	{
@@ -41,6 +58,11 @@ static embvm::i2c::status convertI2CTransactionErrorCode(int r) noexcept
 			case AA_I2C_BUS_ALREADY_FREE:
 				status = embvm::i2c::status::bus;
 				break;
+			case AA_COMMUNICATION_ERROR:
+			case AA_INVALID_HANDLE:
+				// The adapter was reconnected but the transaction was not repeated
+				status = embvm::i2c::status::error;
+				break;
 			default:
 				status = embvm::i2c::status::unknown;
 		}
@@ -49,16 +71,75 @@ static embvm::i2c::status convertI2CTransactionErrorCode(int r) noexcept
 	return status;
 }
 
+/// Check whether a transaction result points to a signal integrity problem on the bus.
+/// Address NACKs are not counted: absent devices and EEPROM write-cycle ack polling
+/// produce them on a healthy bus.
+static bool isBusError(embvm::i2c::status status) noexcept
+{
+	switch(status)
+	{
+		case embvm::i2c::status::dataNACK:
+		case embvm::i2c::status::bus:
+		case embvm::i2c::status::error:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/// Check whether a failed transaction is worth retrying.
+static bool isRetryable(embvm::i2c::status status) noexcept
+{
+	return status == embvm::i2c::status::busy || status == embvm::i2c::status::bus ||
+		   status == embvm::i2c::status::error;
+}
+
+/** Check whether a transaction can be issued again after the adapter was reconnected
+ *
+ * The connection may drop after a transaction reached the bus, so only transactions that
+ * leave the target unchanged are repeated. A writeRead is accepted when its write is short
+ * enough to be a register address.
+ */
+static bool isRepeatable(const embvm::i2c::op_t& op) noexcept
+{
+	switch(op.op)
+	{
+		case embvm::i2c::operation::read:
+		case embvm::i2c::operation::ping:
+		case embvm::i2c::operation::stop:
+		case embvm::i2c::operation::restart:
+			return true;
+		case embvm::i2c::operation::writeRead:
+			return op.tx_size <= 2;
+		default:
+			return false;
+	}
+}
+
+/// Compute the backoff delay before the next attempt.
+static std::chrono::milliseconds retryDelay(const aardvarkI2CRetryPolicy& policy,
+											uint8_t attempt) noexcept
+{
+	auto delay = policy.backoff;
+
+	for(uint8_t i = 1; i < attempt && delay < policy.max_backoff; i++)
+	{
+		delay *= policy.backoff_multiplier;
+	}
+
+	return std::min(delay, policy.max_backoff);
+}
+
 aardvarkI2CMaster::~aardvarkI2CMaster() noexcept = default;
 
 void aardvarkI2CMaster::start_() noexcept
 {
-	base_driver_.start();
+	base_driver_.attach();
 }
 
 void aardvarkI2CMaster::stop_() noexcept
 {
-	base_driver_.stop();
+	base_driver_.detach();
 }
 
 embvm::i2c::pullups aardvarkI2CMaster::setPullups_(embvm::i2c::pullups pullups) noexcept
@@ -70,15 +151,11 @@ embvm::i2c::pullups aardvarkI2CMaster::setPullups_(embvm::i2c::pullups pullups)
 	return pullups;
 }
 
-void aardvarkI2CMaster::process_(const storagePair_t& pair) noexcept
+int aardvarkI2CMaster::execute_(const embvm::i2c::op_t& op) noexcept
 {
-	const auto& [op, cb] = pair;
 	int r = AA_OK;
 	uint16_t num_written = 0;
 	uint16_t num_read = 0;
-	embvm::i2c::status status;
-
-	std::unique_lock<aardvarkAdapter> lock(base_driver_);
 
 	switch(op.op)
 	{
@@ -86,20 +163,20 @@ void aardvarkI2CMaster::process_(const storagePair_t& pair) noexcept
 		case embvm::i2c::operation::write: {
 			r = aa_i2c_write_ext(base_driver_.handle(), op.address, AA_I2C_NO_FLAGS,
 								 static_cast<uint16_t>(op.tx_size), op.tx_buffer, &num_written);
-			assert(op.tx_size == num_written);
+			assert(r != AA_I2C_STATUS_OK || op.tx_size == num_written);
 			break;
 		}
 		case embvm::i2c::operation::writeNoStop:
 		case embvm::i2c::operation::continueWriteNoStop: {
 			r = aa_i2c_write_ext(base_driver_.handle(), op.address, AA_I2C_NO_STOP,
 								 static_cast<uint16_t>(op.tx_size), op.tx_buffer, &num_written);
-			assert(op.tx_size == num_written);
+			assert(r != AA_I2C_STATUS_OK || op.tx_size == num_written);
 			break;
 		}
 		case embvm::i2c::operation::read: {
 			r = aa_i2c_read_ext(base_driver_.handle(), op.address, AA_I2C_NO_FLAGS,
 								static_cast<uint16_t>(op.rx_size), op.rx_buffer, &num_read);
-			assert(op.rx_size == num_read);
+			assert(r != AA_I2C_STATUS_OK || op.rx_size == num_read);
 			break;
 		}
 		case embvm::i2c::operation::writeRead: {
@@ -107,11 +184,11 @@ void aardvarkI2CMaster::process_(const storagePair_t& pair) noexcept
 								  static_cast<uint16_t>(op.tx_size), op.tx_buffer, &num_written,
 								  static_cast<uint16_t>(op.rx_size), op.rx_buffer, &num_read);
 
-			assert(num_written == op.tx_size);
-			assert(num_read == op.rx_size);
+			assert(r != AA_I2C_STATUS_OK || num_written == op.tx_size);
+			assert(r != AA_I2C_STATUS_OK || num_read == op.rx_size);
 
 			// We will use read status for our return value
-			r = (r >> 8) & 0xff; // NOLINT
+			r = (r < 0) ? r : ((r >> 8) & 0xff); // NOLINT
 			// Unused, but here is how you parse: int write_status = (r & 0xff);
 			break;
 		}
@@ -121,10 +198,18 @@ void aardvarkI2CMaster::process_(const storagePair_t& pair) noexcept
 								reinterpret_cast<uint8_t*>(&num_written), &num_read);
 
 			// If we don't read any data, we didn't get an ACK
-			if(num_read == 0)
+			if(aardvarkAdapter::connectionLost(r))
+			{
+				break;
+			}
+			else if(num_read == 0)
 			{
 				r = AA_I2C_WRITE_ERROR;
 			}
+			else
+			{
+				r = AA_OK;
+			}
 
 			break;
 		}
@@ -135,33 +220,251 @@ void aardvarkI2CMaster::process_(const storagePair_t& pair) noexcept
 			break; // Fallthrough - we set AA_OK above
 	}
 
-	status = convertI2CTransactionErrorCode(r);
+	return r;
+}
+
+embvm::i2c::status aardvarkI2CMaster::perform_(const embvm::i2c::op_t& op) noexcept
+{
+	auto start = std::chrono::steady_clock::now();
+	int r = execute_(op);
+
+	if(aardvarkAdapter::connectionLost(r) && base_driver_.reconnect() && isRepeatable(op))
+	{
+		// The adapter came back with its configuration restored: try once more
+		start = std::chrono::steady_clock::now();
+		r = execute_(op);
+	}
+
+	auto status = convertI2CTransactionErrorCode(r);
+
+	base_driver_.metrics().recordI2C(
+		op.address, status, (status == embvm::i2c::status::ok) ? op.tx_size + op.rx_size : 0,
+		std::chrono::steady_clock::now() - start);
+
+	if(autotune_)
+	{
+		auto khz = tuner_.record(isBusError(status));
+		if(khz)
+		{
+			auto set_bitrate = base_driver_.i2cBitrate(static_cast<int>(khz));
+			if(set_bitrate > 0)
+			{
+				tuner_.applied(static_cast<uint32_t>(set_bitrate));
+			}
+		}
+	}
+
+	return status;
+}
+
+void aardvarkI2CMaster::process_(const aardvarkQueueToken& token) noexcept
+{
+	(void)token;
+
+	// Retries waiting out their backoff stay in the queue, so other ready work runs first
+	auto req = queue_.pop();
+
+	if(req.batch != nullptr)
+	{
+		processBatch_(req);
+		return;
+	}
+
+	const auto& op = req.op;
+
+	aardvarkBusLock bus(base_driver_, req.timing.deadline);
+	std::unique_lock<aardvarkBusLock> lock(bus);
+
+	auto status = perform_(op);
+
+	if(isRetryable(status) && (req.attempt + 1) < req.policy.max_attempts)
+	{
+		// Only a stuck bus is helped by clocking out bus-clear pulses
+		if(req.policy.bus_clear && status == embvm::i2c::status::bus)
+		{
+			aa_i2c_free_bus(base_driver_.handle());
+			bus_clears_++;
+		}
+
+		lock.unlock();
+
+		req.attempt++;
+		req.timing.not_before =
+			std::chrono::steady_clock::now() + retryDelay(req.policy, req.attempt);
+		retries_++;
+		queue_.defer(std::move(req));
+		enqueue(aardvarkQueueToken{});
+		return;
+	}
+
 	lock.unlock();
 
-	callback(op, status, cb);
+	if(req.attempt > 0)
+	{
+		if(status == embvm::i2c::status::ok)
+		{
+			recovered_++;
+		}
+		else if(isRetryable(status))
+		{
+			exhausted_++;
+		}
+	}
+
+	base_driver_.recordLatency(req.timing.priority, req.timing.submitted, req.timing.deadline);
+
+	callback(op, status, req.cb);
+}
+
+void aardvarkI2CMaster::processBatch_(const aardvarkI2CRequest& req) noexcept
+{
+	auto status = embvm::i2c::status::ok;
+	size_t completed = 0;
+
+	aardvarkBusLock bus(base_driver_, req.timing.deadline);
+	bus.lock();
+
+	for(; completed < req.batch_count; completed++)
+	{
+		status = perform_(req.batch[completed]);
+		if(status != embvm::i2c::status::ok)
+		{
+			break;
+		}
+	}
+
+	bus.unlock();
+
+	base_driver_.recordLatency(req.timing.priority, req.timing.submitted, req.timing.deadline);
+
+	if(req.batch_cb)
+	{
+		req.batch_cb(status, completed);
+	}
 }
 
 embvm::i2c::status aardvarkI2CMaster::transfer_(const embvm::i2c::op_t& op,
 												const embvm::i2c::master::cb_t& cb) noexcept
 {
-	enqueue({op, cb});
+	policy_lock_.lock();
+	auto policy = default_policy_;
+	policy_lock_.unlock();
+
+	return transfer(op, aardvarkSchedule{}, policy, cb);
+}
+
+embvm::i2c::status aardvarkI2CMaster::transfer(const embvm::i2c::op_t& op,
+											   const aardvarkI2CRetryPolicy& policy,
+											   const embvm::i2c::master::cb_t& cb) noexcept
+{
+	return transfer(op, aardvarkSchedule{}, policy, cb);
+}
+
+embvm::i2c::status aardvarkI2CMaster::transfer(const embvm::i2c::op_t& op,
+											   const aardvarkSchedule& schedule,
+											   const embvm::i2c::master::cb_t& cb) noexcept
+{
+	policy_lock_.lock();
+	auto policy = default_policy_;
+	policy_lock_.unlock();
+
+	return transfer(op, schedule, policy, cb);
+}
+
+embvm::i2c::status aardvarkI2CMaster::transfer(const embvm::i2c::op_t& op,
+											   const aardvarkSchedule& schedule,
+											   const aardvarkI2CRetryPolicy& policy,
+											   const embvm::i2c::master::cb_t& cb) noexcept
+{
+	assert(policy.max_attempts > 0);
+
+	aardvarkI2CRequest req{};
+	req.op = op;
+	req.cb = cb;
+	req.policy = policy;
+	aardvarkRequestQueue<aardvarkI2CRequest>::stamp(req.timing, schedule);
+
+	queue_.push(std::move(req));
+	enqueue(aardvarkQueueToken{});
+
+	return embvm::i2c::status::enqueued;
+}
+
+embvm::i2c::status aardvarkI2CMaster::transfer(const embvm::i2c::op_t* ops, size_t count,
+											   const aardvarkI2CBatchCb& cb,
+											   const aardvarkSchedule& schedule) noexcept
+{
+	assert(ops != nullptr && count > 0);
+
+	aardvarkI2CRequest req{};
+	req.batch = ops;
+	req.batch_count = count;
+	req.batch_cb = cb;
+	aardvarkRequestQueue<aardvarkI2CRequest>::stamp(req.timing, schedule);
+
+	queue_.push(std::move(req));
+	enqueue(aardvarkQueueToken{});
 
 	return embvm::i2c::status::enqueued;
 }
 
+void aardvarkI2CMaster::retryPolicy(const aardvarkI2CRetryPolicy& policy) noexcept
+{
+	assert(policy.max_attempts > 0);
+
+	std::lock_guard<std::mutex> lock(policy_lock_);
+	default_policy_ = policy;
+}
+
+aardvarkI2CRetryStats aardvarkI2CMaster::retryStats() const noexcept
+{
+	return {retries_.load(std::memory_order_relaxed), recovered_.load(std::memory_order_relaxed),
+			exhausted_.load(std::memory_order_relaxed), bus_clears_.load(std::memory_order_relaxed)};
+}
+
 embvm::i2c::baud aardvarkI2CMaster::baudrate_(embvm::i2c::baud baud) noexcept
 {
 	assert(started_ && "Setting baudrate before starting not supported\n");
 
 	base_driver_.lock();
-	auto set_bitrate = aa_i2c_bitrate(
-		base_driver_.handle(), static_cast<int>(baud) / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR);
+	// An explicit bitrate request overrides automatic tuning
+	autotune_ = false;
+	auto set_bitrate =
+		base_driver_.i2cBitrate(static_cast<int>(baud) / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR);
 	base_driver_.unlock();
 
-	assert(set_bitrate == (static_cast<int>(baud) / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR));
-	// TODO: tolerance checks
+	// The adapter selects the closest bitrate it supports, which may differ from the request.
+	// Report the bitrate that is actually in effect.
+	assert(set_bitrate > 0 && "Failed to set I2C bitrate");
+
+	return static_cast<embvm::i2c::baud>(static_cast<uint32_t>(set_bitrate) *
+										 INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR);
+}
+
+void aardvarkI2CMaster::autoTuneBitrate(const aardvarkBitrateTuner::config& cfg) noexcept
+{
+	assert(started_ && "Enabling bitrate tuning before starting not supported\n");
+
+	std::lock_guard<aardvarkAdapter> lock(base_driver_);
+
+	auto khz = tuner_.reset(cfg);
+	auto set_bitrate = base_driver_.i2cBitrate(static_cast<int>(khz));
+	assert(set_bitrate > 0 && "Failed to set I2C bitrate");
+	tuner_.applied(static_cast<uint32_t>(set_bitrate));
 
-	return baud;
+	autotune_ = true;
+}
+
+void aardvarkI2CMaster::disableBitrateAutoTune() noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(base_driver_);
+	autotune_ = false;
+}
+
+aardvarkBitrateTuner::stats aardvarkI2CMaster::bitrateTunerStats() noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(base_driver_);
+	return tuner_.statistics();
 }
 
 void aardvarkI2CMaster::configure_(embvm::i2c::pullups pullup) noexcept
@@ -169,9 +472,7 @@ void aardvarkI2CMaster::configure_(embvm::i2c::pullups pullup) noexcept
 	(void)pullup;
 	assert(started_ && "Configuring before starting not supported\n");
 
-	base_driver_.lock();
-	auto timeout = aa_i2c_bus_timeout(base_driver_.handle(), bus_timeout_ms);
-	base_driver_.unlock();
+	auto timeout = base_driver_.i2cBusTimeout(bus_timeout_ms);
 
 	assert(timeout == bus_timeout_ms);
 }
@@ -5,12 +5,81 @@
 #define AARDVARK_I2C_DRIVER_HPP_
 
 #include "base.hpp"
+#include "bitrate_tuner.hpp"
+#include "schedule.hpp"
 #include <active_object/active_object.hpp>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <driver/i2c.hpp>
+#include <functional>
 
 namespace embdrv
 {
+/** Retry policy for Aardvark I2C transactions
+ *
+ * Transactions that fail with embvm::i2c::status::busy, bus, or error are retried
+ * according to this policy. Retries are re-queued behind other pending work, so a
+ * failing transaction does not stall the transactions queued after it.
+ *
+ * @ingroup AardvarkDrivers
+ */
+struct aardvarkI2CRetryPolicy
+{
+	/// Total number of attempts, including the first. 1 disables retries.
+	uint8_t max_attempts = 1;
+	/// Delay before the first retry.
+	std::chrono::milliseconds backoff{1};
+	/// The backoff delay is multiplied by this factor after every retry.
+	uint8_t backoff_multiplier = 2;
+	/// Upper limit for the backoff delay.
+	std::chrono::milliseconds max_backoff{100};
+	/// Issue a bus clear (aa_i2c_free_bus) before retrying after a bus status.
+	bool bus_clear = true;
+};
+
+/// Counters describing the retry activity of an aardvarkI2CMaster
+/// @ingroup AardvarkDrivers
+struct aardvarkI2CRetryStats
+{
+	/// Number of retry attempts scheduled.
+	uint32_t retries;
+	/// Number of transactions that succeeded after at least one retry.
+	uint32_t recovered;
+	/// Number of transactions that failed after exhausting their attempts.
+	uint32_t exhausted;
+	/// Number of bus clears issued.
+	uint32_t bus_clears;
+};
+
+/// Completion callback for a batch of I2C transactions.
+/// Receives the status of the last transaction attempted and the number of transactions
+/// that completed successfully.
+/// @ingroup AardvarkDrivers
+using aardvarkI2CBatchCb = std::function<void(embvm::i2c::status, size_t)>;
+
+/// An I2C transaction request, as stored in the aardvarkI2CMaster queue.
+/// @ingroup AardvarkDrivers
+struct aardvarkI2CRequest
+{
+	/// Scheduling information for this transaction.
+	aardvarkRequestTiming timing;
+	/// The transaction to perform.
+	embvm::i2c::op_t op;
+	/// The callback to invoke once the transaction completes.
+	embvm::i2c::master::cb_t cb;
+	/// Retry policy for this transaction.
+	aardvarkI2CRetryPolicy policy;
+	/// Number of attempts already made.
+	uint8_t attempt = 0;
+	/// Transactions to perform back-to-back, or nullptr for a single transaction (op).
+	const embvm::i2c::op_t* batch = nullptr;
+	/// Number of transactions in batch.
+	size_t batch_count = 0;
+	/// The callback to invoke once the batch completes.
+	aardvarkI2CBatchCb batch_cb;
+};
+
 /** Create an Aardvark I2C Master Driver
  *
  * This driver requires an aardvarkAdapter to work. The aardvark adapter must be
@@ -23,16 +92,34 @@ namespace embdrv
  * embdrv::aardvarkI2CMaster i2c0{aardvark};
  * @endcode
  *
+ * Instead of fixing the bitrate with baudrate(), the driver can search for the highest bitrate
+ * that keeps the data NACK/bus error rate below a target, and keep adjusting it during operation:
+ *
+ * @code
+ * i2c0.start();
+ * i2c0.autoTuneBitrate({10, 800});
+ * @endcode
+ *
+ * Transient failures can be retried automatically, either for every transaction or per call:
+ *
+ * @code
+ * i2c0.retryPolicy({3, std::chrono::milliseconds(2)});
+ * i2c0.transfer(op, {5, std::chrono::milliseconds(10)}, cb);
+ * @endcode
+ *
+ * Queued transactions are dispatched earliest-deadline-first, and the adapter is arbitrated
+ * by deadline between all masters that share it. Latency-critical transactions can be
+ * submitted with a higher priority class or an explicit deadline:
+ *
+ * @code
+ * i2c0.transfer(irq_status_read, {embdrv::aardvarkPriority::critical}, cb);
+ * @endcode
+ *
  * @ingroup AardvarkDrivers
  */
-class aardvarkI2CMaster final
-	: public embvm::i2c::master,
-	  public embutil::activeObject<aardvarkI2CMaster,
-								   std::pair<embvm::i2c::op_t, const embvm::i2c::master::cb_t>>
+class aardvarkI2CMaster final : public embvm::i2c::master,
+								public embutil::activeObject<aardvarkI2CMaster, aardvarkQueueToken>
 {
-	/// The storage type that the active object stores.
-	using storagePair_t = std::pair<embvm::i2c::op_t, const embvm::i2c::master::cb_t>;
-
   public:
 	/** Construct an Aardvark I2C master
 	 *
@@ -44,9 +131,98 @@ class aardvarkI2CMaster final
 	~aardvarkI2CMaster() noexcept;
 
 	/// Active object process function
-	void process_(const storagePair_t& op) noexcept;
+	void process_(const aardvarkQueueToken& token) noexcept;
+
+	using embvm::i2c::master::transfer;
+
+	/** Perform an I2C transaction with a specific retry policy
+	 *
+	 * @param op The transaction to perform.
+	 * @param policy The retry policy to use for this transaction.
+	 * @param cb The callback to invoke once the transaction completes.
+	 * @returns embvm::i2c::status::enqueued.
+	 */
+	embvm::i2c::status transfer(const embvm::i2c::op_t& op, const aardvarkI2CRetryPolicy& policy,
+								const embvm::i2c::master::cb_t& cb = nullptr) noexcept;
+
+	/** Perform an I2C transaction with specific scheduling parameters
+	 *
+	 * @param op The transaction to perform.
+	 * @param schedule The priority class and optional deadline for this transaction.
+	 * @param cb The callback to invoke once the transaction completes.
+	 * @returns embvm::i2c::status::enqueued.
+	 */
+	embvm::i2c::status transfer(const embvm::i2c::op_t& op, const aardvarkSchedule& schedule,
+								const embvm::i2c::master::cb_t& cb = nullptr) noexcept;
+
+	/** Perform an I2C transaction with specific scheduling parameters and retry policy
+	 *
+	 * @param op The transaction to perform.
+	 * @param schedule The priority class and optional deadline for this transaction.
+	 * @param policy The retry policy to use for this transaction.
+	 * @param cb The callback to invoke once the transaction completes.
+	 * @returns embvm::i2c::status::enqueued.
+	 */
+	embvm::i2c::status transfer(const embvm::i2c::op_t& op, const aardvarkSchedule& schedule,
+								const aardvarkI2CRetryPolicy& policy,
+								const embvm::i2c::master::cb_t& cb = nullptr) noexcept;
+
+	/** Perform a batch of I2C transactions
+	 *
+	 * The transactions are performed back-to-back under a single adapter acquisition,
+	 * and the batch stops at the first failure. Batched transactions are not retried.
+	 *
+	 * @param ops The transactions to perform. Must remain valid until cb is invoked.
+	 * @param count The number of transactions in ops.
+	 * @param cb The callback to invoke once the batch completes.
+	 * @param schedule The priority class and optional deadline for the batch.
+	 * @returns embvm::i2c::status::enqueued.
+	 */
+	embvm::i2c::status transfer(const embvm::i2c::op_t* ops, size_t count,
+								const aardvarkI2CBatchCb& cb,
+								const aardvarkSchedule& schedule = {}) noexcept;
+
+	/// Set the retry policy used by transfers that do not specify one.
+	/// @param policy The default retry policy.
+	void retryPolicy(const aardvarkI2CRetryPolicy& policy) noexcept;
+
+	/// Get the retry activity counters.
+	/// @returns a snapshot of the retry counters.
+	aardvarkI2CRetryStats retryStats() const noexcept;
+
+	/** Enable automatic bitrate tuning
+	 *
+	 * The bus bitrate is adjusted at runtime based on the observed error rate.
+	 * Calling baudrate() disables automatic tuning.
+	 *
+	 * @pre The driver is started.
+	 * @param cfg The tuning parameters. Bitrates are specified in kHz.
+	 */
+	void autoTuneBitrate(const aardvarkBitrateTuner::config& cfg) noexcept;
+
+	/// Disable automatic bitrate tuning. The current bitrate remains in effect.
+	void disableBitrateAutoTune() noexcept;
+
+	/// Get the automatic bitrate tuner's activity counters.
+	/// @returns a copy of the tuner counters.
+	aardvarkBitrateTuner::stats bitrateTunerStats() noexcept;
 
   private:
+	/// Issue a single transaction to the adapter.
+	/// @pre The adapter is acquired.
+	/// @returns the raw Aardvark API result.
+	int execute_(const embvm::i2c::op_t& op) noexcept;
+
+	/// Perform a single transaction, recovering from a lost USB connection, and report the
+	/// result to the bitrate tuner. After a reconnect, only reads, pings and register reads
+	/// are issued again; other transactions fail, and are retried only if the retry policy
+	/// allows it.
+	/// @pre The adapter is acquired.
+	embvm::i2c::status perform_(const embvm::i2c::op_t& op) noexcept;
+
+	/// Perform a batch request.
+	void processBatch_(const aardvarkI2CRequest& req) noexcept;
+
 	void configure_(embvm::i2c::pullups pullup) noexcept final;
 	embvm::i2c::status transfer_(const embvm::i2c::op_t& op,
 								 const embvm::i2c::master::cb_t& cb) noexcept final;
@@ -58,6 +234,33 @@ class aardvarkI2CMaster final
   private:
 	/// The aardvarkAdapter instance associated with this driver.
 	aardvarkAdapter& base_driver_;
+
+	/// Automatic bitrate tuner. Protected by the base_driver_ lock.
+	aardvarkBitrateTuner tuner_;
+
+	/// True when automatic bitrate tuning is enabled. Protected by the base_driver_ lock.
+	bool autotune_ = false;
+
+	/// Retry policy for transfers that do not specify one. Protected by policy_lock_.
+	aardvarkI2CRetryPolicy default_policy_;
+
+	/// Protects default_policy_.
+	std::mutex policy_lock_;
+
+	/// Pending transactions, in dispatch order.
+	aardvarkRequestQueue<aardvarkI2CRequest> queue_;
+
+	/// Number of retry attempts scheduled.
+	std::atomic<uint32_t> retries_ = 0;
+
+	/// Number of transactions that succeeded after a retry.
+	std::atomic<uint32_t> recovered_ = 0;
+
+	/// Number of transactions that failed after exhausting their attempts.
+	std::atomic<uint32_t> exhausted_ = 0;
+
+	/// Number of bus clears issued by the retry logic.
+	std::atomic<uint32_t> bus_clears_ = 0;
 };
 
 } // namespace embdrv
@@ -0,0 +1,323 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/i2c_sampler.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <numeric>
+
+using namespace embdrv;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+
+aardvarkI2CSampler::~aardvarkI2CSampler() noexcept
+{
+	stop();
+}
+
+size_t aardvarkI2CSampler::add(const aardvarkSamplerChannelConfig& cfg) noexcept
+{
+	assert(!running() && "Channels cannot be added while the sampler is running");
+	assert(cfg.length > 0 && cfg.length <= AARDVARK_SAMPLER_MAX_LENGTH);
+	assert(cfg.period.count() > 0);
+	assert(cfg.depth > 0);
+
+	std::lock_guard<std::mutex> lock(lock_);
+
+	channels_.emplace_back();
+	auto& ch = channels_.back();
+	ch.cfg = cfg;
+	// The spare slot is read into while the samples stay readable
+	ch.ring.resize(cfg.depth + 1);
+
+	ops_.resize(channels_.size());
+	op_channel_.resize(channels_.size());
+
+	return channels_.size() - 1;
+}
+
+void aardvarkI2CSampler::start() noexcept
+{
+	assert(!running());
+	assert(resolution_.count() > 0);
+
+	std::lock_guard<std::mutex> lock(lock_);
+	assert(!channels_.empty() && "No sampling channels registered");
+
+	microseconds::rep gcd = 0;
+	for(const auto& ch : channels_)
+	{
+		gcd = std::gcd(gcd, ch.cfg.period.count());
+	}
+
+	// Periods that do not share a tick at least as coarse as the resolution are rounded
+	tick_ = microseconds(std::max(gcd, resolution_.count()));
+
+	for(auto& ch : channels_)
+	{
+		auto divisor = (ch.cfg.period + tick_ / 2) / tick_;
+		ch.divisor = static_cast<uint32_t>(std::max<microseconds::rep>(divisor, 1));
+	}
+
+	stopping_ = false;
+	thread_ = std::thread(&aardvarkI2CSampler::run_, this);
+}
+
+void aardvarkI2CSampler::stop() noexcept
+{
+	if(!running())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+
+	cv_.notify_all();
+	thread_.join();
+
+	// The pending reads point into the channel rings
+	std::unique_lock<std::mutex> lock(lock_);
+	cv_.wait(lock, [this] { return !busy_; });
+}
+
+void aardvarkI2CSampler::run_() noexcept
+{
+	auto next = steady_clock::now();
+	uint32_t tick = 0;
+
+	std::unique_lock<std::mutex> lock(lock_);
+
+	while(!cv_.wait_until(lock, next, [this] { return stopping_; }))
+	{
+		if(busy_)
+		{
+			skip_(tick);
+		}
+		else if(prepare_(tick) > 0)
+		{
+			busy_ = true;
+			tick_time_ = next;
+			tick_index_ = tick;
+			ticks_++;
+			batches_++;
+
+			lock.unlock();
+			issue_(0);
+			lock.lock();
+		}
+
+		tick++;
+		next += tick_;
+
+		// Ticks the scheduler thread slept through are not issued late
+		auto now = steady_clock::now();
+		while(next + tick_ <= now)
+		{
+			skip_(tick);
+			tick++;
+			next += tick_;
+		}
+	}
+}
+
+size_t aardvarkI2CSampler::prepare_(uint32_t tick) noexcept
+{
+	size_t n = 0;
+
+	for(size_t i = 0; i < channels_.size(); i++)
+	{
+		auto& ch = channels_[i];
+		if(!due_(ch, tick))
+		{
+			continue;
+		}
+
+		auto& op = ops_[n];
+		op.op = embvm::i2c::operation::writeRead;
+		op.address = ch.cfg.address;
+		op.tx_buffer = &ch.cfg.reg;
+		op.tx_size = 1;
+		op.rx_buffer = ch.ring[ch.head].data.data();
+		op.rx_size = ch.cfg.length;
+
+		op_channel_[n] = i;
+		n++;
+	}
+
+	op_count_ = n;
+
+	return n;
+}
+
+void aardvarkI2CSampler::skip_(uint32_t tick) noexcept
+{
+	overruns_++;
+
+	for(auto& ch : channels_)
+	{
+		if(due_(ch, tick))
+		{
+			ch.overruns++;
+		}
+	}
+}
+
+void aardvarkI2CSampler::issue_(size_t first) noexcept
+{
+	// tick_time_ and the prepared reads do not change until busy_ is cleared
+	aardvarkSchedule schedule{priority_, tick_time_ + tick_};
+
+	i2c_.transfer(
+		&ops_[first], op_count_ - first,
+		[this, first](embvm::i2c::status status, size_t completed) {
+			complete_(first, status, completed);
+		},
+		schedule);
+}
+
+void aardvarkI2CSampler::complete_(size_t first, embvm::i2c::status status,
+								   size_t completed) noexcept
+{
+	auto now = steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(lock_);
+
+	size_t end = first + completed;
+	for(size_t i = first; i < end; i++)
+	{
+		commit_(channels_[op_channel_[i]], now);
+	}
+
+	if(status != embvm::i2c::status::ok && end < op_count_)
+	{
+		channels_[op_channel_[end]].errors++;
+
+		// The batch stopped at the failed read; the rest of the tick still has to be sampled
+		if(end + 1 < op_count_)
+		{
+			batches_++;
+			lock.unlock();
+			issue_(end + 1);
+			return;
+		}
+	}
+
+	auto latency = static_cast<uint32_t>(duration_cast<microseconds>(now - tick_time_).count());
+	latency_max_us_ = std::max(latency_max_us_, latency);
+
+	busy_ = false;
+
+	// Notify with the lock held: stop() may destroy the sampler as soon as it sees busy_ clear
+	cv_.notify_all();
+}
+
+void aardvarkI2CSampler::commit_(stream& ch, steady_clock::time_point now) noexcept
+{
+	auto& slot = ch.ring[ch.head];
+	slot.timestamp = now;
+	slot.tick = tick_index_;
+	slot.length = ch.cfg.length;
+
+	if(ch.samples == 0)
+	{
+		ch.first = now;
+	}
+	else
+	{
+		auto expected = tick_ * (tick_index_ - ch.last_tick);
+		auto actual = duration_cast<microseconds>(now - ch.last);
+		auto deviation = static_cast<uint32_t>(std::llabs((actual - expected).count()));
+
+		ch.jitter_sum_us += deviation;
+		ch.jitter_max_us = std::max(ch.jitter_max_us, deviation);
+	}
+
+	ch.last = now;
+	ch.last_tick = tick_index_;
+	ch.samples++;
+
+	// Only a sample that was actually read displaces the oldest unread one
+	if(ch.count == ch.cfg.depth)
+	{
+		ch.count--;
+		ch.dropped++;
+	}
+
+	ch.head = (ch.head + 1) % ch.ring.size();
+	ch.count++;
+}
+
+size_t aardvarkI2CSampler::read(size_t channel, aardvarkSample* samples, size_t count) noexcept
+{
+	assert(samples != nullptr || count == 0);
+
+	std::lock_guard<std::mutex> lock(lock_);
+	assert(channel < channels_.size());
+
+	auto& ch = channels_[channel];
+	auto size = ch.ring.size();
+	auto n = std::min(count, ch.count);
+	auto tail = (ch.head + size - ch.count) % size;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		samples[i] = ch.ring[(tail + i) % size];
+	}
+
+	ch.count -= n;
+
+	return n;
+}
+
+bool aardvarkI2CSampler::latest(size_t channel, aardvarkSample& sample) const noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	assert(channel < channels_.size());
+
+	const auto& ch = channels_[channel];
+	if(ch.count == 0)
+	{
+		return false;
+	}
+
+	sample = ch.ring[(ch.head + ch.ring.size() - 1) % ch.ring.size()];
+
+	return true;
+}
+
+aardvarkSamplerChannelStats aardvarkI2CSampler::statistics(size_t channel) const noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	assert(channel < channels_.size());
+
+	const auto& ch = channels_[channel];
+
+	aardvarkSamplerChannelStats s{};
+	s.samples = ch.samples;
+	s.errors = ch.errors;
+	s.overruns = ch.overruns;
+	s.dropped = ch.dropped;
+	s.period = (tick_.count() > 0) ? tick_ * ch.divisor : ch.cfg.period;
+
+	if(ch.samples > 1)
+	{
+		auto elapsed = std::chrono::duration<double>(ch.last - ch.first).count();
+		s.rate_hz = (elapsed > 0.0) ? (ch.samples - 1) / elapsed : 0.0;
+		s.jitter_mean_us = static_cast<uint32_t>(ch.jitter_sum_us / (ch.samples - 1));
+		s.jitter_max_us = ch.jitter_max_us;
+	}
+
+	return s;
+}
+
+aardvarkSamplerStats aardvarkI2CSampler::statistics() const noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+
+	return {tick_, ticks_, overruns_, batches_, latency_max_us_};
+}
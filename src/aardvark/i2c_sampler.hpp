@@ -0,0 +1,300 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_I2C_SAMPLER_HPP_
+#define AARDVARK_I2C_SAMPLER_HPP_
+
+#include "base.hpp"
+#include "i2c.hpp"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <driver/i2c.hpp>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/// Maximum number of bytes read by one sampling channel.
+inline constexpr size_t AARDVARK_SAMPLER_MAX_LENGTH = 32;
+
+/// Settings for one channel of an aardvarkI2CSampler
+struct aardvarkSamplerChannelConfig
+{
+	/// The 7-bit target address.
+	uint8_t address = 0;
+	/// The register to read from.
+	uint8_t reg = 0;
+	/// Number of bytes to read, between (1..AARDVARK_SAMPLER_MAX_LENGTH).
+	uint8_t length = 1;
+	/// Sampling period. Rounded to a multiple of the sampler tick.
+	std::chrono::microseconds period{1000};
+	/// Number of samples kept until they are read. Older samples are overwritten.
+	size_t depth = 16;
+};
+
+/// A sample read by an aardvarkI2CSampler
+struct aardvarkSample
+{
+	/// Time the read completed.
+	std::chrono::steady_clock::time_point timestamp{};
+	/// Index of the tick the sample was scheduled on. Gaps indicate missed samples.
+	uint32_t tick = 0;
+	/// Number of valid bytes in data.
+	uint8_t length = 0;
+	/// The register contents.
+	std::array<uint8_t, AARDVARK_SAMPLER_MAX_LENGTH> data{};
+};
+
+/// Activity counters of one aardvarkI2CSampler channel
+struct aardvarkSamplerChannelStats
+{
+	/// Number of samples read successfully.
+	uint32_t samples;
+	/// Number of reads that failed.
+	uint32_t errors;
+	/// Number of reads skipped because the previous tick had not completed.
+	uint32_t overruns;
+	/// Number of samples overwritten before they were read.
+	uint32_t dropped;
+	/// Effective sampling period, after rounding to the sampler tick.
+	std::chrono::microseconds period;
+	/// Achieved sampling rate, in Hz.
+	double rate_hz;
+	/// Mean deviation between consecutive samples and their scheduled spacing, in microseconds.
+	uint32_t jitter_mean_us;
+	/// Maximum deviation between consecutive samples and their scheduled spacing, in microseconds.
+	uint32_t jitter_max_us;
+};
+
+/// Activity counters of an aardvarkI2CSampler
+struct aardvarkSamplerStats
+{
+	/// The common tick all channel periods are aligned to.
+	std::chrono::microseconds tick;
+	/// Number of ticks issued to the I2C master.
+	uint32_t ticks;
+	/// Number of ticks skipped because the previous tick had not completed.
+	uint32_t overruns;
+	/// Number of batches submitted, including those resubmitted after a failed read.
+	uint32_t batches;
+	/// Maximum time from a tick to the completion of its reads, in microseconds.
+	uint32_t latency_max_us;
+};
+
+/** Periodic register sampler for an Aardvark I2C master
+ *
+ * The sampler reads a set of registers periodically, without a timer thread per register.
+ * Each channel describes one register read and its period. When the sampler starts, the
+ * periods are aligned onto a common tick (their greatest common divisor, but no finer than
+ * the resolution), and each tick issues the reads that are due as a single batch on the
+ * I2C master's worker thread. The adapter is therefore acquired once per tick, no matter
+ * how many channels are due.
+ *
+ * Results are written directly into per-channel ring buffers that are allocated when the
+ * channel is added, so sampling does not allocate memory. A failed read does not cancel
+ * the rest of its tick: the remaining reads are resubmitted.
+ *
+ * If the reads of a tick have not completed when the next tick is due, that tick is
+ * skipped and counted as an overrun.
+ *
+ * @code
+ * embdrv::aardvarkI2CSampler sampler{i2c0};
+ * auto accel = sampler.add({0x1d, 0x28, 6, std::chrono::milliseconds(1)});
+ * auto temp = sampler.add({0x48, 0x00, 2, std::chrono::milliseconds(100)});
+ * sampler.start();
+ * ...
+ * embdrv::aardvarkSample s[16];
+ * size_t n = sampler.read(accel, s, 16);
+ * @endcode
+ */
+class aardvarkI2CSampler
+{
+  public:
+	/** Create a sampler
+	 *
+	 * @param i2c The I2C master that performs the reads.
+	 * @param priority The priority class of the sampling batches. Each batch is due
+	 *	before the next tick.
+	 * @param resolution The finest tick the sampler will use.
+	 */
+	explicit aardvarkI2CSampler(
+		aardvarkI2CMaster& i2c, aardvarkPriority priority = aardvarkPriority::high,
+		std::chrono::microseconds resolution = std::chrono::microseconds(1000)) noexcept
+		: i2c_(i2c), priority_(priority), resolution_(resolution)
+	{
+	}
+
+	/// Stops sampling.
+	~aardvarkI2CSampler() noexcept;
+
+	/** Register a channel
+	 *
+	 * @pre The sampler is not running.
+	 * @param cfg The channel settings.
+	 * @returns the channel ID.
+	 */
+	size_t add(const aardvarkSamplerChannelConfig& cfg) noexcept;
+
+	/// Align the channel periods and start sampling.
+	/// @pre The I2C master is started.
+	void start() noexcept;
+
+	/// Stop sampling. Returns once the reads in progress have completed.
+	/// @pre The I2C master has not been stopped yet.
+	void stop() noexcept;
+
+	/// Check whether the sampler is running.
+	bool running() const noexcept
+	{
+		return thread_.joinable();
+	}
+
+	/** Read the oldest samples of a channel
+	 *
+	 * The samples are removed from the channel's ring buffer.
+	 *
+	 * @param channel The channel ID returned by add().
+	 * @param samples Receives the samples, oldest first.
+	 * @param count The capacity of samples.
+	 * @returns the number of samples read.
+	 */
+	size_t read(size_t channel, aardvarkSample* samples, size_t count) noexcept;
+
+	/** Get the newest sample of a channel
+	 *
+	 * The sample is not removed from the channel's ring buffer.
+	 *
+	 * @param channel The channel ID returned by add().
+	 * @param sample Receives the sample.
+	 * @returns false if the channel has no unread sample.
+	 */
+	bool latest(size_t channel, aardvarkSample& sample) const noexcept;
+
+	/// Get the activity counters of a channel.
+	/// @param channel The channel ID returned by add().
+	/// @returns a snapshot of the channel's counters.
+	aardvarkSamplerChannelStats statistics(size_t channel) const noexcept;
+
+	/// Get the activity counters of the sampler.
+	/// @returns a snapshot of the sampler's counters.
+	aardvarkSamplerStats statistics() const noexcept;
+
+  private:
+	/// A registered channel
+	struct stream
+	{
+		/// The channel settings.
+		aardvarkSamplerChannelConfig cfg;
+		/// Sampling period, in ticks.
+		uint32_t divisor = 1;
+		/// Ring buffer storage, one slot larger than the depth. The slot at head never holds
+		/// an unread sample, so it can be written while a read is pending.
+		std::vector<aardvarkSample> ring;
+		/// Next slot to write.
+		size_t head = 0;
+		/// Number of unread samples.
+		size_t count = 0;
+		/// Counters reported by statistics().
+		uint32_t samples = 0;
+		uint32_t errors = 0;
+		uint32_t overruns = 0;
+		uint32_t dropped = 0;
+		/// Timestamp of the first sample.
+		std::chrono::steady_clock::time_point first{};
+		/// Timestamp and tick of the previous sample.
+		std::chrono::steady_clock::time_point last{};
+		uint32_t last_tick = 0;
+		/// Sum of the spacing deviations, in microseconds.
+		uint64_t jitter_sum_us = 0;
+		/// Maximum spacing deviation, in microseconds.
+		uint32_t jitter_max_us = 0;
+	};
+
+	/// Scheduler thread: issues a batch on every tick until stop() is called.
+	void run_() noexcept;
+
+	/// Check whether a channel is due on a tick.
+	bool due_(const stream& ch, uint32_t tick) const noexcept
+	{
+		return (tick % ch.divisor) == 0;
+	}
+
+	/// Prepare the reads that are due on a tick. @pre lock_ is held.
+	/// @returns the number of reads prepared.
+	size_t prepare_(uint32_t tick) noexcept;
+
+	/// Account for a tick that is skipped. @pre lock_ is held.
+	void skip_(uint32_t tick) noexcept;
+
+	/// Store the sample read into a channel's head slot, dropping the oldest unread sample if
+	/// the channel is full. @pre lock_ is held.
+	void commit_(stream& ch, std::chrono::steady_clock::time_point now) noexcept;
+
+	/// Submit the prepared reads, starting at index first.
+	void issue_(size_t first) noexcept;
+
+	/// Commit the results of a batch and resubmit the remaining reads after a failure.
+	void complete_(size_t first, embvm::i2c::status status, size_t completed) noexcept;
+
+  private:
+	/// The I2C master that performs the reads.
+	aardvarkI2CMaster& i2c_;
+
+	/// The priority class of the sampling batches.
+	const aardvarkPriority priority_;
+
+	/// The finest tick the sampler will use.
+	const std::chrono::microseconds resolution_;
+
+	/// Protects everything below, except thread_.
+	mutable std::mutex lock_;
+
+	/// Signals stop requests and batch completion.
+	std::condition_variable cv_;
+
+	/// Registered channels.
+	std::vector<stream> channels_;
+
+	/// Reads of the current tick. rx buffers point into the channel rings.
+	std::vector<embvm::i2c::op_t> ops_;
+
+	/// Channel index of each entry in ops_.
+	std::vector<size_t> op_channel_;
+
+	/// Number of valid entries in ops_.
+	size_t op_count_ = 0;
+
+	/// True while the reads of a tick are pending.
+	bool busy_ = false;
+
+	/// The common tick.
+	std::chrono::microseconds tick_{0};
+
+	/// Scheduled time and index of the tick in progress.
+	std::chrono::steady_clock::time_point tick_time_{};
+	uint32_t tick_index_ = 0;
+
+	/// Counters reported by statistics().
+	uint32_t ticks_ = 0;
+	uint32_t overruns_ = 0;
+	uint32_t batches_ = 0;
+	uint32_t latency_max_us_ = 0;
+
+	/// Set by stop().
+	bool stopping_ = false;
+
+	/// The scheduler thread.
+	std::thread thread_;
+};
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_I2C_SAMPLER_HPP_
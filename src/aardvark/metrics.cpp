@@ -0,0 +1,271 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/metrics.hpp>
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+
+using namespace embdrv;
+
+// aardvarkTargetMetrics::errors() relies on both status types using 0 for success
+static_assert(static_cast<size_t>(embvm::i2c::status::ok) == 0, "I2C ok status must be 0");
+static_assert(static_cast<size_t>(embvm::comm::status::ok) == 0, "SPI ok status must be 0");
+
+// The documented footprint: two cache lines per target
+static_assert(sizeof(aardvarkBusMetrics) ==
+				  (AARDVARK_METRICS_I2C_TARGETS + AARDVARK_METRICS_SPI_TARGETS) * 2 *
+					  AARDVARK_CACHE_LINE_SIZE,
+			  "Update the aardvarkBusMetrics footprint documentation");
+
+/// Maximum length of the exported file path, including the temporary file suffix.
+constexpr size_t MAX_PATH_LENGTH = 256;
+
+static const char* i2cStatusName(size_t index) noexcept
+{
+	switch(static_cast<embvm::i2c::status>(index))
+	{
+		case embvm::i2c::status::ok:
+			return "ok";
+		case embvm::i2c::status::enqueued:
+			return "enqueued";
+		case embvm::i2c::status::busy:
+			return "busy";
+		case embvm::i2c::status::addrNACK:
+			return "addrNACK";
+		case embvm::i2c::status::dataNACK:
+			return "dataNACK";
+		case embvm::i2c::status::bus:
+			return "bus";
+		case embvm::i2c::status::error:
+			return "error";
+		case embvm::i2c::status::unknown:
+			return "unknown";
+		default:
+			return nullptr;
+	}
+}
+
+static const char* spiStatusName(size_t index) noexcept
+{
+	switch(static_cast<embvm::comm::status>(index))
+	{
+		case embvm::comm::status::ok:
+			return "ok";
+		case embvm::comm::status::enqueued:
+			return "enqueued";
+		case embvm::comm::status::busy:
+			return "busy";
+		case embvm::comm::status::error:
+			return "error";
+		case embvm::comm::status::unknown:
+			return "unknown";
+		default:
+			return nullptr;
+	}
+}
+
+void aardvarkBusMetrics::copy_(const slot& s, aardvarkTargetMetrics& m) noexcept
+{
+	m.bytes = s.bytes.load(std::memory_order_relaxed);
+	m.busy_ns = s.busy_ns.load(std::memory_order_relaxed);
+	m.ops = 0;
+
+	// A separate ops counter could be read before a status count it covers, and errors()
+	// would then underflow
+	for(size_t i = 0; i < AARDVARK_METRICS_STATUS_COUNT; i++)
+	{
+		m.status[i] = s.status[i].load(std::memory_order_relaxed);
+		m.ops += m.status[i];
+	}
+}
+
+void aardvarkBusMetrics::snapshot(aardvarkMetricsSnapshot& snapshot) const noexcept
+{
+	for(size_t i = 0; i < AARDVARK_METRICS_I2C_TARGETS; i++)
+	{
+		copy_(i2c_[i], snapshot.i2c[i]);
+	}
+
+	for(size_t i = 0; i < AARDVARK_METRICS_SPI_TARGETS; i++)
+	{
+		copy_(spi_[i], snapshot.spi[i]);
+	}
+}
+
+namespace
+{
+/// Description of one bus for the exporter
+struct busFamily
+{
+	/// Metric name prefix.
+	const char* bus;
+	/// Name of the target label.
+	const char* label;
+	/// Format of the target label value.
+	const char* format;
+	/// Status name lookup.
+	const char* (*status_name)(size_t);
+};
+
+void writeFamily(FILE* f, const char* adapter, const busFamily& family,
+				 const aardvarkTargetMetrics* targets, size_t count)
+{
+	char target[8];
+
+	fprintf(f, "# HELP aardvark_%s_ops_total Transactions performed, by target.\n", family.bus);
+	fprintf(f, "# TYPE aardvark_%s_ops_total counter\n", family.bus);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(targets[i].ops != 0)
+		{
+			snprintf(target, sizeof(target), family.format, static_cast<unsigned>(i));
+			fprintf(f, "aardvark_%s_ops_total{adapter=\"%s\",%s=\"%s\"} %" PRIu64 "\n", family.bus,
+					adapter, family.label, target, targets[i].ops);
+		}
+	}
+
+	fprintf(f, "# HELP aardvark_%s_bytes_total Bytes transferred by successful transactions.\n",
+			family.bus);
+	fprintf(f, "# TYPE aardvark_%s_bytes_total counter\n", family.bus);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(targets[i].ops != 0)
+		{
+			snprintf(target, sizeof(target), family.format, static_cast<unsigned>(i));
+			fprintf(f, "aardvark_%s_bytes_total{adapter=\"%s\",%s=\"%s\"} %" PRIu64 "\n",
+					family.bus, adapter, family.label, target, targets[i].bytes);
+		}
+	}
+
+	fprintf(f, "# HELP aardvark_%s_busy_seconds_total Time spent performing transactions.\n",
+			family.bus);
+	fprintf(f, "# TYPE aardvark_%s_busy_seconds_total counter\n", family.bus);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(targets[i].ops != 0)
+		{
+			snprintf(target, sizeof(target), family.format, static_cast<unsigned>(i));
+			fprintf(f, "aardvark_%s_busy_seconds_total{adapter=\"%s\",%s=\"%s\"} %.9f\n",
+					family.bus, adapter, family.label, target,
+					static_cast<double>(targets[i].busy_ns) / 1e9);
+		}
+	}
+
+	fprintf(f, "# HELP aardvark_%s_status_total Transactions by result.\n", family.bus);
+	fprintf(f, "# TYPE aardvark_%s_status_total counter\n", family.bus);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(targets[i].ops == 0)
+		{
+			continue;
+		}
+
+		snprintf(target, sizeof(target), family.format, static_cast<unsigned>(i));
+
+		for(size_t s = 0; s < AARDVARK_METRICS_STATUS_COUNT; s++)
+		{
+			if(targets[i].status[s] == 0)
+			{
+				continue;
+			}
+
+			const char* name = family.status_name(s);
+			char number[4];
+			if(name == nullptr)
+			{
+				snprintf(number, sizeof(number), "%u", static_cast<unsigned>(s));
+				name = number;
+			}
+
+			fprintf(f, "aardvark_%s_status_total{adapter=\"%s\",%s=\"%s\",status=\"%s\"} %" PRIu64
+					   "\n",
+					family.bus, adapter, family.label, target, name, targets[i].status[s]);
+		}
+	}
+}
+} // namespace
+
+aardvarkMetricsExporter::~aardvarkMetricsExporter() noexcept
+{
+	stop();
+}
+
+void aardvarkMetricsExporter::start() noexcept
+{
+	assert(cfg_.path != nullptr && cfg_.adapter != nullptr);
+
+	if(thread_.joinable())
+	{
+		return;
+	}
+
+	stopping_ = false;
+	thread_ = std::thread(&aardvarkMetricsExporter::run_, this);
+}
+
+void aardvarkMetricsExporter::stop() noexcept
+{
+	if(!thread_.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+
+	cv_.notify_all();
+	thread_.join();
+}
+
+void aardvarkMetricsExporter::run_() noexcept
+{
+	std::unique_lock<std::mutex> lock(lock_);
+
+	do
+	{
+		lock.unlock();
+		write();
+		lock.lock();
+	} while(!cv_.wait_for(lock, cfg_.interval, [this] { return stopping_; }));
+}
+
+bool aardvarkMetricsExporter::write() noexcept
+{
+	assert(cfg_.path != nullptr && cfg_.adapter != nullptr);
+
+	std::lock_guard<std::mutex> lock(write_lock_);
+
+	char tmp[MAX_PATH_LENGTH];
+	if(snprintf(tmp, sizeof(tmp), "%s.tmp", cfg_.path) >= static_cast<int>(sizeof(tmp)))
+	{
+		return false;
+	}
+
+	FILE* f = fopen(tmp, "w");
+	if(f == nullptr)
+	{
+		return false;
+	}
+
+	metrics_.snapshot(snapshot_);
+
+	writeFamily(f, cfg_.adapter, {"i2c", "address", "0x%02x", i2cStatusName},
+				snapshot_.i2c.data(), snapshot_.i2c.size());
+	writeFamily(f, cfg_.adapter, {"spi", "group", "%u", spiStatusName}, snapshot_.spi.data(),
+				snapshot_.spi.size());
+
+	bool ok = (ferror(f) == 0);
+	ok = (fclose(f) == 0) && ok;
+
+	// Replace the previous file atomically, so scrapers never read a partial file
+	if(!ok || rename(tmp, cfg_.path) != 0)
+	{
+		remove(tmp);
+		return false;
+	}
+
+	return true;
+}
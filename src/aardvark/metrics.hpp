@@ -0,0 +1,236 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_METRICS_HPP_
+#define AARDVARK_METRICS_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <driver/i2c.hpp>
+#include <driver/spi.hpp>
+#include <mutex>
+#include <thread>
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/// Size of a cache line. Per-target counters are aligned to it so that bus masters on
+/// different threads do not contend on shared lines.
+inline constexpr size_t AARDVARK_CACHE_LINE_SIZE = 64;
+
+/// Number of status codes counted per target: every embvm::i2c::status and
+/// embvm::comm::status value. Larger status values share the last slot.
+inline constexpr size_t AARDVARK_METRICS_STATUS_COUNT = 8;
+
+/// Number of I2C targets tracked: one per 7-bit address.
+inline constexpr size_t AARDVARK_METRICS_I2C_TARGETS = 128;
+
+/// Number of SPI targets tracked: one per aardvarkSchedule::group (0 for ungrouped transfers).
+/// With an aardvarkSPIMux, the group is the device ID.
+inline constexpr size_t AARDVARK_METRICS_SPI_TARGETS = 256;
+
+/// Counters of one bus target
+struct aardvarkTargetMetrics
+{
+	/// Number of transactions performed. Always the sum of status.
+	uint64_t ops;
+	/// Number of bytes transferred by successful transactions.
+	uint64_t bytes;
+	/// Time spent performing transactions, in nanoseconds.
+	uint64_t busy_ns;
+	/// Number of transactions by result, indexed by the numeric value of the
+	/// embvm::i2c::status (I2C) or embvm::comm::status (SPI).
+	std::array<uint64_t, AARDVARK_METRICS_STATUS_COUNT> status;
+
+	/// Get the number of transactions that did not succeed.
+	/// @returns the number of transactions whose status is not ok.
+	uint64_t errors() const noexcept
+	{
+		return ops - status[0];
+	}
+};
+
+/// Counters of every bus target of an adapter
+///
+/// A snapshot takes about 33 KiB, so it should not be placed on a thread's stack.
+struct aardvarkMetricsSnapshot
+{
+	/// I2C counters, indexed by 7-bit address.
+	std::array<aardvarkTargetMetrics, AARDVARK_METRICS_I2C_TARGETS> i2c;
+	/// SPI counters, indexed by aardvarkSchedule::group.
+	std::array<aardvarkTargetMetrics, AARDVARK_METRICS_SPI_TARGETS> spi;
+};
+
+/** Per-target bus metrics of an Aardvark adapter
+ *
+ * The bus masters record every transaction here, keyed by I2C address or SPI group. Each
+ * target has its own cache-line aligned slot of relaxed atomic counters, so recording a
+ * transaction never takes a lock.
+ *
+ * An instance is owned by each aardvarkAdapter and shared by all masters using it. Each
+ * slot takes two cache lines (128 bytes), so the tables add 48 KiB to every adapter.
+ *
+ * @code
+ * auto snapshot = std::make_unique<embdrv::aardvarkMetricsSnapshot>();
+ * aardvark.metrics().snapshot(*snapshot);
+ * auto nacks = snapshot->i2c[0x50].status[static_cast<size_t>(embvm::i2c::status::addrNACK)];
+ * @endcode
+ */
+class aardvarkBusMetrics
+{
+  public:
+	/** Record an I2C transaction
+	 *
+	 * @param address The 7-bit target address.
+	 * @param status The transaction result.
+	 * @param bytes The number of bytes transferred.
+	 * @param busy The time spent performing the transaction.
+	 */
+	void recordI2C(uint8_t address, embvm::i2c::status status, size_t bytes,
+				   std::chrono::nanoseconds busy) noexcept
+	{
+		record_(i2c_[address % AARDVARK_METRICS_I2C_TARGETS], static_cast<size_t>(status), bytes,
+				busy);
+	}
+
+	/** Record an SPI transaction
+	 *
+	 * A request is recorded once, even if it is performed in chunks or as a batch.
+	 *
+	 * @param group The aardvarkSchedule::group of the transaction.
+	 * @param status The transaction result.
+	 * @param bytes The number of bytes transferred.
+	 * @param busy The time spent performing the transaction.
+	 */
+	void recordSPI(uint8_t group, embvm::comm::status status, size_t bytes,
+				   std::chrono::nanoseconds busy) noexcept
+	{
+		record_(spi_[group], static_cast<size_t>(status), bytes, busy);
+	}
+
+	/// Copy the counters of every target. Each counter is read individually, so a snapshot
+	/// taken during a transaction may count it in some fields but not others. The ops count
+	/// is derived from the status counts, so it never disagrees with them.
+	/// @param snapshot Receives the counters.
+	void snapshot(aardvarkMetricsSnapshot& snapshot) const noexcept;
+
+  private:
+	/// The counters of one target. The number of transactions is the sum of status.
+	struct alignas(AARDVARK_CACHE_LINE_SIZE) slot
+	{
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> busy_ns{0};
+		std::array<std::atomic<uint64_t>, AARDVARK_METRICS_STATUS_COUNT> status{};
+	};
+
+	static void record_(slot& s, size_t status, size_t bytes, std::chrono::nanoseconds busy) noexcept
+	{
+		s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		s.busy_ns.fetch_add(static_cast<uint64_t>(busy.count()), std::memory_order_relaxed);
+		s.status[std::min(status, AARDVARK_METRICS_STATUS_COUNT - 1)].fetch_add(
+			1, std::memory_order_relaxed);
+	}
+
+	static void copy_(const slot& s, aardvarkTargetMetrics& m) noexcept;
+
+  private:
+	/// I2C counters, indexed by 7-bit address.
+	std::array<slot, AARDVARK_METRICS_I2C_TARGETS> i2c_{};
+
+	/// SPI counters, indexed by group.
+	std::array<slot, AARDVARK_METRICS_SPI_TARGETS> spi_{};
+};
+
+/// Parameters of an aardvarkMetricsExporter
+struct aardvarkMetricsExporterConfig
+{
+	/// The file to write, typically in the node_exporter textfile collector directory.
+	const char* path = nullptr;
+	/// Time between two writes.
+	std::chrono::milliseconds interval{10000};
+	/// Value of the adapter label attached to every sample.
+	const char* adapter = "aardvark";
+};
+
+/** Periodic Prometheus text-file exporter for aardvarkBusMetrics
+ *
+ * A background thread takes a snapshot of the metrics at a fixed interval and writes it
+ * in the Prometheus text exposition format. The file is written under a temporary name and
+ * renamed into place, so readers never see a partial file. Targets that have not performed
+ * any transaction are omitted.
+ *
+ * @code
+ * embdrv::aardvarkMetricsExporter exporter{aardvark.metrics(),
+ *	{"/var/lib/node_exporter/aardvark.prom", std::chrono::seconds(15)}};
+ * exporter.start();
+ * @endcode
+ */
+class aardvarkMetricsExporter
+{
+  public:
+	/** Create an exporter
+	 *
+	 * @param metrics The metrics to export.
+	 * @param cfg The exporter parameters. cfg.path and cfg.adapter must remain valid for the
+	 *	lifetime of the exporter.
+	 */
+	aardvarkMetricsExporter(const aardvarkBusMetrics& metrics,
+							const aardvarkMetricsExporterConfig& cfg) noexcept
+		: metrics_(metrics), cfg_(cfg)
+	{
+	}
+
+	/// Stops the exporter.
+	~aardvarkMetricsExporter() noexcept;
+
+	/// Start writing the metrics file periodically.
+	void start() noexcept;
+
+	/// Stop writing the metrics file. The last file written is left in place.
+	void stop() noexcept;
+
+	/// Write the metrics file now.
+	/// @returns false if the file could not be written.
+	bool write() noexcept;
+
+  private:
+	/// Exporter thread: writes the file every interval until stop() is called.
+	void run_() noexcept;
+
+  private:
+	/// The metrics to export.
+	const aardvarkBusMetrics& metrics_;
+
+	/// Exporter parameters.
+	const aardvarkMetricsExporterConfig cfg_;
+
+	/// Snapshot buffer, reused by every write. Protected by write_lock_.
+	aardvarkMetricsSnapshot snapshot_{};
+
+	/// Serializes write() calls.
+	std::mutex write_lock_;
+
+	/// Protects stopping_.
+	std::mutex lock_;
+
+	/// Wakes the exporter thread when stop() is called.
+	std::condition_variable cv_;
+
+	/// Set by stop().
+	bool stopping_ = false;
+
+	/// The exporter thread.
+	std::thread thread_;
+};
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_METRICS_HPP_
@@ -0,0 +1,65 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_MODE_OPTION_HPP_
+#define AARDVARK_MODE_OPTION_HPP_
+
+#include "base.hpp"
+#include <cstdio>
+#include <cstring>
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/// The aardvarkMode names accepted on the command line, in usage message form.
+inline constexpr const char* AARDVARK_MODE_NAMES = "spi-i2c|spi-gpio|gpio-i2c|gpio";
+
+/** Parse an aardvarkMode given on the command line
+ *
+ * @param name One of the names in AARDVARK_MODE_NAMES.
+ * @param m Receives the mode.
+ * @returns false if name is not a mode name. m is left unchanged.
+ */
+inline bool aardvarkParseMode(const char* name, aardvarkMode& m) noexcept
+{
+	if(strcmp(name, "spi-i2c") == 0)
+	{
+		m = aardvarkMode::SpiI2C;
+	}
+	else if(strcmp(name, "spi-gpio") == 0)
+	{
+		m = aardvarkMode::SpiGpio;
+	}
+	else if(strcmp(name, "gpio-i2c") == 0)
+	{
+		m = aardvarkMode::GpioI2C;
+	}
+	else if(strcmp(name, "gpio") == 0)
+	{
+		m = aardvarkMode::GpioOnly;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/** Print the usage message of a tool that takes a -m mode option
+ *
+ * @param name The program name.
+ * @param options The tool's other options.
+ */
+inline void aardvarkUsage(const char* name, const char* options) noexcept
+{
+	fprintf(stderr, "Usage: %s [-m %s] %s\n", name, AARDVARK_MODE_NAMES, options);
+}
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_MODE_OPTION_HPP_
@@ -0,0 +1,291 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_SCHEDULE_HPP_
+#define AARDVARK_SCHEDULE_HPP_
+
+#include "base.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/// Token stored in the active object queue of the Aardvark bus masters.
+/// Each token represents one request waiting in the master's aardvarkRequestQueue.
+struct aardvarkQueueToken
+{
+};
+
+/// Scheduling bookkeeping shared by all Aardvark bus requests.
+struct aardvarkRequestTiming
+{
+	/// The priority class of the request.
+	aardvarkPriority priority = aardvarkPriority::normal;
+	/// Time the request was submitted.
+	std::chrono::steady_clock::time_point submitted{};
+	/// Effective deadline used for earliest-deadline-first ordering.
+	std::chrono::steady_clock::time_point deadline{};
+	/// The request will not be dispatched before this time (used for retry backoff).
+	std::chrono::steady_clock::time_point not_before{};
+	/// Submission order, used to keep requests with equal deadlines in FIFO order.
+	uint32_t sequence = 0;
+	/// Affinity group (0 for none).
+	uint8_t group = 0;
+};
+
+/** Earliest-deadline-first request queue used by the Aardvark bus masters
+ *
+ * Requests are dispatched in order of their effective deadline. Requests without an
+ * explicit deadline receive an implicit one derived from their priority class, so
+ * higher classes are served first while lower classes cannot be starved indefinitely.
+ *
+ * An optional affinity window trades a bounded amount of deadline order for locality:
+ * a request in the same group as the previously dispatched request may overtake the most
+ * urgent request if its deadline is no more than the window later.
+ *
+ * @tparam TRequest The request type. Must have an aardvarkRequestTiming member named timing.
+ */
+template<typename TRequest>
+class aardvarkRequestQueue
+{
+  public:
+	/// Default constructor
+	aardvarkRequestQueue() noexcept = default;
+
+	/// Default destructor
+	~aardvarkRequestQueue() noexcept = default;
+
+	/** Stamp a new request with its submission time and effective deadline
+	 *
+	 * @param timing The timing information to initialize.
+	 * @param schedule The scheduling parameters supplied by the caller.
+	 */
+	static void stamp(aardvarkRequestTiming& timing, const aardvarkSchedule& schedule) noexcept
+	{
+		timing.priority = schedule.priority;
+		timing.group = schedule.group;
+		timing.submitted = std::chrono::steady_clock::now();
+		timing.not_before = timing.submitted;
+
+		if(schedule.deadline == std::chrono::steady_clock::time_point::max())
+		{
+			timing.deadline = timing.submitted + aardvarkDefaultBudget(schedule.priority);
+		}
+		else
+		{
+			timing.deadline = schedule.deadline;
+		}
+	}
+
+	/// Add a request that is ready for dispatch.
+	/// @param req The request to add.
+	void push(TRequest&& req) noexcept
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		req.timing.sequence = sequence_++;
+		ready_.push_back(std::move(req));
+		std::push_heap(ready_.begin(), ready_.end(), later);
+
+		// Wake a pop() waiting out a deferred retry, so new work does not wait behind it
+		ready_cv_.notify_one();
+	}
+
+	/// Add a request that may not be dispatched before req.timing.not_before.
+	/// @param req The request to add.
+	void defer(TRequest&& req) noexcept
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		deferred_.push_back(std::move(req));
+	}
+
+	/** Set the affinity window
+	 *
+	 * @param window How far past the earliest deadline a request may be dispatched to keep
+	 *	requests of the same group together. A zero window disables grouping.
+	 */
+	void affinity(std::chrono::steady_clock::duration window) noexcept
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		affinity_window_ = window;
+	}
+
+	/** Remove the request with the earliest deadline
+	 *
+	 * If only deferred requests are queued, the calling thread waits until the first one
+	 * becomes ready or a new request is pushed, whichever comes first.
+	 *
+	 * @pre At least one request is queued.
+	 * @returns the request to dispatch.
+	 */
+	TRequest pop() noexcept
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+
+		while(true)
+		{
+			auto now = std::chrono::steady_clock::now();
+			auto wake = std::chrono::steady_clock::time_point::max();
+
+			for(auto it = deferred_.begin(); it != deferred_.end();)
+			{
+				if(it->timing.not_before <= now)
+				{
+					it->timing.sequence = sequence_++;
+					ready_.push_back(std::move(*it));
+					std::push_heap(ready_.begin(), ready_.end(), later);
+					it = deferred_.erase(it);
+				}
+				else
+				{
+					wake = std::min(wake, it->timing.not_before);
+					++it;
+				}
+			}
+
+			if(!ready_.empty())
+			{
+				break;
+			}
+
+			assert(!deferred_.empty() && "pop() called on an empty queue");
+			ready_cv_.wait_until(lock, wake);
+		}
+
+		auto next = affine_();
+		TRequest req;
+
+		if(next != ready_.end())
+		{
+			req = std::move(*next);
+			ready_.erase(next);
+			std::make_heap(ready_.begin(), ready_.end(), later);
+		}
+		else
+		{
+			std::pop_heap(ready_.begin(), ready_.end(), later);
+			req = std::move(ready_.back());
+			ready_.pop_back();
+		}
+
+		last_group_ = req.timing.group;
+
+		return req;
+	}
+
+  private:
+	/// Find a ready request that should overtake the heap head to stay in the last group.
+	/// @returns the request to dispatch, or ready_.end() to dispatch the heap head.
+	typename std::vector<TRequest>::iterator affine_() noexcept
+	{
+		const auto& head = ready_.front();
+
+		if(affinity_window_ == std::chrono::steady_clock::duration::zero() || last_group_ == 0 ||
+		   head.timing.group == last_group_)
+		{
+			return ready_.end();
+		}
+
+		auto limit = head.timing.deadline + affinity_window_;
+		auto best = ready_.end();
+
+		for(auto it = ready_.begin(); it != ready_.end(); ++it)
+		{
+			if(it->timing.group == last_group_ && it->timing.deadline <= limit &&
+			   (best == ready_.end() || later(*best, *it)))
+			{
+				best = it;
+			}
+		}
+
+		return best;
+	}
+
+	/// Heap ordering: returns true if a should be dispatched after b.
+	static bool later(const TRequest& a, const TRequest& b) noexcept
+	{
+		if(a.timing.deadline != b.timing.deadline)
+		{
+			return a.timing.deadline > b.timing.deadline;
+		}
+
+		// Wrap-safe comparison of submission order
+		return static_cast<int32_t>(a.timing.sequence - b.timing.sequence) > 0;
+	}
+
+  private:
+	/// Protects the queue contents.
+	std::mutex lock_;
+
+	/// Requests ready for dispatch, stored as a heap ordered by deadline.
+	std::vector<TRequest> ready_;
+
+	/// Requests waiting for their not_before time.
+	std::vector<TRequest> deferred_;
+
+	/// Signals pop() when a request is pushed while it waits for a deferred request.
+	std::condition_variable ready_cv_;
+
+	/// Next submission sequence number.
+	uint32_t sequence_ = 0;
+
+	/// Affinity window, or zero if grouping is disabled.
+	std::chrono::steady_clock::duration affinity_window_{};
+
+	/// Group of the most recently dispatched request.
+	uint8_t last_group_ = 0;
+};
+
+/** Lockable wrapper that acquires the aardvarkAdapter through its deadline arbiter
+ *
+ * Use with std::unique_lock or std::lock_guard in place of locking the adapter directly.
+ */
+class aardvarkBusLock
+{
+  public:
+	/** Create a bus lock for a scheduled request
+	 *
+	 * @param adapter The adapter to acquire.
+	 * @param deadline The deadline of the request that needs the bus.
+	 */
+	aardvarkBusLock(aardvarkAdapter& adapter,
+					std::chrono::steady_clock::time_point deadline) noexcept
+		: adapter_(adapter), deadline_(deadline)
+	{
+	}
+
+	/// Default destructor
+	~aardvarkBusLock() noexcept = default;
+
+	/// Acquire the adapter once no request with an earlier deadline is waiting.
+	void lock() noexcept
+	{
+		adapter_.acquire(deadline_);
+	}
+
+	/// Release the adapter.
+	void unlock() noexcept
+	{
+		adapter_.release();
+	}
+
+  private:
+	/// The adapter to acquire.
+	aardvarkAdapter& adapter_;
+
+	/// The deadline of the request that needs the bus.
+	const std::chrono::steady_clock::time_point deadline_;
+};
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_SCHEDULE_HPP_
@@ -0,0 +1,528 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/share_client.hpp>
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace embdrv;
+
+/// Allocation granularity of the shared-memory region.
+constexpr size_t REGION_BLOCK_SIZE = 64;
+
+/// Status reported when a request fails before it reaches a bus master.
+constexpr int32_t SHARE_FAILED = -1;
+
+aardvarkShareClient::~aardvarkShareClient() noexcept
+{
+	disconnect();
+}
+
+bool aardvarkShareClient::connect(const char* path) noexcept
+{
+	assert(fd_ < 0 && "Client is already connected");
+
+	sockaddr_un addr{};
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		return false;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	aardvarkShareHello hello{};
+	int shm_fd = -1;
+
+	if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+	   !aardvarkShareRead(fd, &hello, sizeof(hello), &shm_fd) ||
+	   hello.magic != AARDVARK_SHARE_MAGIC || hello.version != AARDVARK_SHARE_VERSION ||
+	   shm_fd < 0)
+	{
+		if(shm_fd >= 0)
+		{
+			close(shm_fd);
+		}
+		close(fd);
+		return false;
+	}
+
+	void* region = mmap(nullptr, hello.region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+
+	if(region == MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+
+	region_ = static_cast<uint8_t*>(region);
+	region_size_ = hello.region_size;
+
+	auto blocks = region_size_ / REGION_BLOCK_SIZE;
+	runs_.assign(blocks, 0);
+	used_.assign(blocks, false);
+
+	lost_ = false;
+	fd_ = fd;
+	receiver_ = std::thread(&aardvarkShareClient::receive_, this);
+
+	return true;
+}
+
+void aardvarkShareClient::disconnect() noexcept
+{
+	if(fd_ < 0)
+	{
+		return;
+	}
+
+	// Wakes the receive thread, which fails the outstanding requests
+	shutdown(fd_, SHUT_RDWR);
+	receiver_.join();
+
+	close(fd_);
+	fd_ = -1;
+
+	munmap(region_, region_size_);
+	region_ = nullptr;
+	region_size_ = 0;
+}
+
+bool aardvarkShareClient::inRegion_(const uint8_t* p, size_t length) const noexcept
+{
+	return p >= region_ && p + length <= region_ + region_size_;
+}
+
+uint8_t* aardvarkShareClient::allocate(size_t size) noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	return allocateLocked_(size);
+}
+
+void aardvarkShareClient::deallocate(uint8_t* buffer) noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	deallocateLocked_(buffer);
+}
+
+uint8_t* aardvarkShareClient::allocateLocked_(size_t size) noexcept
+{
+	auto count = std::max<size_t>(1, (size + REGION_BLOCK_SIZE - 1) / REGION_BLOCK_SIZE);
+
+	// First fit
+	size_t run = 0;
+	for(size_t i = 0; i < used_.size(); i++)
+	{
+		run = used_[i] ? 0 : run + 1;
+		if(run == count)
+		{
+			auto first = i + 1 - count;
+			std::fill_n(used_.begin() + static_cast<ptrdiff_t>(first), count, true);
+			runs_[first] = static_cast<uint32_t>(count);
+			return region_ + first * REGION_BLOCK_SIZE;
+		}
+	}
+
+	return nullptr;
+}
+
+void aardvarkShareClient::deallocateLocked_(uint8_t* buffer) noexcept
+{
+	if(buffer == nullptr)
+	{
+		return;
+	}
+
+	assert(inRegion_(buffer, 1) && "Buffer was not allocated from the shared region");
+
+	auto first = static_cast<size_t>(buffer - region_) / REGION_BLOCK_SIZE;
+	std::fill_n(used_.begin() + static_cast<ptrdiff_t>(first), runs_[first], false);
+	runs_[first] = 0;
+}
+
+bool aardvarkShareClient::submit(aardvarkShareRequest req, const uint8_t* tx, uint8_t* rx,
+								 const completion& cb) noexcept
+{
+	if(!connected())
+	{
+		return false;
+	}
+
+	pending p;
+	p.cb = cb;
+
+	lock_.lock();
+
+	// Stage buffers that are not already in the shared region
+	const uint8_t* tx_shared = tx;
+	if(req.tx_length != 0 && !inRegion_(tx, req.tx_length))
+	{
+		p.tx_stage = allocateLocked_(req.tx_length);
+		tx_shared = p.tx_stage;
+	}
+
+	uint8_t* rx_shared = rx;
+	if(req.rx_length != 0 && !inRegion_(rx, req.rx_length))
+	{
+		p.rx_stage = allocateLocked_(req.rx_length);
+		p.rx_user = rx;
+		p.rx_length = req.rx_length;
+		rx_shared = p.rx_stage;
+	}
+
+	if((req.tx_length != 0 && tx_shared == nullptr) || (req.rx_length != 0 && rx_shared == nullptr))
+	{
+		deallocateLocked_(p.tx_stage);
+		deallocateLocked_(p.rx_stage);
+		lock_.unlock();
+		return false;
+	}
+
+	if(p.tx_stage != nullptr)
+	{
+		memcpy(p.tx_stage, tx, req.tx_length);
+	}
+
+	req.id = next_id_++;
+	req.tx_offset = req.tx_length ? static_cast<uint32_t>(tx_shared - region_) : 0;
+	req.rx_offset = req.rx_length ? static_cast<uint32_t>(rx_shared - region_) : 0;
+
+	// Register before sending: the response can arrive before write() returns
+	pending_.emplace(req.id, std::move(p));
+
+	lock_.unlock();
+
+	write_lock_.lock();
+	bool sent = aardvarkShareWrite(fd_, &req, sizeof(req));
+	write_lock_.unlock();
+
+	if(!sent)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		auto it = pending_.find(req.id);
+		if(it != pending_.end())
+		{
+			// The receive thread has not failed it yet
+			deallocateLocked_(it->second.tx_stage);
+			deallocateLocked_(it->second.rx_stage);
+			pending_.erase(it);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int32_t aardvarkShareClient::call(aardvarkShareRequest req, uint32_t* value) noexcept
+{
+	assert(std::this_thread::get_id() != receiver_.get_id() &&
+		   "Synchronous calls are not allowed in completion callbacks");
+	assert(req.tx_length == 0 && req.rx_length == 0);
+
+	std::mutex m;
+	std::condition_variable cv;
+	bool done = false;
+	int32_t status = SHARE_FAILED;
+	uint32_t result = 0;
+
+	bool sent = submit(req, nullptr, nullptr, [&](int32_t s, uint32_t v) {
+		std::lock_guard<std::mutex> lock(m);
+		status = s;
+		result = v;
+		done = true;
+		cv.notify_one();
+	});
+
+	if(!sent)
+	{
+		return SHARE_FAILED;
+	}
+
+	std::unique_lock<std::mutex> lock(m);
+	cv.wait(lock, [&] { return done; });
+
+	if(value != nullptr)
+	{
+		*value = result;
+	}
+
+	return status;
+}
+
+void aardvarkShareClient::receive_() noexcept
+{
+	aardvarkShareResponse resp{};
+
+	while(aardvarkShareRead(fd_, &resp, sizeof(resp)))
+	{
+		pending p;
+
+		lock_.lock();
+		auto it = pending_.find(resp.id);
+		if(it == pending_.end())
+		{
+			lock_.unlock();
+			continue;
+		}
+
+		p = std::move(it->second);
+		pending_.erase(it);
+
+		if(p.rx_user != nullptr && resp.status >= 0)
+		{
+			memcpy(p.rx_user, p.rx_stage, p.rx_length);
+		}
+
+		deallocateLocked_(p.tx_stage);
+		deallocateLocked_(p.rx_stage);
+		lock_.unlock();
+
+		if(p.cb)
+		{
+			p.cb(resp.status, resp.value);
+		}
+	}
+
+	// The connection is gone: fail everything still outstanding
+	lost_ = true;
+
+	lock_.lock();
+	auto orphans = std::move(pending_);
+	pending_.clear();
+	for(auto& entry : orphans)
+	{
+		deallocateLocked_(entry.second.tx_stage);
+		deallocateLocked_(entry.second.rx_stage);
+	}
+	lock_.unlock();
+
+	for(auto& entry : orphans)
+	{
+		if(entry.second.cb)
+		{
+			entry.second.cb(SHARE_FAILED, 0);
+		}
+	}
+}
+
+/*=========================================================================
+| aardvarkRemoteI2CMaster
+ ========================================================================*/
+
+void aardvarkRemoteI2CMaster::start_() noexcept
+{
+	assert(client_.connected() && "Connect the aardvarkShareClient before starting proxies");
+}
+
+void aardvarkRemoteI2CMaster::stop_() noexcept {}
+
+void aardvarkRemoteI2CMaster::configure_(embvm::i2c::pullups pullup) noexcept
+{
+	setPullups_(pullup);
+}
+
+embvm::i2c::pullups aardvarkRemoteI2CMaster::setPullups_(embvm::i2c::pullups pullups) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::i2cPullups;
+	req.arg = (pullups != embvm::i2c::pullups::external) ? 1 : 0;
+	client_.call(req);
+
+	return pullups;
+}
+
+embvm::i2c::baud aardvarkRemoteI2CMaster::baudrate_(embvm::i2c::baud baud) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::i2cBaudrate;
+	req.arg = static_cast<uint32_t>(baud);
+
+	uint32_t value = 0;
+	if(client_.call(req, &value) < 0)
+	{
+		return baudrate();
+	}
+
+	return static_cast<embvm::i2c::baud>(value);
+}
+
+embvm::i2c::status aardvarkRemoteI2CMaster::transfer_(const embvm::i2c::op_t& op,
+													  const embvm::i2c::master::cb_t& cb) noexcept
+{
+	return transfer(op, aardvarkPriority::normal, cb);
+}
+
+embvm::i2c::status aardvarkRemoteI2CMaster::transfer(const embvm::i2c::op_t& op,
+													 aardvarkPriority priority,
+													 const embvm::i2c::master::cb_t& cb) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::i2cTransfer;
+	req.priority = static_cast<uint8_t>(priority);
+	req.i2c_op = static_cast<uint8_t>(op.op);
+	req.address = op.address;
+	req.tx_length = static_cast<uint32_t>(op.tx_buffer ? op.tx_size : 0);
+	req.rx_length = static_cast<uint32_t>(op.rx_buffer ? op.rx_size : 0);
+
+	bool sent = client_.submit(req, op.tx_buffer, op.rx_buffer, [this, op, cb](int32_t s, uint32_t) {
+		callback(op, s < 0 ? embvm::i2c::status::error : static_cast<embvm::i2c::status>(s), cb);
+	});
+
+	return sent ? embvm::i2c::status::enqueued : embvm::i2c::status::busy;
+}
+
+/*=========================================================================
+| aardvarkRemoteSPIMaster
+ ========================================================================*/
+
+void aardvarkRemoteSPIMaster::start_() noexcept
+{
+	assert(client_.connected() && "Connect the aardvarkShareClient before starting proxies");
+}
+
+void aardvarkRemoteSPIMaster::stop_() noexcept {}
+
+void aardvarkRemoteSPIMaster::configure_() noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::spiConfigure;
+	req.pin = static_cast<uint8_t>(mode_);
+	req.arg = static_cast<uint32_t>(order_);
+	client_.call(req);
+}
+
+uint32_t aardvarkRemoteSPIMaster::baudrate_(uint32_t baud) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::spiBaudrate;
+	req.arg = baud;
+
+	uint32_t value = 0;
+	if(client_.call(req, &value) < 0)
+	{
+		return baudrate();
+	}
+
+	return value;
+}
+
+embvm::comm::status aardvarkRemoteSPIMaster::transfer_(const embvm::spi::op_t& op,
+													   const embvm::spi::master::cb_t& cb) noexcept
+{
+	return transfer(op, aardvarkPriority::normal, cb);
+}
+
+embvm::comm::status aardvarkRemoteSPIMaster::transfer(const embvm::spi::op_t& op,
+													  aardvarkPriority priority,
+													  const embvm::spi::master::cb_t& cb) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::spiTransfer;
+	req.priority = static_cast<uint8_t>(priority);
+	req.tx_length = static_cast<uint32_t>(op.tx_buffer ? op.length : 0);
+	req.rx_length = static_cast<uint32_t>(op.rx_buffer ? op.length : 0);
+
+	bool sent = client_.submit(req, op.tx_buffer, op.rx_buffer, [this, op, cb](int32_t s, uint32_t) {
+		callback(op, s < 0 ? embvm::comm::status::error : static_cast<embvm::comm::status>(s), cb);
+	});
+
+	return sent ? embvm::comm::status::enqueued : embvm::comm::status::busy;
+}
+
+void aardvarkRemoteSPIMaster::setMode_(embvm::spi::mode mode) noexcept
+{
+	assert(((mode == embvm::spi::mode::mode0) || (mode == embvm::spi::mode::mode3)) &&
+		   "Aardvark only supports SPI mode 3 and 0");
+	mode_ = mode;
+	configure_();
+}
+
+void aardvarkRemoteSPIMaster::setOrder_(embvm::spi::order order) noexcept
+{
+	order_ = order;
+	configure_();
+}
+
+/*=========================================================================
+| aardvarkRemoteGPIO
+ ========================================================================*/
+
+aardvarkRemoteGPIO::aardvarkRemoteGPIO(aardvarkShareClient& client, uint8_t pin,
+									   embvm::gpio::mode mode) noexcept
+	: client_(client), pin_(pin), mode_(mode)
+{
+	assert(pin < AARDVARK_IO_COUNT);
+}
+
+void aardvarkRemoteGPIO::set(bool v) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::gpioSet;
+	req.pin = pin_;
+	req.arg = v ? 1 : 0;
+	client_.call(req);
+}
+
+bool aardvarkRemoteGPIO::get() noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::gpioGet;
+	req.pin = pin_;
+
+	uint32_t value = 0;
+	client_.call(req, &value);
+
+	return value != 0;
+}
+
+void aardvarkRemoteGPIO::toggle() noexcept
+{
+	// The server inverts the adapter's output latch, which other clients may have changed
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::gpioToggle;
+	req.pin = pin_;
+	client_.call(req);
+}
+
+void aardvarkRemoteGPIO::setMode(embvm::gpio::mode mode) noexcept
+{
+	aardvarkShareRequest req{};
+	req.command = aardvarkShareCommand::gpioMode;
+	req.pin = pin_;
+	req.arg = static_cast<uint32_t>(mode);
+	client_.call(req);
+
+	mode_ = mode;
+}
+
+embvm::gpio::mode aardvarkRemoteGPIO::mode() noexcept
+{
+	return mode_;
+}
+
+void aardvarkRemoteGPIO::start_() noexcept
+{
+	assert(client_.connected() && "Connect the aardvarkShareClient before starting proxies");
+	setMode(mode_);
+}
+
+void aardvarkRemoteGPIO::stop_() noexcept
+{
+	setMode(embvm::gpio::mode::input);
+}
@@ -0,0 +1,300 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_SHARE_CLIENT_HPP_
+#define AARDVARK_SHARE_CLIENT_HPP_
+
+#include "base.hpp"
+#include "share_protocol.hpp"
+#include <atomic>
+#include <cstdint>
+#include <driver/gpio.hpp>
+#include <driver/i2c.hpp>
+#include <driver/spi.hpp>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace embdrv
+{
+/** Connection to an aardvarkd server
+ *
+ * Most code uses the connection through the aardvarkRemoteI2CMaster, aardvarkRemoteSPIMaster
+ * and aardvarkRemoteGPIO proxies, which implement the same framework interfaces as the local
+ * drivers.
+ *
+ * Transfer buffers are staged through the shared-memory region the server provides. Buffers
+ * obtained from allocate() already live in that region and are passed to the server without
+ * any copy:
+ *
+ * @code
+ * embdrv::aardvarkShareClient client;
+ * client.connect();
+ * embdrv::aardvarkRemoteI2CMaster i2c0{client};
+ * uint8_t* buf = client.allocate(64); // zero-copy transfer buffer
+ * @endcode
+ *
+ * Completion callbacks run on the connection's receive thread. They may submit new
+ * asynchronous requests, but must not make synchronous calls (configuration, GPIO).
+ *
+ * @ingroup AardvarkShare
+ */
+class aardvarkShareClient
+{
+  public:
+	/// Completion callback: receives the response status (negative if the request failed
+	/// before reaching a bus master) and the response value.
+	using completion = std::function<void(int32_t, uint32_t)>;
+
+	/// Default constructor. The client is disconnected until connect() succeeds.
+	aardvarkShareClient() noexcept = default;
+
+	/// Disconnects from the server.
+	~aardvarkShareClient() noexcept;
+
+	/** Connect to a server
+	 *
+	 * @param path The server socket path.
+	 * @returns true if the connection is established.
+	 */
+	bool connect(const char* path = AARDVARK_SHARE_DEFAULT_SOCKET) noexcept;
+
+	/// Disconnect from the server. Outstanding requests complete with an error.
+	void disconnect() noexcept;
+
+	/// Check whether the client is connected.
+	bool connected() const noexcept
+	{
+		return fd_ >= 0 && !lost_;
+	}
+
+	/** Allocate a buffer in the shared-memory region
+	 *
+	 * Transfers that use these buffers are not copied.
+	 *
+	 * @param size The buffer size in bytes.
+	 * @returns the buffer, or nullptr if the region is exhausted or the client is disconnected.
+	 */
+	uint8_t* allocate(size_t size) noexcept;
+
+	/// Release a buffer obtained from allocate().
+	/// @param buffer The buffer to release.
+	void deallocate(uint8_t* buffer) noexcept;
+
+	/** Submit a request asynchronously
+	 *
+	 * req.tx_length and req.rx_length describe the buffers. Buffers outside the shared-memory
+	 * region are copied into it (tx) and back out of it (rx) around the request.
+	 *
+	 * @param req The request. The ID and buffer offsets are filled in.
+	 * @param tx The transmit buffer, or nullptr.
+	 * @param rx The receive buffer, or nullptr. Must remain valid until cb is invoked.
+	 * @param cb The completion callback.
+	 * @returns false if the request could not be sent (disconnected or region exhausted).
+	 */
+	bool submit(aardvarkShareRequest req, const uint8_t* tx, uint8_t* rx,
+				const completion& cb) noexcept;
+
+	/** Perform a request synchronously
+	 *
+	 * @pre Not called from a completion callback.
+	 * @param req The request. Must not carry buffers.
+	 * @param value Receives the response value, or nullptr.
+	 * @returns the response status, or a negative value on failure.
+	 */
+	int32_t call(aardvarkShareRequest req, uint32_t* value = nullptr) noexcept;
+
+  private:
+	/// An outstanding request
+	struct pending
+	{
+		/// The completion callback.
+		completion cb;
+		/// Staging buffer for the transmit data, or nullptr.
+		uint8_t* tx_stage = nullptr;
+		/// Staging buffer for the receive data, or nullptr.
+		uint8_t* rx_stage = nullptr;
+		/// Caller buffer to copy the receive data into, or nullptr.
+		uint8_t* rx_user = nullptr;
+		/// Number of bytes to copy into rx_user.
+		size_t rx_length = 0;
+	};
+
+	/// Receive thread: dispatches responses until the connection closes.
+	void receive_() noexcept;
+
+	/// Check whether a buffer lies entirely inside the shared-memory region.
+	bool inRegion_(const uint8_t* p, size_t length) const noexcept;
+
+	/// Allocate region blocks. @pre lock_ is held.
+	uint8_t* allocateLocked_(size_t size) noexcept;
+
+	/// Release region blocks. @pre lock_ is held.
+	void deallocateLocked_(uint8_t* buffer) noexcept;
+
+  private:
+	/// The connection socket, or -1.
+	int fd_ = -1;
+
+	/// The shared-memory region.
+	uint8_t* region_ = nullptr;
+
+	/// Size of the shared-memory region.
+	size_t region_size_ = 0;
+
+	/// Set by the receive thread when the server closes the connection.
+	std::atomic<bool> lost_{false};
+
+	/// Protects pending_, next_id_ and the block allocator.
+	std::mutex lock_;
+
+	/// Serializes requests written from different threads.
+	std::mutex write_lock_;
+
+	/// Outstanding requests by ID.
+	std::unordered_map<uint32_t, pending> pending_;
+
+	/// Next request ID.
+	uint32_t next_id_ = 0;
+
+	/// Allocation length (in blocks) for each block that starts an allocation, else 0.
+	std::vector<uint32_t> runs_;
+
+	/// Block usage map.
+	std::vector<bool> used_;
+
+	/// The receive thread.
+	std::thread receiver_;
+};
+
+/** I2C master proxy for an aardvarkd server
+ *
+ * Transfers are performed by the aardvarkI2CMaster owned by the server.
+ *
+ * @ingroup AardvarkShare
+ */
+class aardvarkRemoteI2CMaster final : public embvm::i2c::master
+{
+  public:
+	/// Create an I2C proxy.
+	/// @param client The server connection.
+	explicit aardvarkRemoteI2CMaster(aardvarkShareClient& client) noexcept : client_(client) {}
+
+	/// Default destructor
+	~aardvarkRemoteI2CMaster() noexcept = default;
+
+	using embvm::i2c::master::transfer;
+
+	/** Perform an I2C transaction with a priority class
+	 *
+	 * @param op The transaction to perform.
+	 * @param priority The priority class used by the server's scheduler.
+	 * @param cb The callback to invoke once the transaction completes.
+	 * @returns enqueued, or busy if the request could not be sent.
+	 */
+	embvm::i2c::status transfer(const embvm::i2c::op_t& op, aardvarkPriority priority,
+								const embvm::i2c::master::cb_t& cb = nullptr) noexcept;
+
+  private:
+	void start_() noexcept final;
+	void stop_() noexcept final;
+	void configure_(embvm::i2c::pullups pullup) noexcept final;
+	embvm::i2c::status transfer_(const embvm::i2c::op_t& op,
+								 const embvm::i2c::master::cb_t& cb) noexcept final;
+	embvm::i2c::baud baudrate_(embvm::i2c::baud baud) noexcept final;
+	embvm::i2c::pullups setPullups_(embvm::i2c::pullups pullups) noexcept final;
+
+  private:
+	/// The server connection.
+	aardvarkShareClient& client_;
+};
+
+/** SPI master proxy for an aardvarkd server
+ *
+ * Transfers are performed by the aardvarkSPIMaster owned by the server. Mode, bit order and
+ * bitrate are shared by all clients of the server.
+ *
+ * @ingroup AardvarkShare
+ */
+class aardvarkRemoteSPIMaster final : public embvm::spi::master
+{
+  public:
+	/// Create an SPI proxy.
+	/// @param client The server connection.
+	explicit aardvarkRemoteSPIMaster(aardvarkShareClient& client) noexcept : client_(client) {}
+
+	/// Default destructor
+	~aardvarkRemoteSPIMaster() noexcept = default;
+
+	using embvm::spi::master::transfer;
+
+	/** Perform an SPI transfer with a priority class
+	 *
+	 * @param op The transfer to perform.
+	 * @param priority The priority class used by the server's scheduler.
+	 * @param cb The callback to invoke once the transfer completes.
+	 * @returns enqueued, or busy if the request could not be sent.
+	 */
+	embvm::comm::status transfer(const embvm::spi::op_t& op, aardvarkPriority priority,
+								 const embvm::spi::master::cb_t& cb = nullptr) noexcept;
+
+  private:
+	void start_() noexcept final;
+	void stop_() noexcept final;
+	void configure_() noexcept final;
+	uint32_t baudrate_(uint32_t baud) noexcept final;
+	embvm::comm::status transfer_(const embvm::spi::op_t& op,
+								  const embvm::spi::master::cb_t& cb) noexcept final;
+	void setMode_(embvm::spi::mode mode) noexcept final;
+	void setOrder_(embvm::spi::order order) noexcept final;
+
+  private:
+	/// The server connection.
+	aardvarkShareClient& client_;
+};
+
+/** GPIO proxy for an aardvarkd server
+ *
+ * @ingroup AardvarkShare
+ */
+class aardvarkRemoteGPIO final : public embvm::gpio::base
+{
+  public:
+	/** Create a GPIO proxy
+	 *
+	 * @param client The server connection.
+	 * @param pin The Aardvark pin, between (0..5).
+	 * @param mode The GPIO mode applied when the proxy is started.
+	 */
+	aardvarkRemoteGPIO(aardvarkShareClient& client, uint8_t pin,
+					   embvm::gpio::mode mode = embvm::gpio::mode::input) noexcept;
+
+	/// Default destructor
+	~aardvarkRemoteGPIO() noexcept = default;
+
+	void set(bool v) noexcept final;
+	bool get() noexcept final;
+	void toggle() noexcept final;
+	void setMode(embvm::gpio::mode mode) noexcept final;
+	embvm::gpio::mode mode() noexcept final;
+
+  private:
+	void start_() noexcept final;
+	void stop_() noexcept final;
+
+  private:
+	/// The server connection.
+	aardvarkShareClient& client_;
+
+	/// The Aardvark pin.
+	const uint8_t pin_;
+
+	/// Currently configured GPIO mode.
+	embvm::gpio::mode mode_;
+};
+
+} // namespace embdrv
+
+#endif // AARDVARK_SHARE_CLIENT_HPP_
@@ -0,0 +1,117 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/share_protocol.hpp>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace embdrv;
+
+#ifdef MSG_NOSIGNAL
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+bool embdrv::aardvarkShareWrite(int fd, const void* data, size_t size, int pass_fd) noexcept
+{
+	const auto* bytes = static_cast<const uint8_t*>(data);
+	size_t sent = 0;
+
+	while(sent < size)
+	{
+		iovec iov{};
+		iov.iov_base = const_cast<uint8_t*>(bytes + sent);
+		iov.iov_len = size - sent;
+
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+		if(pass_fd >= 0 && sent == 0)
+		{
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			auto* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+		}
+
+		auto r = sendmsg(fd, &msg, SEND_FLAGS);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return false;
+		}
+
+		sent += static_cast<size_t>(r);
+	}
+
+	return true;
+}
+
+bool embdrv::aardvarkShareRead(int fd, void* data, size_t size, int* received_fd) noexcept
+{
+	auto* bytes = static_cast<uint8_t*>(data);
+	size_t received = 0;
+
+	if(received_fd != nullptr)
+	{
+		*received_fd = -1;
+	}
+
+	while(received < size)
+	{
+		iovec iov{};
+		iov.iov_base = bytes + received;
+		iov.iov_len = size - received;
+
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+		if(received_fd != nullptr)
+		{
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+		}
+
+		auto r = recvmsg(fd, &msg, 0);
+		if(r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(r <= 0)
+		{
+			return false;
+		}
+
+		if(received_fd != nullptr)
+		{
+			for(auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			{
+				if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				{
+					memcpy(received_fd, CMSG_DATA(cmsg), sizeof(int));
+				}
+			}
+		}
+
+		received += static_cast<size_t>(r);
+	}
+
+	return true;
+}
@@ -0,0 +1,155 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_SHARE_PROTOCOL_HPP_
+#define AARDVARK_SHARE_PROTOCOL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/** @defgroup AardvarkShare Aardvark adapter sharing
+ *
+ * Only one process can open an Aardvark port. aardvarkd owns the adapter and serves I2C,
+ * SPI and GPIO requests to other processes over a Unix domain socket.
+ *
+ * When a client connects, the server creates a shared-memory region for it and passes the
+ * file descriptor back with the aardvarkShareHello message. Transfer payloads are placed in
+ * that region, so requests and responses on the socket only carry offsets. The server hands
+ * pointers into the region straight to the bus masters, so payloads are never copied on the
+ * server side.
+ *
+ * The client manages its region with a block allocator rather than a ring. Requests complete
+ * out of order (the I2C and SPI masters run independently and schedule by deadline), and
+ * aardvarkShareClient::allocate() hands out buffers that stay valid for as long as the caller
+ * needs them. A ring could only reclaim space behind its oldest outstanding buffer.
+ *
+ * All messages are fixed-size structures in host byte order, since both ends run on the
+ * same machine.
+ *
+ * @{
+ */
+
+/// Default path of the aardvarkd socket.
+inline constexpr const char* AARDVARK_SHARE_DEFAULT_SOCKET = "/tmp/aardvarkd.sock";
+
+/// Identifies an aardvarkd hello message.
+inline constexpr uint32_t AARDVARK_SHARE_MAGIC = 0x41415644; // "AAVD"
+
+/// Protocol version. Bumped whenever a message layout changes.
+inline constexpr uint16_t AARDVARK_SHARE_VERSION = 1;
+
+/// Default size of the shared-memory region created for each client.
+inline constexpr size_t AARDVARK_SHARE_DEFAULT_REGION_SIZE = 256 * 1024;
+
+/// Request commands. All commands other than the transfers change settings shared by every
+/// client of the server.
+enum class aardvarkShareCommand : uint8_t
+{
+	/// Perform an I2C transaction. Asynchronous.
+	i2cTransfer = 0,
+	/// Set the I2C bitrate. arg is the embvm::i2c::baud value, between 1 kHz and 800 kHz.
+	i2cBaudrate,
+	/// Enable (arg != 0) or disable the I2C pullups.
+	i2cPullups,
+	/// Perform an SPI transfer. Asynchronous.
+	spiTransfer,
+	/// Set the SPI bitrate. arg is the bitrate in Hz, between 125 kHz and 8 MHz.
+	spiBaudrate,
+	/// Set the SPI mode (pin, mode0 or mode3) and bit order (arg).
+	spiConfigure,
+	/// Set the GPIO mode of pin to arg (embvm::gpio::mode input or output).
+	gpioMode,
+	/// Drive GPIO pin high (arg != 0) or low.
+	gpioSet,
+	/// Read GPIO pin.
+	gpioGet,
+	/// Invert the output level of GPIO pin.
+	gpioToggle,
+};
+
+/// Client to server request
+struct aardvarkShareRequest
+{
+	/// Request ID, echoed in the response.
+	uint32_t id;
+	/// The command to perform.
+	aardvarkShareCommand command;
+	/// The aardvarkPriority of the request.
+	uint8_t priority;
+	/// I2C: the embvm::i2c::operation to perform.
+	uint8_t i2c_op;
+	/// GPIO: the pin. spiConfigure: the embvm::spi::mode.
+	uint8_t pin;
+	/// I2C: the target address.
+	uint16_t address;
+	/// Reserved, must be 0.
+	uint16_t reserved;
+	/// Command argument.
+	uint32_t arg;
+	/// Offset of the transmit data in the shared-memory region.
+	uint32_t tx_offset;
+	/// Number of bytes to transmit.
+	uint32_t tx_length;
+	/// Offset of the receive buffer in the shared-memory region.
+	uint32_t rx_offset;
+	/// Number of bytes to receive.
+	uint32_t rx_length;
+};
+
+/// Server to client response
+struct aardvarkShareResponse
+{
+	/// ID of the request this response completes.
+	uint32_t id;
+	/// The embvm::i2c::status or embvm::comm::status of the request, or a negative value
+	/// if the server rejected it.
+	int32_t status;
+	/// Command result (bitrate, GPIO level).
+	uint32_t value;
+};
+
+/// First message sent by the server, carrying the shared-memory file descriptor
+struct aardvarkShareHello
+{
+	/// Always AARDVARK_SHARE_MAGIC.
+	uint32_t magic;
+	/// The server's AARDVARK_SHARE_VERSION.
+	uint16_t version;
+	/// Reserved, always 0.
+	uint16_t reserved;
+	/// Size of the shared-memory region in bytes.
+	uint32_t region_size;
+};
+
+/** Write a complete message to a socket
+ *
+ * @param fd The socket.
+ * @param data The message.
+ * @param size The message size.
+ * @param pass_fd A file descriptor to pass along with the message, or -1.
+ * @returns true if the whole message was written.
+ */
+bool aardvarkShareWrite(int fd, const void* data, size_t size, int pass_fd = -1) noexcept;
+
+/** Read a complete message from a socket
+ *
+ * @param fd The socket.
+ * @param data Storage for the message.
+ * @param size The message size.
+ * @param received_fd Receives a passed file descriptor (or -1), or nullptr if none is expected.
+ * @returns true if the whole message was read, false on error or end of stream.
+ */
+bool aardvarkShareRead(int fd, void* data, size_t size, int* received_fd = nullptr) noexcept;
+
+/// @}
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_SHARE_PROTOCOL_HPP_
@@ -0,0 +1,641 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/share_server.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace embdrv;
+
+#ifdef MSG_NOSIGNAL
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+/// Requests buffered per client before the server stops reading from its socket.
+constexpr size_t MAX_PENDING_PER_CLIENT = 64;
+
+/// Highest 7-bit I2C address.
+constexpr uint16_t I2C_MAX_ADDRESS = 0x7f;
+
+/// Bitrate ranges supported by the adapter, in Hz.
+constexpr uint32_t I2C_MIN_BAUDRATE = 1000;
+constexpr uint32_t I2C_MAX_BAUDRATE = 800000;
+constexpr uint32_t SPI_MIN_BAUDRATE = 125000;
+constexpr uint32_t SPI_MAX_BAUDRATE = 8000000;
+
+aardvarkShareServer::client::~client() noexcept
+{
+	if(region != nullptr)
+	{
+		munmap(region, region_size);
+	}
+
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+aardvarkShareServer::aardvarkShareServer(aardvarkAdapter& adapter, aardvarkI2CMaster* i2c,
+										 aardvarkSPIMaster* spi,
+										 const aardvarkShareServerConfig& cfg) noexcept
+	: adapter_(adapter), i2c_(i2c), spi_(spi), cfg_(cfg)
+{
+	assert(cfg_.max_inflight > 0 && cfg_.region_size > 0);
+
+	int r = pipe(wake_fds_);
+	assert(r == 0 && "Failed to create the wake pipe");
+	(void)r;
+
+	for(auto fd : wake_fds_)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+}
+
+aardvarkShareServer::~aardvarkShareServer() noexcept
+{
+	stop();
+
+	// Completions still queued on the bus masters refer to this server
+	while(outstanding_.load() != 0)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	clients_.clear();
+
+	if(listen_fd_ >= 0)
+	{
+		close(listen_fd_);
+		unlink(path_.data());
+	}
+
+	close(wake_fds_[0]);
+	close(wake_fds_[1]);
+}
+
+bool aardvarkShareServer::listen(const char* path) noexcept
+{
+	assert(listen_fd_ < 0 && "Server is already listening");
+
+	sockaddr_un addr{};
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		return false;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	// Replace a socket file left behind by a server that did not shut down cleanly
+	unlink(path);
+
+	if(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+	   ::listen(fd, static_cast<int>(cfg_.max_clients)) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	listen_fd_ = fd;
+	path_.assign(path, path + strlen(path) + 1);
+
+	return true;
+}
+
+void aardvarkShareServer::stop() noexcept
+{
+	stopping_ = true;
+	wake_();
+}
+
+aardvarkShareServerStats aardvarkShareServer::statistics() const noexcept
+{
+	aardvarkShareServerStats stats{};
+
+	lock_.lock();
+	stats.clients = static_cast<uint32_t>(clients_.size());
+	lock_.unlock();
+
+	stats.connections = connections_.load(std::memory_order_relaxed);
+	stats.completed = completed_.load(std::memory_order_relaxed);
+	stats.rejected = rejected_.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
+void aardvarkShareServer::run() noexcept
+{
+	assert(listen_fd_ >= 0 && "listen() must succeed before run()");
+
+	std::vector<pollfd> fds;
+	std::vector<std::shared_ptr<client>> polled;
+
+	while(!stopping_)
+	{
+		fds.clear();
+		polled.clear();
+
+		fds.push_back({listen_fd_, POLLIN, 0});
+		fds.push_back({wake_fds_[0], POLLIN, 0});
+
+		lock_.lock();
+		for(const auto& c : clients_)
+		{
+			// Stop reading from clients with a full backlog, so they block on the socket
+			short events = (c->pending.size() < MAX_PENDING_PER_CLIENT) ? POLLIN : 0;
+			if(!c->responses.empty())
+			{
+				events |= POLLOUT;
+			}
+
+			if(events != 0)
+			{
+				fds.push_back({c->fd, events, 0});
+				polled.push_back(c);
+			}
+		}
+		lock_.unlock();
+
+		if(poll(fds.data(), fds.size(), -1) < 0)
+		{
+			continue;
+		}
+
+		if(fds[1].revents & POLLIN)
+		{
+			char drain[64];
+			while(read(wake_fds_[0], drain, sizeof(drain)) > 0)
+			{
+			}
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			accept_();
+		}
+
+		for(size_t i = 0; i < polled.size(); i++)
+		{
+			auto revents = fds[i + 2].revents;
+			bool open = true;
+
+			if(revents & POLLOUT)
+			{
+				open = flush_(polled[i]);
+			}
+
+			if(open && (revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				open = receive_(polled[i]);
+			}
+
+			if(!open)
+			{
+				// Requests already on the bus masters still complete, but nobody reads the result
+				std::lock_guard<std::mutex> lock(lock_);
+				polled[i]->pending.clear();
+				clients_.erase(std::find(clients_.begin(), clients_.end(), polled[i]));
+			}
+		}
+
+		dispatch_();
+	}
+}
+
+void aardvarkShareServer::accept_() noexcept
+{
+	int fd = accept(listen_fd_, nullptr, nullptr);
+	if(fd < 0)
+	{
+		return;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	auto c = std::make_shared<client>();
+	c->fd = fd;
+
+	lock_.lock();
+	bool full = clients_.size() >= cfg_.max_clients;
+	lock_.unlock();
+
+	if(full)
+	{
+		// The client sees the connection close before the hello message
+		return;
+	}
+
+	// Create an anonymous shared-memory object: the name only exists until it is unlinked
+	char name[64];
+	snprintf(name, sizeof(name), "/aardvarkd-%d-%u", static_cast<int>(getpid()),
+			 connections_.load());
+
+	int shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(shm_fd < 0)
+	{
+		return;
+	}
+
+	shm_unlink(name);
+
+	if(ftruncate(shm_fd, static_cast<off_t>(cfg_.region_size)) == 0)
+	{
+		void* region =
+			mmap(nullptr, cfg_.region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+		if(region != MAP_FAILED)
+		{
+			c->region = static_cast<uint8_t*>(region);
+			c->region_size = cfg_.region_size;
+		}
+	}
+
+	aardvarkShareHello hello{};
+	hello.magic = AARDVARK_SHARE_MAGIC;
+	hello.version = AARDVARK_SHARE_VERSION;
+	hello.region_size = static_cast<uint32_t>(c->region_size);
+
+	bool ok = c->region != nullptr && aardvarkShareWrite(fd, &hello, sizeof(hello), shm_fd);
+	close(shm_fd);
+
+	// Everything after the hello message is written from run() when the socket is writable
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if(ok)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		clients_.push_back(std::move(c));
+		connections_++;
+	}
+}
+
+bool aardvarkShareServer::receive_(const std::shared_ptr<client>& c) noexcept
+{
+	while(true)
+	{
+		auto r = recv(c->fd, c->partial.data() + c->partial_length,
+					  c->partial.size() - c->partial_length, 0);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			// Nothing more to read for now; the rest of a partial request arrives later
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		if(r == 0)
+		{
+			return false;
+		}
+
+		c->partial_length += static_cast<size_t>(r);
+		if(c->partial_length < c->partial.size())
+		{
+			continue;
+		}
+
+		aardvarkShareRequest req{};
+		memcpy(&req, c->partial.data(), sizeof(req));
+		c->partial_length = 0;
+
+		std::lock_guard<std::mutex> lock(lock_);
+		c->pending.push_back(req);
+		if(c->pending.size() >= MAX_PENDING_PER_CLIENT)
+		{
+			return true;
+		}
+	}
+}
+
+bool aardvarkShareServer::flush_(const std::shared_ptr<client>& c) noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+
+	while(!c->responses.empty())
+	{
+		const auto* bytes = reinterpret_cast<const uint8_t*>(&c->responses.front());
+		auto r = send(c->fd, bytes + c->response_offset,
+					  sizeof(aardvarkShareResponse) - c->response_offset, SEND_FLAGS);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		c->response_offset += static_cast<size_t>(r);
+		if(c->response_offset == sizeof(aardvarkShareResponse))
+		{
+			c->responses.pop_front();
+			c->response_offset = 0;
+			c->inflight--;
+		}
+	}
+
+	return true;
+}
+
+void aardvarkShareServer::dispatch_() noexcept
+{
+	bool progress = true;
+
+	while(progress)
+	{
+		progress = false;
+
+		// One round: at most one request from each client
+		for(size_t n = 0;; n++)
+		{
+			std::shared_ptr<client> c;
+			aardvarkShareRequest req{};
+
+			lock_.lock();
+			if(n >= clients_.size())
+			{
+				lock_.unlock();
+				break;
+			}
+
+			// A configuration command waits for the client's earlier requests, and the
+			// client's later requests wait for it
+			auto& candidate = clients_[(next_ + n) % clients_.size()];
+			if(!candidate->pending.empty() && candidate->inflight < cfg_.max_inflight &&
+			   !candidate->configuring &&
+			   (!configCommand_(candidate->pending.front().command) || candidate->inflight == 0))
+			{
+				c = candidate;
+				req = c->pending.front();
+				c->pending.pop_front();
+				c->inflight++;
+				outstanding_++;
+			}
+			lock_.unlock();
+
+			if(c)
+			{
+				execute_(c, req);
+				progress = true;
+			}
+		}
+
+		lock_.lock();
+		next_ = clients_.empty() ? 0 : (next_ + 1) % clients_.size();
+		lock_.unlock();
+	}
+}
+
+bool aardvarkShareServer::valid_(const client& c, const aardvarkShareRequest& req) const noexcept
+{
+	// The adapter transfers at most UINT16_MAX bytes per transaction
+	auto fits = [&c](uint32_t offset, uint32_t length) {
+		return length <= UINT16_MAX &&
+			   static_cast<size_t>(offset) + static_cast<size_t>(length) <= c.region_size;
+	};
+	bool buffers = fits(req.tx_offset, req.tx_length) && fits(req.rx_offset, req.rx_length);
+
+	switch(req.command)
+	{
+		case aardvarkShareCommand::i2cTransfer:
+			return i2c_ != nullptr && buffers && req.address <= I2C_MAX_ADDRESS &&
+				   i2cOperation_(req.i2c_op);
+		case aardvarkShareCommand::spiTransfer:
+			return spi_ != nullptr && buffers &&
+				   (req.tx_length == 0 || req.rx_length == 0 || req.tx_length == req.rx_length);
+		case aardvarkShareCommand::i2cBaudrate:
+			return i2c_ != nullptr && req.arg >= I2C_MIN_BAUDRATE && req.arg <= I2C_MAX_BAUDRATE;
+		case aardvarkShareCommand::i2cPullups:
+			return true;
+		case aardvarkShareCommand::spiBaudrate:
+			return spi_ != nullptr && req.arg >= SPI_MIN_BAUDRATE && req.arg <= SPI_MAX_BAUDRATE;
+		case aardvarkShareCommand::spiConfigure:
+			return spi_ != nullptr &&
+				   (req.pin == static_cast<uint8_t>(embvm::spi::mode::mode0) ||
+					req.pin == static_cast<uint8_t>(embvm::spi::mode::mode3)) &&
+				   (req.arg == static_cast<uint32_t>(embvm::spi::order::msbFirst) ||
+					req.arg == static_cast<uint32_t>(embvm::spi::order::lsbFirst));
+		case aardvarkShareCommand::gpioMode:
+			return gpioAvailable_(req.pin) &&
+				   (req.arg == static_cast<uint32_t>(embvm::gpio::mode::input) ||
+					req.arg == static_cast<uint32_t>(embvm::gpio::mode::output));
+		case aardvarkShareCommand::gpioSet:
+		case aardvarkShareCommand::gpioGet:
+		case aardvarkShareCommand::gpioToggle:
+			return gpioAvailable_(req.pin);
+		default:
+			return false;
+	}
+}
+
+bool aardvarkShareServer::i2cOperation_(uint8_t op) noexcept
+{
+	switch(static_cast<embvm::i2c::operation>(op))
+	{
+		case embvm::i2c::operation::continueWriteStop:
+		case embvm::i2c::operation::write:
+		case embvm::i2c::operation::writeNoStop:
+		case embvm::i2c::operation::continueWriteNoStop:
+		case embvm::i2c::operation::read:
+		case embvm::i2c::operation::writeRead:
+		case embvm::i2c::operation::ping:
+		case embvm::i2c::operation::stop:
+		case embvm::i2c::operation::restart:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void aardvarkShareServer::execute_(const std::shared_ptr<client>& c,
+								   const aardvarkShareRequest& req) noexcept
+{
+	// Client values must never reach the drivers unchecked: they assert on invalid arguments
+	if(!valid_(*c, req))
+	{
+		rejected_++;
+		complete_(c, req.id, -1, 0);
+		return;
+	}
+
+	aardvarkSchedule schedule{};
+	if(req.priority < static_cast<uint8_t>(aardvarkPriority::count))
+	{
+		schedule.priority = static_cast<aardvarkPriority>(req.priority);
+	}
+
+	uint8_t* tx = req.tx_length ? c->region + req.tx_offset : nullptr;
+	uint8_t* rx = req.rx_length ? c->region + req.rx_offset : nullptr;
+	auto id = req.id;
+
+	switch(req.command)
+	{
+		case aardvarkShareCommand::i2cTransfer: {
+			embvm::i2c::op_t op{};
+			op.op = static_cast<embvm::i2c::operation>(req.i2c_op);
+			op.address = static_cast<uint8_t>(req.address);
+			op.tx_buffer = tx;
+			op.tx_size = req.tx_length;
+			op.rx_buffer = rx;
+			op.rx_size = req.rx_length;
+
+			i2c_->transfer(op, schedule, [this, c, id](embvm::i2c::op_t, embvm::i2c::status s) {
+				complete_(c, id, static_cast<int32_t>(s), 0);
+			});
+			break;
+		}
+		case aardvarkShareCommand::spiTransfer: {
+			embvm::spi::op_t op{};
+			op.tx_buffer = tx;
+			op.rx_buffer = rx;
+			op.length = std::max(req.tx_length, req.rx_length);
+
+			spi_->transfer(op, schedule, [this, c, id](embvm::spi::op_t, embvm::comm::status s) {
+				complete_(c, id, static_cast<int32_t>(s), 0);
+			});
+			break;
+		}
+		default: {
+			std::lock_guard<std::mutex> lock(lock_);
+			c->configuring = true;
+			config_.push_back({c, req});
+			enqueue(aardvarkQueueToken{});
+			break;
+		}
+	}
+}
+
+void aardvarkShareServer::process_(const aardvarkQueueToken& token) noexcept
+{
+	(void)token;
+
+	lock_.lock();
+	auto cfg = std::move(config_.front());
+	config_.pop_front();
+	lock_.unlock();
+
+	configure_(cfg.c, cfg.req);
+}
+
+void aardvarkShareServer::configure_(const std::shared_ptr<client>& c,
+									 const aardvarkShareRequest& req) noexcept
+{
+	int32_t status = 0;
+	uint32_t value = 0;
+
+	switch(req.command)
+	{
+		case aardvarkShareCommand::i2cBaudrate:
+			value = static_cast<uint32_t>(i2c_->baudrate(static_cast<embvm::i2c::baud>(req.arg)));
+			status = static_cast<int32_t>(embvm::i2c::status::ok);
+			break;
+		case aardvarkShareCommand::i2cPullups:
+			value = adapter_.i2cPullups(req.arg != 0);
+			break;
+		case aardvarkShareCommand::spiBaudrate:
+			value = spi_->baudrate(req.arg);
+			status = static_cast<int32_t>(embvm::comm::status::ok);
+			break;
+		case aardvarkShareCommand::spiConfigure:
+			spi_->mode(static_cast<embvm::spi::mode>(req.pin));
+			spi_->order(static_cast<embvm::spi::order>(req.arg));
+			status = static_cast<int32_t>(embvm::comm::status::ok);
+			break;
+		case aardvarkShareCommand::gpioMode:
+			adapter_.setGPIOMode(req.pin, static_cast<embvm::gpio::mode>(req.arg));
+			break;
+		case aardvarkShareCommand::gpioSet:
+			adapter_.setGPIOOutput(req.pin, req.arg != 0);
+			break;
+		case aardvarkShareCommand::gpioGet:
+			value = adapter_.readGPIO(req.pin);
+			break;
+		case aardvarkShareCommand::gpioToggle:
+			adapter_.toggleGPIO(req.pin);
+			break;
+		default:
+			assert(0 && "Not a configuration command");
+			break;
+	}
+
+	lock_.lock();
+	c->configuring = false;
+	lock_.unlock();
+
+	complete_(c, req.id, status, value);
+}
+
+bool aardvarkShareServer::configCommand_(aardvarkShareCommand command) noexcept
+{
+	return command != aardvarkShareCommand::i2cTransfer &&
+		   command != aardvarkShareCommand::spiTransfer;
+}
+
+void aardvarkShareServer::complete_(const std::shared_ptr<client>& c, uint32_t id, int32_t status,
+									uint32_t value) noexcept
+{
+	aardvarkShareResponse resp{};
+	resp.id = id;
+	resp.status = status;
+	resp.value = value;
+
+	// A client that disconnected simply misses its responses
+	lock_.lock();
+	c->responses.push_back(resp);
+	lock_.unlock();
+
+	completed_.fetch_add(1, std::memory_order_relaxed);
+	wake_();
+
+	// Must be last: the server may be destroyed as soon as this reaches zero
+	outstanding_--;
+}
+
+bool aardvarkShareServer::gpioAvailable_(uint8_t pin) const noexcept
+{
+	if(pin >= AARDVARK_IO_COUNT)
+	{
+		return false;
+	}
+
+	// Pins 0-1 carry I2C and pins 2-5 carry SPI when those buses are enabled
+	auto mode = static_cast<uint8_t>(adapter_.mode());
+	uint8_t bus = (pin < 2) ? static_cast<uint8_t>(aardvarkMode::GpioI2C)
+							: static_cast<uint8_t>(aardvarkMode::SpiGpio);
+
+	return (mode & bus) == 0;
+}
+
+void aardvarkShareServer::wake_() noexcept
+{
+	const char b = 0;
+	// A full pipe already guarantees a wakeup
+	(void)!write(wake_fds_[1], &b, 1);
+}
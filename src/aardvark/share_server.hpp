@@ -0,0 +1,255 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_SHARE_SERVER_HPP_
+#define AARDVARK_SHARE_SERVER_HPP_
+
+#include "base.hpp"
+#include "i2c.hpp"
+#include "schedule.hpp"
+#include "share_protocol.hpp"
+#include "spi.hpp"
+#include <active_object/active_object.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace embdrv
+{
+/// Activity counters of an aardvarkShareServer
+/// @ingroup AardvarkShare
+struct aardvarkShareServerStats
+{
+	/// Clients currently connected.
+	uint32_t clients;
+	/// Clients accepted since the server started.
+	uint32_t connections;
+	/// Requests completed.
+	uint32_t completed;
+	/// Requests rejected because they were malformed or targeted a missing bus.
+	uint32_t rejected;
+};
+
+/// Parameters of an aardvarkShareServer
+/// @ingroup AardvarkShare
+struct aardvarkShareServerConfig
+{
+	/// Size of the shared-memory region created for each client.
+	size_t region_size = AARDVARK_SHARE_DEFAULT_REGION_SIZE;
+	/// Maximum number of requests per client queued on the bus masters.
+	size_t max_inflight = 8;
+	/// Maximum number of connected clients.
+	size_t max_clients = 16;
+};
+
+/** Serve an Aardvark adapter to other processes
+ *
+ * The server owns the adapter's bus masters on behalf of its clients. It accepts connections
+ * on a Unix domain socket, creates a shared-memory region for each client, and performs the
+ * client's requests using pointers into that region.
+ *
+ * Requests from different clients are dispatched round-robin, one request per client per
+ * round, and each client may have at most aardvarkShareServerConfig::max_inflight requests
+ * queued on the bus masters at a time. A client that floods the server therefore cannot delay the others by
+ * more than one round. Requests from the same client are dispatched in order.
+ *
+ * run() performs all socket I/O on the calling thread, and client sockets are non-blocking.
+ * Completions arrive on the bus masters' worker threads. Their responses are queued and
+ * written by run() once the client's socket is writable, so a client that stops reading
+ * cannot stall a worker thread. Responses that were not yet delivered count against the
+ * client's in-flight limit.
+ *
+ * Configuration commands (bitrates, SPI mode and bit order, pullups, and GPIO) change the
+ * shared adapter, so they apply to every client, just as for devices sharing a physical bus.
+ * They call into the adapter synchronously, so they run on the server's own worker thread
+ * rather than on run(). Each one waits for the client's earlier requests to complete, and the
+ * client's later requests wait for it, so a client's transfers always see the settings it
+ * requested before them.
+ *
+ * @code
+ * embdrv::aardvarkAdapter aardvark{embdrv::aardvarkMode::SpiI2C};
+ * embdrv::aardvarkI2CMaster i2c0{aardvark};
+ * embdrv::aardvarkSPIMaster spi0{aardvark};
+ * embdrv::aardvarkShareServer server{aardvark, &i2c0, &spi0};
+ * i2c0.start();
+ * spi0.start();
+ * if(server.listen(embdrv::AARDVARK_SHARE_DEFAULT_SOCKET))
+ * {
+ *	server.run();
+ * }
+ * @endcode
+ *
+ * @ingroup AardvarkShare
+ */
+class aardvarkShareServer final
+	: public embutil::activeObject<aardvarkShareServer, aardvarkQueueToken>
+{
+  public:
+	/** Create a server
+	 *
+	 * @param adapter The adapter to serve. Used directly for GPIO and pullup requests.
+	 * @param i2c The I2C master to serve, or nullptr if I2C is not available.
+	 * @param spi The SPI master to serve, or nullptr if SPI is not available.
+	 * @param cfg The server parameters.
+	 */
+	aardvarkShareServer(aardvarkAdapter& adapter, aardvarkI2CMaster* i2c, aardvarkSPIMaster* spi,
+						const aardvarkShareServerConfig& cfg = {}) noexcept;
+
+	/// Closes the socket and all client connections.
+	~aardvarkShareServer() noexcept;
+
+	/** Bind the server socket
+	 *
+	 * A stale socket file left at path by a previous server is replaced.
+	 *
+	 * @param path The socket path.
+	 * @returns true if the server is listening.
+	 */
+	bool listen(const char* path) noexcept;
+
+	/// Serve clients until stop() is called.
+	/// @pre listen() succeeded.
+	void run() noexcept;
+
+	/// Make run() return. Safe to call from a signal handler.
+	void stop() noexcept;
+
+	/// Get the server's activity counters.
+	/// @returns a snapshot of the counters.
+	aardvarkShareServerStats statistics() const noexcept;
+
+	/// Active object process function: performs one queued configuration command.
+	void process_(const aardvarkQueueToken& token) noexcept;
+
+  private:
+	/// A connected client
+	struct client
+	{
+		/// Unmaps the region and closes the connection.
+		~client() noexcept;
+
+		/// The connection socket.
+		int fd = -1;
+		/// The shared-memory region.
+		uint8_t* region = nullptr;
+		/// Size of the shared-memory region.
+		size_t region_size = 0;
+		/// Bytes of a request that has not been received completely yet.
+		std::array<uint8_t, sizeof(aardvarkShareRequest)> partial{};
+		/// Number of valid bytes in partial.
+		size_t partial_length = 0;
+		/// Requests received and not yet dispatched. Protected by the server lock.
+		std::deque<aardvarkShareRequest> pending;
+		/// Requests dispatched and not yet answered. Protected by the server lock.
+		size_t inflight = 0;
+		/// Responses waiting to be written. Protected by the server lock.
+		std::deque<aardvarkShareResponse> responses;
+		/// Bytes of responses.front() already written. Protected by the server lock.
+		size_t response_offset = 0;
+		/// A configuration command is in progress, and later requests wait for it.
+		/// Protected by the server lock.
+		bool configuring = false;
+	};
+
+	/// A configuration command queued for the worker thread
+	struct configRequest
+	{
+		/// The client that sent the command.
+		std::shared_ptr<client> c;
+		/// The command.
+		aardvarkShareRequest req;
+	};
+
+	/// Accept a new client and send it its shared-memory region.
+	void accept_() noexcept;
+
+	/// Read the requests available on a client's socket, keeping a partial request for later.
+	/// @returns false if the connection was closed.
+	bool receive_(const std::shared_ptr<client>& c) noexcept;
+
+	/// Write queued responses until the client's socket is full.
+	/// @returns false if the connection was closed.
+	bool flush_(const std::shared_ptr<client>& c) noexcept;
+
+	/// Dispatch pending requests round-robin until every client is idle or at its limit.
+	void dispatch_() noexcept;
+
+	/// Perform a request, or queue it for the worker thread if it is a configuration command.
+	void execute_(const std::shared_ptr<client>& c, const aardvarkShareRequest& req) noexcept;
+
+	/// Perform a configuration command.
+	void configure_(const std::shared_ptr<client>& c, const aardvarkShareRequest& req) noexcept;
+
+	/// Check whether a command is a configuration command, performed by the worker thread.
+	static bool configCommand_(aardvarkShareCommand command) noexcept;
+
+	/// Queue a response for a completed request. Thread-safe.
+	void complete_(const std::shared_ptr<client>& c, uint32_t id, int32_t status,
+				   uint32_t value) noexcept;
+
+	/// Check that a request is well formed, its arguments are in range, its buffers lie
+	/// inside the client's region, and it targets an available bus or pin.
+	bool valid_(const client& c, const aardvarkShareRequest& req) const noexcept;
+
+	/// Check whether an I2C operation is supported by aardvarkI2CMaster.
+	static bool i2cOperation_(uint8_t op) noexcept;
+
+	/// Check whether a pin is usable as GPIO in the adapter's current mode.
+	bool gpioAvailable_(uint8_t pin) const noexcept;
+
+	/// Wake run() so it dispatches more requests.
+	void wake_() noexcept;
+
+  private:
+	/// The adapter being served.
+	aardvarkAdapter& adapter_;
+
+	/// The I2C master being served, or nullptr.
+	aardvarkI2CMaster* const i2c_;
+
+	/// The SPI master being served, or nullptr.
+	aardvarkSPIMaster* const spi_;
+
+	/// Server parameters.
+	const aardvarkShareServerConfig cfg_;
+
+	/// The listening socket.
+	int listen_fd_ = -1;
+
+	/// Self-pipe used to wake run() from other threads and signal handlers.
+	int wake_fds_[2] = {-1, -1};
+
+	/// The socket path, removed when the server is destroyed.
+	std::vector<char> path_;
+
+	/// Set by stop().
+	std::atomic<bool> stopping_{false};
+
+	/// Protects the client list and the client request queues.
+	mutable std::mutex lock_;
+
+	/// Connected clients.
+	std::vector<std::shared_ptr<client>> clients_;
+
+	/// Configuration commands waiting for the worker thread. Protected by lock_.
+	std::deque<configRequest> config_;
+
+	/// Client that is served first in the next dispatch round.
+	size_t next_ = 0;
+
+	/// Requests dispatched to the bus masters and not yet completed, across all clients.
+	std::atomic<uint32_t> outstanding_{0};
+
+	/// Activity counters.
+	std::atomic<uint32_t> connections_{0};
+	std::atomic<uint32_t> completed_{0};
+	std::atomic<uint32_t> rejected_{0};
+};
+
+} // namespace embdrv
+
+#endif // AARDVARK_SHARE_SERVER_HPP_
@@ -3,6 +3,9 @@
 
 #include "vendor/aardvark.h"
 #include <aardvark/spi.hpp>
+#include <algorithm>
+#include <cassert>
+#include <mutex>
 #include <vector>
 
 using namespace embdrv;
@@ -13,66 +16,186 @@ aardvarkSPIMaster::~aardvarkSPIMaster() noexcept = default;
 
 void aardvarkSPIMaster::start_() noexcept
 {
-	base_driver_.start();
+	base_driver_.attach();
 }
 
 void aardvarkSPIMaster::stop_() noexcept
 {
-	base_driver_.stop();
+	base_driver_.detach();
 }
 
 uint32_t aardvarkSPIMaster::baudrate_(uint32_t baud) noexcept
 {
 	base_driver_.lock();
-	auto set_baud = aa_spi_bitrate(base_driver_.handle(),
-								   static_cast<int>(baud / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR));
+	// An explicit bitrate request overrides automatic tuning
+	autotune_ = false;
+	auto set_baud =
+		base_driver_.spiBitrate(static_cast<int>(baud / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR));
 	base_driver_.unlock();
 
-	assert(set_baud == static_cast<int>(baud / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR));
-	// TODO: tolerance checks
+	// The adapter selects the closest bitrate it supports, which may differ from the request.
+	// Report the bitrate that is actually in effect.
+	assert(set_baud > 0 && "Failed to set SPI bitrate");
 
-	return baud;
+	return static_cast<uint32_t>(set_baud) * INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR;
+}
+
+void aardvarkSPIMaster::autoTuneBitrate(const aardvarkBitrateTuner::config& cfg) noexcept
+{
+	assert(started() && "Enabling bitrate tuning before starting not supported\n");
+
+	std::lock_guard<aardvarkAdapter> lock(base_driver_);
+
+	auto khz = tuner_.reset(cfg);
+	auto set_baud = base_driver_.spiBitrate(static_cast<int>(khz));
+	assert(set_baud > 0 && "Failed to set SPI bitrate");
+	tuner_.applied(static_cast<uint32_t>(set_baud));
+
+	autotune_ = true;
+}
+
+void aardvarkSPIMaster::disableBitrateAutoTune() noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(base_driver_);
+	autotune_ = false;
+}
+
+aardvarkBitrateTuner::stats aardvarkSPIMaster::bitrateTunerStats() noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(base_driver_);
+	return tuner_.statistics();
 }
 
 void aardvarkSPIMaster::configure_() noexcept
 {
 	if(started())
 	{
-		auto bitorder =
-			order_ == embvm::spi::order::msbFirst ? AA_SPI_BITORDER_MSB : AA_SPI_BITORDER_LSB;
-		base_driver_.lock();
-		aa_spi_configure(base_driver_.handle(),
-						 static_cast<AardvarkSpiPolarity>(static_cast<int>(mode_) >> 1),
-						 static_cast<AardvarkSpiPhase>(static_cast<int>(mode_) & 1), bitorder);
-		base_driver_.unlock();
+		base_driver_.spiConfigure(mode_, order_);
 	}
 }
 
 embvm::comm::status aardvarkSPIMaster::transfer_(const embvm::spi::op_t& op,
 												 const embvm::spi::master::cb_t& cb) noexcept
 {
-	enqueue({op, cb});
+	return transfer(op, aardvarkSchedule{}, cb);
+}
+
+embvm::comm::status aardvarkSPIMaster::transfer(const embvm::spi::op_t& op,
+												const aardvarkSchedule& schedule,
+												const embvm::spi::master::cb_t& cb) noexcept
+{
+	aardvarkSPIRequest req{};
+	req.op = op;
+	req.cb = cb;
+	// Grouped transfers must keep their chip select asserted, so they are never split
+	req.chunk = (schedule.group == 0) ? schedule.chunk : 0;
+	aardvarkRequestQueue<aardvarkSPIRequest>::stamp(req.timing, schedule);
+
+	queue_.push(std::move(req));
+	enqueue(aardvarkQueueToken{});
 
 	return embvm::comm::status::enqueued;
 }
 
-void aardvarkSPIMaster::process_(const storagePair_t& pair) noexcept
+embvm::comm::status aardvarkSPIMaster::transfer(const embvm::spi::op_t* ops, size_t count,
+												const aardvarkSPIBatchCb& cb,
+												const aardvarkSchedule& schedule) noexcept
 {
-	const auto& [op, cb] = pair;
+	assert(ops != nullptr && count > 0);
 
-	std::vector<uint8_t> zeroes(op.length, 0);
+	aardvarkSPIRequest req{};
+	req.batch = ops;
+	req.batch_count = count;
+	req.batch_cb = cb;
+	aardvarkRequestQueue<aardvarkSPIRequest>::stamp(req.timing, schedule);
 
-	auto* rx_buffer = (op.rx_buffer != nullptr) ? op.rx_buffer : zeroes.data();
-	auto* tx_buffer = (op.tx_buffer != nullptr) ? op.tx_buffer : zeroes.data();
+	queue_.push(std::move(req));
+	enqueue(aardvarkQueueToken{});
 
-	base_driver_.lock();
-	int r = aa_spi_write(base_driver_.handle(), static_cast<uint16_t>(op.length), tx_buffer,
-						 static_cast<uint16_t>(op.length), rx_buffer);
-	base_driver_.unlock();
+	return embvm::comm::status::enqueued;
+}
+
+embvm::comm::status aardvarkSPIMaster::transfer(const aardvarkSPISegment* segments, size_t count,
+												const aardvarkSPIVectorCb& cb,
+												const aardvarkSchedule& schedule) noexcept
+{
+	assert(segments != nullptr && count > 0);
+
+	// A single transaction cannot be split without releasing the chip select
+	size_t total = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		total += segments[i].length;
+	}
+
+	if(total > UINT16_MAX)
+	{
+		return embvm::comm::status::error;
+	}
+
+	aardvarkSPIRequest req{};
+	req.segments = segments;
+	req.segment_count = count;
+	req.vector_cb = cb;
+	aardvarkRequestQueue<aardvarkSPIRequest>::stamp(req.timing, schedule);
+
+	queue_.push(std::move(req));
+	enqueue(aardvarkQueueToken{});
+
+	return embvm::comm::status::enqueued;
+}
+
+embvm::comm::status aardvarkSPIMaster::perform_(const embvm::spi::op_t& op, size_t offset,
+												size_t length) noexcept
+{
+	if(zeroes_.size() < length)
+	{
+		zeroes_.resize(length, 0);
+	}
+
+	auto* rx_buffer = (op.rx_buffer != nullptr) ? op.rx_buffer + offset : zeroes_.data();
+	const uint8_t* tx_buffer = (op.tx_buffer != nullptr) ? op.tx_buffer + offset : zeroes_.data();
+
+	if(op.tx_buffer == nullptr)
+	{
+		// The scratch buffer may hold data received by an earlier transfer
+		std::fill_n(zeroes_.begin(), length, uint8_t{0});
+	}
+
+	return write_(tx_buffer, rx_buffer, length);
+}
+
+embvm::comm::status aardvarkSPIMaster::write_(const uint8_t* tx_buffer, uint8_t* rx_buffer,
+											  size_t length) noexcept
+{
+	int r = aa_spi_write(base_driver_.handle(), static_cast<uint16_t>(length), tx_buffer,
+						 static_cast<uint16_t>(length), rx_buffer);
+
+	if(aardvarkAdapter::connectionLost(r))
+	{
+		// The transfer may have reached the device before the connection dropped, so it is
+		// not repeated: the adapter is restored for the next request and this one fails
+		base_driver_.reconnect();
+	}
+
+	if(autotune_)
+	{
+		// Short or failed transfers count against the error budget
+		auto khz = tuner_.record(r != static_cast<int>(length));
+		if(khz)
+		{
+			auto set_baud = base_driver_.spiBitrate(static_cast<int>(khz));
+			if(set_baud > 0)
+			{
+				tuner_.applied(static_cast<uint32_t>(set_baud));
+			}
+		}
+	}
 
 	embvm::comm::status status;
 
-	switch(r)
+	// aa_spi_write returns the number of bytes read on success
+	switch(r < 0 ? r : AA_OK)
 	{
 		case AA_OK:
 			status = embvm::comm::status::ok;
@@ -84,6 +207,8 @@ void aardvarkSPIMaster::process_(const storagePair_t& pair) noexcept
 		case AA_SPI_SLAVE_READ_ERROR:
 		case AA_SPI_SLAVE_TIMEOUT:
 		case AA_SPI_DROPPED_EXCESS_BYTES:
+		case AA_COMMUNICATION_ERROR:
+		case AA_INVALID_HANDLE:
 			status = embvm::comm::status::error;
 			break;
 		case AA_SPI_NOT_ENABLED:
@@ -91,7 +216,158 @@ void aardvarkSPIMaster::process_(const storagePair_t& pair) noexcept
 			status = embvm::comm::status::unknown;
 	}
 
-	callback(op, status, cb);
+	return status;
+}
+
+void aardvarkSPIMaster::process_(const aardvarkQueueToken& token) noexcept
+{
+	(void)token;
+
+	auto req = queue_.pop();
+
+	if(req.batch != nullptr)
+	{
+		processBatch_(req);
+		return;
+	}
+
+	if(req.segments != nullptr)
+	{
+		processVector_(req);
+		return;
+	}
+
+	const auto& op = req.op;
+
+	auto remaining = op.length - req.offset;
+	auto length = (req.chunk != 0 && remaining > req.chunk) ? req.chunk : remaining;
+
+	aardvarkBusLock bus(base_driver_, req.timing.deadline);
+	bus.lock();
+	auto selected = select_(req.timing.group);
+	auto status = perform_(op, req.offset, length);
+	req.busy += std::chrono::steady_clock::now() - selected;
+	deselect_(req.timing.group, status, length);
+	bus.unlock();
+
+	if(status == embvm::comm::status::ok && (req.offset + length) < op.length)
+	{
+		// Re-queue the remainder so that more urgent requests can run between chunks
+		req.offset += length;
+		queue_.push(std::move(req));
+		enqueue(aardvarkQueueToken{});
+		return;
+	}
+
+	// A chunked transfer counts as one request in the metrics
+	base_driver_.metrics().recordSPI(req.timing.group, status,
+									 (status == embvm::comm::status::ok) ? op.length : 0,
+									 req.busy);
+	base_driver_.recordLatency(req.timing.priority, req.timing.submitted, req.timing.deadline);
+
+	callback(op, status, req.cb);
+}
+
+void aardvarkSPIMaster::processBatch_(const aardvarkSPIRequest& req) noexcept
+{
+	auto status = embvm::comm::status::ok;
+	size_t completed = 0;
+	size_t bytes = 0;
+	std::chrono::steady_clock::duration busy{};
+
+	aardvarkBusLock bus(base_driver_, req.timing.deadline);
+	bus.lock();
+
+	for(; completed < req.batch_count; completed++)
+	{
+		const auto& op = req.batch[completed];
+		auto selected = select_(req.timing.group);
+		status = perform_(op, 0, op.length);
+		busy += std::chrono::steady_clock::now() - selected;
+		deselect_(req.timing.group, status, op.length);
+		if(status != embvm::comm::status::ok)
+		{
+			break;
+		}
+
+		bytes += op.length;
+	}
+
+	bus.unlock();
+
+	// The batch counts as one request
+	base_driver_.metrics().recordSPI(req.timing.group, status,
+									 (status == embvm::comm::status::ok) ? bytes : 0, busy);
+	base_driver_.recordLatency(req.timing.priority, req.timing.submitted, req.timing.deadline);
+
+	if(req.batch_cb)
+	{
+		req.batch_cb(status, completed);
+	}
+}
+
+void aardvarkSPIMaster::processVector_(const aardvarkSPIRequest& req) noexcept
+{
+	size_t total = 0;
+	for(size_t i = 0; i < req.segment_count; i++)
+	{
+		total += req.segments[i].length;
+	}
+
+	assert(total <= UINT16_MAX && "Checked by transfer()");
+
+	// Gather the tx segments into one contiguous transaction
+	gather_.resize(std::max(gather_.size(), total));
+	scatter_.resize(std::max(scatter_.size(), total));
+
+	size_t offset = 0;
+	for(size_t i = 0; i < req.segment_count; i++)
+	{
+		const auto& seg = req.segments[i];
+		if(seg.tx_buffer != nullptr)
+		{
+			std::copy_n(seg.tx_buffer, seg.length, gather_.begin() + static_cast<ptrdiff_t>(offset));
+		}
+		else
+		{
+			std::fill_n(gather_.begin() + static_cast<ptrdiff_t>(offset), seg.length, uint8_t{0});
+		}
+		offset += seg.length;
+	}
+
+	aardvarkBusLock bus(base_driver_, req.timing.deadline);
+	bus.lock();
+	auto selected = select_(req.timing.group);
+	auto status = write_(gather_.data(), scatter_.data(), total);
+	auto busy = std::chrono::steady_clock::now() - selected;
+	deselect_(req.timing.group, status, total);
+	bus.unlock();
+
+	base_driver_.metrics().recordSPI(req.timing.group, status,
+									 (status == embvm::comm::status::ok) ? total : 0, busy);
+
+	if(status == embvm::comm::status::ok)
+	{
+		// Scatter the received bytes back to the caller's rx segments
+		offset = 0;
+		for(size_t i = 0; i < req.segment_count; i++)
+		{
+			const auto& seg = req.segments[i];
+			if(seg.rx_buffer != nullptr)
+			{
+				std::copy_n(scatter_.begin() + static_cast<ptrdiff_t>(offset), seg.length,
+							seg.rx_buffer);
+			}
+			offset += seg.length;
+		}
+	}
+
+	base_driver_.recordLatency(req.timing.priority, req.timing.submitted, req.timing.deadline);
+
+	if(req.vector_cb)
+	{
+		req.vector_cb(status, status == embvm::comm::status::ok ? total : 0);
+	}
 }
 
 void aardvarkSPIMaster::setMode_(embvm::spi::mode mode) noexcept
@@ -5,12 +5,103 @@
 #define AARDVARK_SPI_DRIVER_HPP_
 
 #include "base.hpp"
+#include "bitrate_tuner.hpp"
+#include "schedule.hpp"
 #include <active_object/active_object.hpp>
+#include <chrono>
 #include <cstdint>
 #include <driver/spi.hpp>
+#include <functional>
+#include <vector>
 
 namespace embdrv
 {
+/// Completion callback for a batch of SPI transfers.
+/// Receives the status of the last transfer attempted and the number of transfers
+/// that completed successfully.
+/// @ingroup AardvarkDrivers
+using aardvarkSPIBatchCb = std::function<void(embvm::comm::status, size_t)>;
+
+/// Completion callback for a scatter-gather SPI transfer.
+/// Receives the status of the transfer and the total number of bytes transferred.
+/// @ingroup AardvarkDrivers
+using aardvarkSPIVectorCb = std::function<void(embvm::comm::status, size_t)>;
+
+/** One segment of a scatter-gather SPI transfer
+ *
+ * Segments are clocked out back-to-back under a single chip-select assertion.
+ * A segment without a tx_buffer clocks out zeroes, and a segment without an rx_buffer
+ * discards the bytes received while it is transmitted.
+ *
+ * @ingroup AardvarkDrivers
+ */
+struct aardvarkSPISegment
+{
+	/// Data to transmit, or nullptr to transmit zeroes.
+	const uint8_t* tx_buffer = nullptr;
+	/// Buffer for the received data, or nullptr to discard it.
+	uint8_t* rx_buffer = nullptr;
+	/// Number of bytes in this segment.
+	size_t length = 0;
+};
+
+/** Chip-select hook for the aardvarkSPIMaster
+ *
+ * When a selector is attached, the master calls select() before and deselect() after
+ * each transaction whose aardvarkSchedule::group is non-zero. Both are called on the
+ * master's worker thread while the adapter is acquired.
+ *
+ * @ingroup AardvarkDrivers
+ */
+class aardvarkSPISelector
+{
+  public:
+	/// Default destructor
+	virtual ~aardvarkSPISelector() noexcept = default;
+
+	/// Prepare the bus for a transaction with a device.
+	/// @param device The group of the request being dispatched.
+	virtual void select(uint8_t device) noexcept = 0;
+
+	/** Release the bus after a transaction with a device
+	 *
+	 * @param device The group of the request that was dispatched.
+	 * @param status The result of the transaction.
+	 * @param bytes The number of bytes in the transaction.
+	 */
+	virtual void deselect(uint8_t device, embvm::comm::status status, size_t bytes) noexcept = 0;
+};
+
+/// An SPI transfer request, as stored in the aardvarkSPIMaster queue.
+/// @ingroup AardvarkDrivers
+struct aardvarkSPIRequest
+{
+	/// Scheduling information for this transfer.
+	aardvarkRequestTiming timing;
+	/// The transfer to perform.
+	embvm::spi::op_t op;
+	/// The callback to invoke once the transfer completes.
+	embvm::spi::master::cb_t cb;
+	/// Maximum number of bytes to transfer per dispatch (0 transfers everything at once).
+	size_t chunk = 0;
+	/// Number of bytes already transferred.
+	size_t offset = 0;
+	/// Time spent transferring the chunks so far, recorded in the metrics on completion.
+	std::chrono::steady_clock::duration busy{};
+	/// Transfers to perform back-to-back, or nullptr for a single transfer (op).
+	const embvm::spi::op_t* batch = nullptr;
+	/// Number of transfers in batch.
+	size_t batch_count = 0;
+	/// The callback to invoke once the batch completes.
+	aardvarkSPIBatchCb batch_cb;
+	/// Segments of a scatter-gather transfer, or nullptr.
+	const aardvarkSPISegment* segments = nullptr;
+	/// Number of entries in segments.
+	size_t segment_count = 0;
+	/// The callback to invoke once the scatter-gather transfer completes.
+	aardvarkSPIVectorCb vector_cb;
+};
+
 /** Create an Aardvark SPI Master Driver
  *
  * This driver requires an aardvarkAdapter to work. The aardvark adapter must be
@@ -23,16 +114,30 @@ namespace embdrv
  * embdrv::aardvarkSPIMaster spi0{aardvark, "spi0"};
  * @endcode
  *
+ * Queued transfers are dispatched earliest-deadline-first, and the adapter is arbitrated
+ * by deadline between all masters that share it. Long transfers can be split into chunks
+ * so that more urgent requests are able to preempt them at chunk boundaries:
+ *
+ * @code
+ * spi0.transfer(flash_dump, {embdrv::aardvarkPriority::bulk,
+ *	std::chrono::steady_clock::time_point::max(), 1024}, cb);
+ * @endcode
+ *
+ * Protocols that frame a command, an address and a payload in one chip-select assertion
+ * can send them from separate buffers with a scatter-gather transfer. The segments are
+ * gathered into one adapter transaction, and received data is scattered back:
+ *
+ * @code
+ * std::array<embdrv::aardvarkSPISegment, 3> segs = {{
+ *	{&cmd, nullptr, 1}, {addr.data(), nullptr, addr.size()}, {nullptr, page.data(), page.size()}}};
+ * spi0.transfer(segs.data(), segs.size(), cb);
+ * @endcode
+ *
  * @ingroup AardvarkDrivers
  */
-class aardvarkSPIMaster final
-	: public embvm::spi::master,
-	  public embutil::activeObject<aardvarkSPIMaster,
-								   std::pair<embvm::spi::op_t, const embvm::spi::master::cb_t>>
+class aardvarkSPIMaster final : public embvm::spi::master,
+								public embutil::activeObject<aardvarkSPIMaster, aardvarkQueueToken>
 {
-	/// The storage type that the active object stores.
-	using storagePair_t = std::pair<embvm::spi::op_t, const embvm::spi::master::cb_t>;
-
   public:
 	/** Construct an Aardvark SPI master
 	 *
@@ -44,9 +149,132 @@ class aardvarkSPIMaster final
 	~aardvarkSPIMaster() noexcept;
 
 	/// Active object process function
-	void process_(const storagePair_t& op) noexcept;
+	void process_(const aardvarkQueueToken& token) noexcept;
+
+	using embvm::spi::master::transfer;
+
+	/** Perform an SPI transfer with specific scheduling parameters
+	 *
+	 * @param op The transfer to perform.
+	 * @param schedule The priority class, optional deadline and chunk size for this transfer.
+	 * @param cb The callback to invoke once the transfer completes.
+	 * @returns embvm::comm::status::enqueued.
+	 */
+	embvm::comm::status transfer(const embvm::spi::op_t& op, const aardvarkSchedule& schedule,
+								 const embvm::spi::master::cb_t& cb = nullptr) noexcept;
+
+	/** Perform a batch of SPI transfers
+	 *
+	 * The transfers are performed back-to-back under a single adapter acquisition,
+	 * and the batch stops at the first failure. The chip select is released between
+	 * transfers, and aardvarkSchedule::chunk is ignored.
+	 *
+	 * @param ops The transfers to perform. Must remain valid until cb is invoked.
+	 * @param count The number of transfers in ops.
+	 * @param cb The callback to invoke once the batch completes.
+	 * @param schedule The priority class and optional deadline for the batch.
+	 * @returns embvm::comm::status::enqueued.
+	 */
+	embvm::comm::status transfer(const embvm::spi::op_t* ops, size_t count,
+								 const aardvarkSPIBatchCb& cb,
+								 const aardvarkSchedule& schedule = {}) noexcept;
+
+	/** Perform a scatter-gather SPI transfer
+	 *
+	 * All segments are transferred in a single adapter transaction, so the chip select
+	 * stays asserted from the first byte of the first segment to the last byte of the last.
+	 * aardvarkSchedule::chunk is ignored.
+	 *
+	 * @param segments The segments to transfer. The array and the segment buffers must
+	 *	remain valid until cb is invoked.
+	 * @param count The number of segments.
+	 * @param cb The callback to invoke once the transfer completes.
+	 * @param schedule The priority class and optional deadline for the transfer.
+	 * @returns embvm::comm::status::enqueued, or embvm::comm::status::error without invoking
+	 *	cb if the total length of all segments exceeds UINT16_MAX, the adapter's transaction
+	 *	size.
+	 */
+	embvm::comm::status transfer(const aardvarkSPISegment* segments, size_t count,
+								 const aardvarkSPIVectorCb& cb,
+								 const aardvarkSchedule& schedule = {}) noexcept;
+
+	/** Enable automatic bitrate tuning
+	 *
+	 * The bus bitrate is adjusted at runtime based on the observed transfer error rate.
+	 * Calling baudrate() disables automatic tuning.
+	 *
+	 * @pre The driver is started.
+	 * @param cfg The tuning parameters. Bitrates are specified in kHz.
+	 */
+	void autoTuneBitrate(const aardvarkBitrateTuner::config& cfg) noexcept;
+
+	/// Disable automatic bitrate tuning. The current bitrate remains in effect.
+	void disableBitrateAutoTune() noexcept;
+
+	/// Get the automatic bitrate tuner's activity counters.
+	/// @returns a copy of the tuner counters.
+	aardvarkBitrateTuner::stats bitrateTunerStats() noexcept;
+
+	/** Keep requests of the same aardvarkSchedule::group together
+	 *
+	 * @param window How far past the most urgent deadline a request may be dispatched to
+	 *	stay in the group of the previous request. Zero (the default) disables grouping.
+	 */
+	void affinity(std::chrono::steady_clock::duration window) noexcept
+	{
+		queue_.affinity(window);
+	}
+
+	/** Attach a chip-select hook
+	 *
+	 * @pre No transfers are queued.
+	 * @param selector The hook to call around grouped transactions, or nullptr to detach.
+	 */
+	void selector(aardvarkSPISelector* selector) noexcept
+	{
+		selector_ = selector;
+	}
 
   private:
+	/// Transfer part of an SPI op and report the result to the bitrate tuner.
+	/// @pre The adapter is acquired.
+	embvm::comm::status perform_(const embvm::spi::op_t& op, size_t offset, size_t length) noexcept;
+
+	/// Run a single adapter transaction and report the result to the bitrate tuner. A transfer
+	/// interrupted by a lost USB connection reconnects the adapter and fails without repeating.
+	/// @pre The adapter is acquired.
+	embvm::comm::status write_(const uint8_t* tx_buffer, uint8_t* rx_buffer,
+							   size_t length) noexcept;
+
+	/// Select the device for a grouped transaction.
+	/// @pre The adapter is acquired.
+	/// @returns the time the device was selected, where the transaction's bus time starts.
+	std::chrono::steady_clock::time_point select_(uint8_t group) noexcept
+	{
+		if(selector_ != nullptr && group != 0)
+		{
+			selector_->select(group);
+		}
+
+		return std::chrono::steady_clock::now();
+	}
+
+	/// Deselect the device after a grouped transaction.
+	/// @pre The adapter is acquired.
+	void deselect_(uint8_t group, embvm::comm::status status, size_t bytes) noexcept
+	{
+		if(selector_ != nullptr && group != 0)
+		{
+			selector_->deselect(group, status, bytes);
+		}
+	}
+
+	/// Perform a batch request.
+	void processBatch_(const aardvarkSPIRequest& req) noexcept;
+
+	/// Perform a scatter-gather request.
+	void processVector_(const aardvarkSPIRequest& req) noexcept;
+
 	void start_() noexcept final;
 	void stop_() noexcept final;
 	void configure_() noexcept final;
@@ -59,6 +287,27 @@ class aardvarkSPIMaster final
   private:
 	/// The aardvarkAdapter instance associated with this driver.
 	aardvarkAdapter& base_driver_;
+
+	/// Automatic bitrate tuner. Protected by the base_driver_ lock.
+	aardvarkBitrateTuner tuner_;
+
+	/// True when automatic bitrate tuning is enabled. Protected by the base_driver_ lock.
+	bool autotune_ = false;
+
+	/// Chip-select hook, or nullptr.
+	aardvarkSPISelector* selector_ = nullptr;
+
+	/// Pending transfers, in dispatch order.
+	aardvarkRequestQueue<aardvarkSPIRequest> queue_;
+
+	/// Zero-filled buffer used when an op has no tx or rx buffer. Only used by the worker thread.
+	std::vector<uint8_t> zeroes_;
+
+	/// Staging buffer for gathered tx segments. Only used by the worker thread.
+	std::vector<uint8_t> gather_;
+
+	/// Staging buffer for rx data before it is scattered. Only used by the worker thread.
+	std::vector<uint8_t> scatter_;
 };
 
 } // namespace embdrv
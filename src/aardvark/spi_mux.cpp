@@ -0,0 +1,202 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#include <aardvark/spi_mux.hpp>
+#include <cassert>
+#include <mutex>
+
+using namespace embdrv;
+
+constexpr unsigned INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR = 1000;
+
+aardvarkSPIMux::aardvarkSPIMux(aardvarkAdapter& adapter, aardvarkSPIMaster& spi,
+							   std::chrono::steady_clock::duration window) noexcept
+	: adapter_(adapter), spi_(spi)
+{
+	spi_.selector(this);
+	spi_.affinity(window);
+}
+
+aardvarkSPIMux::~aardvarkSPIMux() noexcept
+{
+	spi_.selector(nullptr);
+	spi_.affinity(std::chrono::steady_clock::duration::zero());
+}
+
+uint8_t aardvarkSPIMux::add(const aardvarkSPIDeviceConfig& cfg) noexcept
+{
+	assert(adapter_.mode() == aardvarkMode::SpiGpio &&
+		   "Chip-select multiplexing requires aardvarkMode::SpiGpio");
+	assert(cfg.cs_pin < AARDVARK_SPI_MUX_MAX_DEVICES && "Only SCL and SDA can be chip selects");
+
+	std::lock_guard<aardvarkAdapter> lock(adapter_);
+
+	assert(count_ < AARDVARK_SPI_MUX_MAX_DEVICES && "Too many SPI devices");
+	for(uint8_t i = 0; i < count_; i++)
+	{
+		assert(devices_[i].cfg.cs_pin != cfg.cs_pin && "Chip-select pin already in use");
+	}
+
+	devices_[count_].cfg = cfg;
+
+	{
+		// Drive the inactive level before the pin becomes an output
+		aardvarkConfigBatch batch{adapter_};
+		adapter_.setGPIOOutput(cfg.cs_pin, !cfg.cs_active_high);
+		adapter_.setGPIOMode(cfg.cs_pin, embvm::gpio::mode::output);
+	}
+
+	return ++count_;
+}
+
+void aardvarkSPIMux::configure(uint8_t device, embvm::spi::mode mode,
+							   embvm::spi::order order) noexcept
+{
+	assert(((mode == embvm::spi::mode::mode0) || (mode == embvm::spi::mode::mode3)) &&
+		   "Aardvark only supports SPI mode 3 and 0");
+
+	std::lock_guard<aardvarkAdapter> lock(adapter_);
+	assert(device > 0 && device <= count_);
+
+	devices_[device - 1].cfg.mode = mode;
+	devices_[device - 1].cfg.order = order;
+}
+
+int aardvarkSPIMux::bitrate(uint8_t device, int khz) noexcept
+{
+	std::lock_guard<aardvarkAdapter> lock(adapter_);
+	assert(device > 0 && device <= count_);
+
+	devices_[device - 1].cfg.bitrate_khz = khz;
+
+	return khz;
+}
+
+aardvarkSPIDeviceStats aardvarkSPIMux::statistics(uint8_t device) const noexcept
+{
+	assert(device > 0 && device <= AARDVARK_SPI_MUX_MAX_DEVICES);
+
+	const auto& d = devices_[device - 1];
+	aardvarkSPIDeviceStats stats;
+
+	stats.transactions = d.transactions.load(std::memory_order_relaxed);
+	stats.errors = d.errors.load(std::memory_order_relaxed);
+	stats.switches = d.switches.load(std::memory_order_relaxed);
+	stats.bytes = d.bytes.load(std::memory_order_relaxed);
+	stats.busy = std::chrono::nanoseconds(d.busy_ns.load(std::memory_order_relaxed));
+
+	return stats;
+}
+
+void aardvarkSPIMux::select(uint8_t device) noexcept
+{
+	if(device == 0 || device > count_)
+	{
+		// Not one of ours
+		return;
+	}
+
+	auto& d = devices_[device - 1];
+
+	selected_ = std::chrono::steady_clock::now();
+
+	if(device != current_)
+	{
+		d.switches.fetch_add(1, std::memory_order_relaxed);
+		current_ = device;
+	}
+
+	// Settings shared with the previous device are elided by the adapter
+	aardvarkConfigBatch batch{adapter_};
+	adapter_.spiConfigure(d.cfg.mode, d.cfg.order);
+	adapter_.spiBitrate(d.cfg.bitrate_khz);
+	adapter_.setGPIOOutput(d.cfg.cs_pin, d.cfg.cs_active_high);
+}
+
+void aardvarkSPIMux::deselect(uint8_t device, embvm::comm::status status, size_t bytes) noexcept
+{
+	if(device == 0 || device > count_)
+	{
+		return;
+	}
+
+	auto& d = devices_[device - 1];
+
+	adapter_.setGPIOOutput(d.cfg.cs_pin, !d.cfg.cs_active_high);
+
+	auto busy = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - selected_);
+
+	d.transactions.fetch_add(1, std::memory_order_relaxed);
+	d.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	d.busy_ns.fetch_add(static_cast<uint64_t>(busy.count()), std::memory_order_relaxed);
+
+	if(status != embvm::comm::status::ok)
+	{
+		d.errors.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void aardvarkSPIDevice::start_() noexcept
+{
+	mux_.master().start();
+}
+
+void aardvarkSPIDevice::stop_() noexcept
+{
+	mux_.master().stop();
+}
+
+void aardvarkSPIDevice::configure_() noexcept
+{
+	mux_.configure(device_, mode_, order_);
+}
+
+uint32_t aardvarkSPIDevice::baudrate_(uint32_t baud) noexcept
+{
+	auto khz = mux_.bitrate(device_,
+							static_cast<int>(baud / INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR));
+
+	return static_cast<uint32_t>(khz) * INPUT_BAUDRATE_TO_AARDVARK_CONV_FACTOR;
+}
+
+embvm::comm::status aardvarkSPIDevice::transfer_(const embvm::spi::op_t& op,
+												 const embvm::spi::master::cb_t& cb) noexcept
+{
+	return transfer(op, aardvarkSchedule{}, cb);
+}
+
+embvm::comm::status aardvarkSPIDevice::transfer(const embvm::spi::op_t& op,
+												const aardvarkSchedule& schedule,
+												const embvm::spi::master::cb_t& cb) noexcept
+{
+	return mux_.master().transfer(op, tag_(schedule), cb);
+}
+
+embvm::comm::status aardvarkSPIDevice::transfer(const embvm::spi::op_t* ops, size_t count,
+												const aardvarkSPIBatchCb& cb,
+												const aardvarkSchedule& schedule) noexcept
+{
+	return mux_.master().transfer(ops, count, cb, tag_(schedule));
+}
+
+embvm::comm::status aardvarkSPIDevice::transfer(const aardvarkSPISegment* segments, size_t count,
+												const aardvarkSPIVectorCb& cb,
+												const aardvarkSchedule& schedule) noexcept
+{
+	return mux_.master().transfer(segments, count, cb, tag_(schedule));
+}
+
+void aardvarkSPIDevice::setMode_(embvm::spi::mode mode) noexcept
+{
+	assert(((mode == embvm::spi::mode::mode0) || (mode == embvm::spi::mode::mode3)) &&
+		   "Aardvark only supports SPI mode 3 and 0");
+	mode_ = mode;
+	configure_();
+}
+
+void aardvarkSPIDevice::setOrder_(embvm::spi::order order) noexcept
+{
+	order_ = order;
+	configure_();
+}
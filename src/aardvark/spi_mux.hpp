@@ -0,0 +1,276 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_SPI_MUX_HPP_
+#define AARDVARK_SPI_MUX_HPP_
+
+#include "base.hpp"
+#include "spi.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <driver/spi.hpp>
+
+namespace embdrv
+{
+/// @addtogroup AardvarkDrivers
+/// @{
+
+/// Maximum number of devices that can share an aardvarkSPIMux.
+/// Only SCL (pin 0) and SDA (pin 1) are free for GPIO use in aardvarkMode::SpiGpio.
+inline constexpr size_t AARDVARK_SPI_MUX_MAX_DEVICES = 2;
+
+/// Settings for one device on an aardvarkSPIMux
+struct aardvarkSPIDeviceConfig
+{
+	/// The Aardvark GPIO pin used as the device's chip select.
+	uint8_t cs_pin = 0;
+	/// True if the chip select is active high.
+	bool cs_active_high = false;
+	/// The SPI mode used with this device.
+	embvm::spi::mode mode = embvm::spi::mode::mode0;
+	/// The bit order used with this device.
+	embvm::spi::order order = embvm::spi::order::msbFirst;
+	/// The bitrate used with this device, in kHz.
+	int bitrate_khz = 1000;
+};
+
+/// Per-device activity counters of an aardvarkSPIMux
+struct aardvarkSPIDeviceStats
+{
+	/// Number of transactions performed.
+	uint32_t transactions = 0;
+	/// Number of transactions that failed.
+	uint32_t errors = 0;
+	/// Number of selections that switched the bus away from another device.
+	uint32_t switches = 0;
+	/// Number of bytes transferred.
+	uint64_t bytes = 0;
+	/// Time the device was selected, including chip-select and configuration overhead.
+	std::chrono::nanoseconds busy{0};
+
+	/// Get the achieved throughput while the device was selected.
+	/// @returns the throughput in bytes per second, or 0 if nothing was transferred.
+	double throughput() const noexcept
+	{
+		return busy.count() ? static_cast<double>(bytes) * 1e9 / static_cast<double>(busy.count())
+							: 0.0;
+	}
+};
+
+/** Chip-select multiplexer for several SPI devices on one Aardvark adapter
+ *
+ * The Aardvark has a single hardware SS line. In aardvarkMode::SpiGpio, the pins that are
+ * not used by SPI (SCL and SDA, pins 0 and 1) are free to drive additional chip selects.
+ * The multiplexer assigns one of these pins to each device and attaches itself to the
+ * aardvarkSPIMaster, which then asserts the device's chip select around each transaction
+ * and applies the device's mode, bit order and bitrate before it.
+ *
+ * The hardware SS line is still asserted for every transaction, so it should be left
+ * unconnected when the multiplexer is in use.
+ *
+ * Queued transactions of the same device are kept together when their deadlines allow
+ * (see aardvarkSPIMaster::affinity()), which reduces the number of device switches and
+ * therefore of mode and bitrate changes. Settings that did not change between two devices
+ * are not sent to the adapter at all.
+ *
+ * Devices are normally used through aardvarkSPIDevice:
+ *
+ * @code
+ * embdrv::aardvarkAdapter aardvark{embdrv::aardvarkMode::SpiGpio};
+ * embdrv::aardvarkSPIMaster spi0{aardvark};
+ * embdrv::aardvarkSPIMux mux{aardvark, spi0};
+ * embdrv::aardvarkSPIDevice flash{mux, {0, false, embvm::spi::mode::mode0,
+ *	embvm::spi::order::msbFirst, 8000}};
+ * embdrv::aardvarkSPIDevice adc{mux, {1, false, embvm::spi::mode::mode3,
+ *	embvm::spi::order::msbFirst, 1000}};
+ * @endcode
+ */
+class aardvarkSPIMux final : public aardvarkSPISelector
+{
+  public:
+	/** Create a chip-select multiplexer
+	 *
+	 * @param adapter The adapter that drives the chip-select pins.
+	 * @param spi The SPI master that performs the transfers.
+	 * @param window The affinity window used to group transactions of the same device.
+	 */
+	aardvarkSPIMux(aardvarkAdapter& adapter, aardvarkSPIMaster& spi,
+				   std::chrono::steady_clock::duration window = std::chrono::microseconds(500)) noexcept;
+
+	/// Detaches the multiplexer from the SPI master.
+	~aardvarkSPIMux() noexcept final;
+
+	/** Register a device
+	 *
+	 * The chip-select pin is configured as an output and deasserted. If the adapter is not
+	 * started yet, this happens when it starts.
+	 *
+	 * @pre The adapter is configured with aardvarkMode::SpiGpio.
+	 * @pre No other device uses cfg.cs_pin.
+	 * @param cfg The device settings.
+	 * @returns the device ID, used as the aardvarkSchedule::group of its transfers.
+	 */
+	uint8_t add(const aardvarkSPIDeviceConfig& cfg) noexcept;
+
+	/** Change the mode and bit order of a device
+	 *
+	 * @param device The device ID returned by add().
+	 * @param mode The SPI mode to use. The Aardvark supports mode 0 and mode 3.
+	 * @param order The bit order to use.
+	 */
+	void configure(uint8_t device, embvm::spi::mode mode, embvm::spi::order order) noexcept;
+
+	/** Change the bitrate of a device
+	 *
+	 * The adapter rounds the bitrate to the closest supported value when the device is
+	 * next selected.
+	 *
+	 * @param device The device ID returned by add().
+	 * @param khz The bitrate to use, in kHz.
+	 * @returns the requested bitrate, in kHz.
+	 */
+	int bitrate(uint8_t device, int khz) noexcept;
+
+	/// Get the activity counters of a device.
+	/// @param device The device ID returned by add().
+	/// @returns a snapshot of the device's counters.
+	aardvarkSPIDeviceStats statistics(uint8_t device) const noexcept;
+
+	/// Get the SPI master used by the multiplexer.
+	aardvarkSPIMaster& master() noexcept
+	{
+		return spi_;
+	}
+
+	void select(uint8_t device) noexcept final;
+	void deselect(uint8_t device, embvm::comm::status status, size_t bytes) noexcept final;
+
+  private:
+	/// A registered device
+	struct slot
+	{
+		/// The device settings. Protected by the adapter lock.
+		aardvarkSPIDeviceConfig cfg;
+		/// Transactions performed.
+		std::atomic<uint32_t> transactions{0};
+		/// Transactions that failed.
+		std::atomic<uint32_t> errors{0};
+		/// Selections that switched from another device.
+		std::atomic<uint32_t> switches{0};
+		/// Bytes transferred.
+		std::atomic<uint64_t> bytes{0};
+		/// Time selected, in nanoseconds.
+		std::atomic<uint64_t> busy_ns{0};
+	};
+
+	/// The adapter that drives the chip-select pins.
+	aardvarkAdapter& adapter_;
+
+	/// The SPI master that performs the transfers.
+	aardvarkSPIMaster& spi_;
+
+	/// Registered devices, indexed by device ID - 1.
+	std::array<slot, AARDVARK_SPI_MUX_MAX_DEVICES> devices_{};
+
+	/// Number of registered devices. Protected by the adapter lock.
+	uint8_t count_ = 0;
+
+	/// The most recently selected device. Only used by the SPI worker thread.
+	uint8_t current_ = 0;
+
+	/// Time the current device was selected. Only used by the SPI worker thread.
+	std::chrono::steady_clock::time_point selected_{};
+};
+
+/** An SPI device behind an aardvarkSPIMux
+ *
+ * Implements the embvm::spi::master interface for a single device, so device drivers can
+ * use it like a dedicated bus. Mode, bit order and bitrate are kept per device. Transfers
+ * are queued on the shared aardvarkSPIMaster.
+ *
+ * aardvarkSchedule::group is set to the device ID, and aardvarkSchedule::chunk is ignored
+ * because the chip select must stay asserted for the whole transfer.
+ */
+class aardvarkSPIDevice final : public embvm::spi::master
+{
+  public:
+	/** Register a device with a multiplexer
+	 *
+	 * @param mux The multiplexer the device is connected to.
+	 * @param cfg The device settings.
+	 */
+	aardvarkSPIDevice(aardvarkSPIMux& mux, const aardvarkSPIDeviceConfig& cfg) noexcept
+		: mux_(mux), device_(mux.add(cfg))
+	{
+		mode_ = cfg.mode;
+		order_ = cfg.order;
+	}
+
+	/// Default destructor
+	~aardvarkSPIDevice() noexcept = default;
+
+	using embvm::spi::master::transfer;
+
+	/// Perform a transfer with specific scheduling parameters.
+	/// @see aardvarkSPIMaster::transfer()
+	embvm::comm::status transfer(const embvm::spi::op_t& op, const aardvarkSchedule& schedule,
+								 const embvm::spi::master::cb_t& cb = nullptr) noexcept;
+
+	/// Perform a batch of transfers.
+	/// @see aardvarkSPIMaster::transfer()
+	embvm::comm::status transfer(const embvm::spi::op_t* ops, size_t count,
+								 const aardvarkSPIBatchCb& cb,
+								 const aardvarkSchedule& schedule = {}) noexcept;
+
+	/// Perform a scatter-gather transfer.
+	/// @see aardvarkSPIMaster::transfer()
+	embvm::comm::status transfer(const aardvarkSPISegment* segments, size_t count,
+								 const aardvarkSPIVectorCb& cb,
+								 const aardvarkSchedule& schedule = {}) noexcept;
+
+	/// Get the device ID used by the multiplexer.
+	uint8_t id() const noexcept
+	{
+		return device_;
+	}
+
+	/// Get the device's activity counters.
+	/// @returns a snapshot of the device's counters.
+	aardvarkSPIDeviceStats statistics() const noexcept
+	{
+		return mux_.statistics(device_);
+	}
+
+  private:
+	void start_() noexcept final;
+	void stop_() noexcept final;
+	void configure_() noexcept final;
+	uint32_t baudrate_(uint32_t baud) noexcept final;
+	embvm::comm::status transfer_(const embvm::spi::op_t& op,
+								  const embvm::spi::master::cb_t& cb) noexcept final;
+	void setMode_(embvm::spi::mode mode) noexcept final;
+	void setOrder_(embvm::spi::order order) noexcept final;
+
+	/// Tag a schedule with this device's group.
+	aardvarkSchedule tag_(aardvarkSchedule schedule) const noexcept
+	{
+		schedule.group = device_;
+		schedule.chunk = 0;
+		return schedule;
+	}
+
+  private:
+	/// The multiplexer the device is connected to.
+	aardvarkSPIMux& mux_;
+
+	/// The device ID.
+	const uint8_t device_;
+};
+
+/// @}
+
+} // namespace embdrv
+
+#endif // AARDVARK_SPI_MUX_HPP_
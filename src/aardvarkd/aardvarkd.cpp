@@ -0,0 +1,124 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvarkd: share one Aardvark adapter between several processes
+ *
+ * Usage: aardvarkd [-m spi-i2c|spi-gpio|gpio-i2c|gpio] [-p port] [-s socket]
+ *
+ * Clients connect with embdrv::aardvarkShareClient and use the aardvarkRemote* proxies.
+ * Bitrate, SPI mode, pullup and GPIO settings are shared: a change made by one client applies
+ * to all of them.
+ */
+
+#include <aardvark/base.hpp>
+#include <aardvark/i2c.hpp>
+#include <aardvark/mode_option.hpp>
+#include <aardvark/share_server.hpp>
+#include <aardvark/spi.hpp>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace embdrv;
+
+namespace
+{
+/// Options other than -m, for the usage message.
+constexpr const char* DAEMON_OPTIONS = "[-p port] [-s socket]";
+
+aardvarkShareServer* server_instance = nullptr;
+
+void handle_signal(int sig)
+{
+	(void)sig;
+
+	if(server_instance != nullptr)
+	{
+		server_instance->stop();
+	}
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	uint8_t port = 0;
+	aardvarkMode mode = aardvarkMode::SpiI2C;
+	const char* path = AARDVARK_SHARE_DEFAULT_SOCKET;
+
+	int opt;
+	while((opt = getopt(argc, argv, "p:m:s:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 'p':
+				port = static_cast<uint8_t>(strtoul(optarg, nullptr, 0));
+				break;
+			case 'm':
+				if(!aardvarkParseMode(optarg, mode))
+				{
+					aardvarkUsage(argv[0], DAEMON_OPTIONS);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				path = optarg;
+				break;
+			case 'h':
+			default:
+				aardvarkUsage(argv[0], DAEMON_OPTIONS);
+				return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	const bool has_i2c = (static_cast<int>(mode) & static_cast<int>(aardvarkMode::GpioI2C)) != 0;
+	const bool has_spi = (static_cast<int>(mode) & static_cast<int>(aardvarkMode::SpiGpio)) != 0;
+
+	aardvarkAdapter aardvark{mode, port};
+	aardvarkI2CMaster i2c{aardvark};
+	aardvarkSPIMaster spi{aardvark};
+
+	// Keep the adapter open even while no bus master is in use
+	aardvark.start();
+
+	if(has_i2c)
+	{
+		i2c.start();
+	}
+
+	if(has_spi)
+	{
+		spi.start();
+	}
+
+	int result = EXIT_SUCCESS;
+
+	{
+		aardvarkShareServer server{aardvark, has_i2c ? &i2c : nullptr, has_spi ? &spi : nullptr};
+
+		if(server.listen(path))
+		{
+			server_instance = &server;
+			signal(SIGPIPE, SIG_IGN);
+			signal(SIGINT, handle_signal);
+			signal(SIGTERM, handle_signal);
+
+			printf("aardvarkd: serving Aardvark port %u on %s\n", port, path);
+			server.run();
+
+			server_instance = nullptr;
+		}
+		else
+		{
+			fprintf(stderr, "aardvarkd: unable to listen on %s\n", path);
+			result = EXIT_FAILURE;
+		}
+	}
+
+	spi.stop();
+	i2c.stop();
+	aardvark.stop();
+
+	return result;
+}
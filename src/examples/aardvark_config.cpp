@@ -0,0 +1,144 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_config: configuration shadow example, run against the simulated adapter (src/sim)
+ *
+ * Usage: aardvark_config
+ *
+ * The example changes adapter settings the way a bus master or application would, and doubles
+ * as the test of the configuration shadow:
+ *
+ *  1. Applying a setting sends one command to the adapter. Applying the same value again
+ *     sends nothing and is counted as elided.
+ *  2. Changes made inside an aardvarkConfigBatch are merged: each setting that differs from
+ *     the adapter's state is sent once when the batch ends, whatever the number of changes.
+ *  3. Settings made before the adapter is started are all applied when it starts.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace embdrv;
+
+namespace
+{
+constexpr uint8_t OUTPUT_PIN = 3;
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Commands sent to the simulated adapter, configuration and GPIO alike.
+uint32_t commands()
+{
+	auto stats = aa_sim_stats();
+	return stats.config_commands + stats.gpio_commands;
+}
+
+/// Check that fn sends count commands to the adapter.
+template<typename TFunction>
+bool sends(uint32_t count, TFunction fn, const char* what)
+{
+	auto before = commands();
+	fn();
+	return check(commands() - before == count, what);
+}
+
+/// Setting a value twice only sends the first one.
+bool runRepeated(aardvarkAdapter& adapter)
+{
+	auto elided = adapter.configStats().elided;
+
+	bool ok = sends(1, [&] { adapter.i2cBitrate(400); }, "I2C bitrate change");
+	ok = sends(0, [&] { adapter.i2cBitrate(400); }, "repeated I2C bitrate") && ok;
+
+	ok = sends(0, [&] { adapter.mode(aardvarkMode::GpioI2C); }, "repeated mode") && ok;
+
+	ok = sends(1, [&] { adapter.setGPIOMode(OUTPUT_PIN, embvm::gpio::mode::output); },
+			   "GPIO direction change") &&
+		 ok;
+	ok = sends(0, [&] { adapter.setGPIOMode(OUTPUT_PIN, embvm::gpio::mode::output); },
+			   "repeated GPIO direction") &&
+		 ok;
+
+	ok = sends(1, [&] { adapter.setGPIOOutput(OUTPUT_PIN, true); }, "GPIO output change") && ok;
+	ok = sends(0, [&] { adapter.setGPIOOutput(OUTPUT_PIN, true); }, "repeated GPIO output") &&
+		 ok;
+
+	ok = check(adapter.configStats().elided - elided == 4, "elided request count") && ok;
+
+	return ok;
+}
+
+/// A batch sends each changed setting once.
+bool runBatch(aardvarkAdapter& adapter)
+{
+	auto stats = adapter.configStats();
+
+	bool ok = sends(
+		3,
+		[&] {
+			aardvarkConfigBatch batch{adapter};
+			adapter.i2cBitrate(100);
+			adapter.i2cBitrate(200);
+			adapter.i2cPullups(true);
+			adapter.i2cPullups(false);
+			adapter.i2cPullups(true);
+			adapter.setGPIOOutput(OUTPUT_PIN, false);
+			adapter.toggleGPIO(OUTPUT_PIN);
+			adapter.toggleGPIO(OUTPUT_PIN);
+		},
+		"batch sends each changed setting once");
+
+	// A batch that ends up where it started sends nothing
+	ok = sends(
+			 0,
+			 [&] {
+				 aardvarkConfigBatch batch{adapter};
+				 adapter.i2cBitrate(100);
+				 adapter.i2cBitrate(200);
+			 },
+			 "batch restoring the applied settings") &&
+		 ok;
+
+	auto after = adapter.configStats();
+	ok = check(after.issued - stats.issued == 3, "issued command count") && ok;
+	ok = check(after.elided - stats.elided == 7, "merged request count") && ok;
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+
+	aardvarkAdapter adapter{aardvarkMode::GpioI2C};
+
+	// Nothing reaches the adapter before it is opened, and everything does once it is
+	bool ok = sends(0, [&] { adapter.i2cBitrate(100); }, "setting before start");
+	auto opened = aa_sim_stats().opens;
+	adapter.start();
+	ok = check(aa_sim_stats().opens == opened + 1 && adapter.handle() > 0, "adapter open") && ok;
+	ok = sends(0, [&] { adapter.i2cBitrate(100); }, "setting applied at start") && ok;
+
+	ok = runRepeated(adapter) && ok;
+	ok = runBatch(adapter) && ok;
+
+	adapter.stop();
+
+	printf("%s\n", ok ? "aardvark_config: ok" : "aardvark_config: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,219 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_coro: coroutine interface example, run against the simulated adapter (src/sim)
+ *
+ * Usage: aardvark_coro
+ *
+ * The example is built as C++20 and doubles as the test of aardvark/coro.hpp:
+ *
+ *  1. A top-level task writes an I2C register, reads it back through a nested task, runs an
+ *     I2C batch and an SPI loopback transfer, and checks every result.
+ *  2. A top-level task is destroyed while its transfer is still queued. The task must not be
+ *     resumed, and its frame must return to the pool once the transfer completes.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/coro.hpp>
+#include <aardvark/i2c.hpp>
+#include <aardvark/spi.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace embdrv;
+
+namespace
+{
+constexpr uint8_t TARGET_ADDRESS = 0x50;
+
+/// Longest time a task is given to finish.
+constexpr auto TASK_TIMEOUT = std::chrono::seconds(5);
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Wait until a top-level task finishes.
+template<typename T>
+bool wait(const aardvarkTask<T>& task)
+{
+	auto limit = std::chrono::steady_clock::now() + TASK_TIMEOUT;
+
+	while(!task.done() && std::chrono::steady_clock::now() < limit)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return task.done();
+}
+
+aardvarkTask<int> readRegister(aardvarkI2CMaster& i2c, uint8_t reg)
+{
+	uint8_t value = 0;
+	auto status = co_await writeReadAsync(i2c, TARGET_ADDRESS, &reg, 1, &value, 1);
+	co_return (status == embvm::i2c::status::ok) ? value : -1;
+}
+
+aardvarkTask<bool> exercise(aardvarkI2CMaster& i2c, aardvarkSPIMaster& spi)
+{
+	bool ok = true;
+
+	// Register 0x10 <- 0xa5, then read it back through a nested task
+	std::array<uint8_t, 2> write{0x10, 0xa5};
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::write;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = write.data();
+	op.tx_size = write.size();
+
+	ok = check(co_await transferAsync(i2c, op) == embvm::i2c::status::ok, "I2C write") && ok;
+	ok = check(co_await readRegister(i2c, 0x10) == 0xa5, "nested I2C read") && ok;
+
+	// Two register reads in one batch
+	std::array<uint8_t, 2> regs{0x10, 0x11};
+	std::array<uint8_t, 2> values{};
+	std::array<embvm::i2c::op_t, 2> batch;
+	for(size_t i = 0; i < batch.size(); i++)
+	{
+		batch[i].op = embvm::i2c::operation::writeRead;
+		batch[i].address = TARGET_ADDRESS;
+		batch[i].tx_buffer = &regs[i];
+		batch[i].tx_size = 1;
+		batch[i].rx_buffer = &values[i];
+		batch[i].rx_size = 1;
+	}
+
+	auto result = co_await transferAsync(i2c, batch.data(), batch.size());
+	ok = check(result.status == embvm::i2c::status::ok && result.completed == batch.size(),
+			   "I2C batch") &&
+		 ok;
+	ok = check(values[0] == 0xa5 && values[1] == 0x11, "I2C batch data") && ok;
+
+	// The simulated adapter loops MOSI back to MISO
+	std::array<uint8_t, 8> tx{1, 2, 3, 4, 5, 6, 7, 8};
+	std::array<uint8_t, 8> rx{};
+	embvm::spi::op_t spi_op;
+	spi_op.tx_buffer = tx.data();
+	spi_op.rx_buffer = rx.data();
+	spi_op.length = tx.size();
+
+	ok = check(co_await transferAsync(spi, spi_op) == embvm::comm::status::ok, "SPI transfer") &&
+		 ok;
+	ok = check(rx == tx, "SPI loopback data") && ok;
+
+	co_return ok;
+}
+
+aardvarkTask<> abandoned(aardvarkI2CMaster& i2c, std::atomic<bool>& resumed)
+{
+	// The buffer lives in the frame, which must stay valid until the read completes
+	std::array<uint8_t, 64> rx{};
+	uint8_t reg = 0;
+	(void)co_await writeReadAsync(i2c, TARGET_ADDRESS, &reg, 1, rx.data(), rx.size());
+	resumed = true;
+}
+
+bool runExercise(aardvarkI2CMaster& i2c, aardvarkSPIMaster& spi)
+{
+	auto task = exercise(i2c, spi);
+	if(!check(task.valid(), "task frame allocation"))
+	{
+		return false;
+	}
+
+	task.start();
+
+	return check(wait(task), "task completion") && task.result();
+}
+
+bool runCancellation(aardvarkI2CMaster& i2c)
+{
+	std::atomic<bool> resumed = false;
+
+	// Make the transfer take long enough to still be queued when the task is destroyed
+	aa_sim_bus_time(1);
+
+	{
+		auto task = abandoned(i2c, resumed);
+		task.start();
+	}
+
+	// Transfers of the same priority complete in order: once this one is done, so is the
+	// abandoned task's transfer
+	uint8_t reg = 0;
+	uint8_t value = 0;
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::writeRead;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = &reg;
+	op.tx_size = 1;
+	op.rx_buffer = &value;
+	op.rx_size = 1;
+
+	std::atomic<bool> done = false;
+	i2c.transfer(op, [&](embvm::i2c::op_t, embvm::i2c::status) { done = true; });
+
+	auto limit = std::chrono::steady_clock::now() + TASK_TIMEOUT;
+	while(!done && std::chrono::steady_clock::now() < limit)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	aa_sim_bus_time(0);
+
+	bool ok = check(done, "transfer completion after cancellation");
+	ok = check(!resumed, "cancelled task not resumed") && ok;
+
+	// Every frame is back in the pool
+	std::vector<aardvarkTask<int>> tasks;
+	for(size_t i = 0; i < AARDVARK_CORO_FRAME_COUNT; i++)
+	{
+		tasks.push_back(readRegister(i2c, 0));
+		ok = check(tasks.back().valid(), "frame released after cancellation") && ok;
+	}
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+	aa_sim_i2c_target(TARGET_ADDRESS, 1);
+
+	u08* registers = aa_sim_i2c_registers(TARGET_ADDRESS);
+	for(int i = 0; i < 256; i++)
+	{
+		registers[i] = static_cast<u08>(i);
+	}
+
+	aardvarkAdapter adapter{aardvarkMode::SpiI2C};
+	aardvarkI2CMaster i2c{adapter};
+	aardvarkSPIMaster spi{adapter};
+	i2c.start();
+	spi.start();
+
+	bool ok = runExercise(i2c, spi);
+	ok = runCancellation(i2c) && ok;
+
+	spi.stop();
+	i2c.stop();
+
+	printf("%s\n", ok ? "aardvark_coro: ok" : "aardvark_coro: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
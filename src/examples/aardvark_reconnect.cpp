@@ -0,0 +1,228 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_reconnect: USB reconnect example, run against the simulated adapter (src/sim)
+ *
+ * Usage: aardvark_reconnect
+ *
+ * The example unplugs the simulated adapter with aa_sim_disconnect(), which also makes it come
+ * back with its power-on settings, and doubles as the test of the reconnect path:
+ *
+ *  1. A register read interrupted by the disconnect is repeated once the adapter is back,
+ *     and the configuration is replayed: the GPIO pins read their configured levels again.
+ *  2. An interrupted write fails instead of being repeated.
+ *  3. A GPIO change detects the disconnect as well, and reconnects the adapter.
+ *  4. When the I2C master and a GPIO user hit the same disconnect, the adapter is reopened
+ *     once and both succeed.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/gpio.hpp>
+#include <aardvark/i2c.hpp>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <thread>
+
+using namespace embdrv;
+
+namespace
+{
+constexpr uint8_t TARGET_ADDRESS = 0x50;
+constexpr uint8_t REGISTER = 0x20;
+constexpr uint8_t OUTPUT_PIN = 3;
+constexpr uint8_t INPUT_PIN = 4;
+
+/// Disconnects in the concurrent phase.
+constexpr unsigned ROUNDS = 20;
+
+/// Longest time a transaction is given to complete.
+constexpr auto TRANSFER_TIMEOUT = std::chrono::seconds(10);
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Perform a transaction and wait for its status.
+embvm::i2c::status transact(aardvarkI2CMaster& i2c, const embvm::i2c::op_t& op)
+{
+	std::promise<embvm::i2c::status> done;
+	auto future = done.get_future();
+
+	i2c.transfer(op, [&done](embvm::i2c::op_t, embvm::i2c::status s) { done.set_value(s); });
+
+	if(future.wait_for(TRANSFER_TIMEOUT) != std::future_status::ready)
+	{
+		return embvm::i2c::status::unknown;
+	}
+
+	return future.get();
+}
+
+/// Read one register.
+embvm::i2c::status readRegister(aardvarkI2CMaster& i2c, uint8_t& value)
+{
+	uint8_t reg = REGISTER;
+
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::writeRead;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = &reg;
+	op.tx_size = 1;
+	op.rx_buffer = &value;
+	op.rx_size = 1;
+
+	return transact(i2c, op);
+}
+
+/// Write one register.
+embvm::i2c::status writeRegister(aardvarkI2CMaster& i2c, uint8_t value)
+{
+	std::array<uint8_t, 2> write{REGISTER, value};
+
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::write;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = write.data();
+	op.tx_size = write.size();
+
+	return transact(i2c, op);
+}
+
+/// An interrupted read is repeated, and the configuration comes back with the adapter.
+bool runRead(aardvarkAdapter& adapter, aardvarkI2CMaster& i2c, aardvarkGPIO& output,
+			 aardvarkGPIO& input)
+{
+	bool ok = check(writeRegister(i2c, 0x42) == embvm::i2c::status::ok, "register write");
+
+	auto before = aa_sim_stats();
+	aa_sim_disconnect();
+
+	uint8_t value = 0;
+	ok = check(readRegister(i2c, value) == embvm::i2c::status::ok, "interrupted read status") &&
+		 ok;
+	ok = check(value == 0x42, "interrupted read data") && ok;
+
+	auto after = aa_sim_stats();
+	auto stats = adapter.reconnectStats();
+	ok = check(stats.reconnects == 1 && stats.failures == 0, "reconnect count") && ok;
+	ok = check(after.opens - before.opens == 1, "adapter reopened once") && ok;
+	ok = check(after.config_commands > before.config_commands, "configuration replayed") && ok;
+
+	// The simulated adapter came back with every pin an input reading low
+	ok = check(output.get(), "GPIO output level replayed") && ok;
+	ok = check(input.get(), "GPIO input after reconnect") && ok;
+
+	return ok;
+}
+
+/// An interrupted write is not repeated.
+bool runWrite(aardvarkAdapter& adapter, aardvarkI2CMaster& i2c)
+{
+	aa_sim_disconnect();
+
+	bool ok = check(writeRegister(i2c, 0x24) == embvm::i2c::status::error,
+					"interrupted write fails");
+	ok = check(adapter.reconnectStats().reconnects == 2, "reconnect after a write") && ok;
+	ok = check(aa_sim_i2c_registers(TARGET_ADDRESS)[REGISTER] == 0x42, "write not repeated") &&
+		 ok;
+
+	// The adapter is usable for the next request
+	ok = check(writeRegister(i2c, 0x24) == embvm::i2c::status::ok, "write after reconnect") && ok;
+
+	return ok;
+}
+
+/// A GPIO change reconnects the adapter too.
+bool runGPIO(aardvarkAdapter& adapter, aardvarkGPIO& output)
+{
+	aa_sim_disconnect();
+	output.toggle();
+
+	bool ok = check(adapter.reconnectStats().reconnects == 3, "reconnect from GPIO");
+	ok = check(!output.get(), "GPIO toggle after reconnect") && ok;
+
+	return ok;
+}
+
+/// The I2C master and a GPIO user hit the same disconnect.
+bool runConcurrent(aardvarkAdapter& adapter, aardvarkI2CMaster& i2c, aardvarkGPIO& input)
+{
+	auto reconnects = adapter.reconnectStats().reconnects;
+	bool ok = true;
+
+	for(unsigned round = 0; round < ROUNDS && ok; round++)
+	{
+		aa_sim_disconnect();
+
+		bool gpio_ok = true;
+		std::thread reader([&] {
+			for(int i = 0; i < 5; i++)
+			{
+				gpio_ok = input.get() && gpio_ok;
+			}
+		});
+
+		uint8_t value = 0;
+		ok = check(readRegister(i2c, value) == embvm::i2c::status::ok && value == 0x24,
+				   "concurrent read") &&
+			 ok;
+
+		reader.join();
+		ok = check(gpio_ok, "concurrent GPIO read") && ok;
+	}
+
+	auto stats = adapter.reconnectStats();
+	ok = check(stats.reconnects - reconnects == ROUNDS, "one reconnect per disconnect") && ok;
+	ok = check(stats.failures == 0, "no failed reconnect") && ok;
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+	aa_sim_i2c_target(TARGET_ADDRESS, 1);
+	aa_sim_gpio_input(1 << INPUT_PIN);
+
+	aardvarkAdapter adapter{aardvarkMode::GpioI2C};
+	adapter.reconnectTimeout(std::chrono::milliseconds(1000));
+
+	aardvarkI2CMaster i2c{adapter};
+	aardvarkGPIO output{adapter, OUTPUT_PIN, embvm::gpio::mode::output};
+	aardvarkGPIO input{adapter, INPUT_PIN, embvm::gpio::mode::input};
+	i2c.start();
+	output.start();
+	input.start();
+
+	adapter.i2cBitrate(400);
+	output.set(true);
+
+	bool ok = runRead(adapter, i2c, output, input);
+	ok = runWrite(adapter, i2c) && ok;
+	ok = runGPIO(adapter, output) && ok;
+	ok = runConcurrent(adapter, i2c, input) && ok;
+
+	input.stop();
+	output.stop();
+	i2c.stop();
+
+	ok = check(adapter.handle() == 0 && adapter.attached() == 0, "adapter closed") && ok;
+
+	printf("%s\n", ok ? "aardvark_reconnect: ok" : "aardvark_reconnect: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
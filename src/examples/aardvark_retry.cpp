@@ -0,0 +1,214 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_retry: I2C retry policy example, run against the simulated adapter (src/sim)
+ *
+ * Usage: aardvark_retry
+ *
+ * The example injects bus errors with aa_sim_fail_next() and doubles as the test of the
+ * I2C retry path:
+ *
+ *  1. A transaction that fails twice succeeds on its third attempt, after both backoff
+ *     delays, with a bus clear before each retry.
+ *  2. A transaction that keeps failing is reported failed once its attempts are exhausted.
+ *  3. Without a retry policy, a failure is reported immediately.
+ *  4. A critical transaction submitted while a retry waits out its backoff completes first.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/i2c.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <thread>
+
+using namespace embdrv;
+using std::chrono::steady_clock;
+
+namespace
+{
+constexpr uint8_t TARGET_ADDRESS = 0x50;
+
+/// Longest time a transaction is given to complete.
+constexpr auto TRANSFER_TIMEOUT = std::chrono::seconds(10);
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Transaction submitted to the master, completed through a future.
+struct pending
+{
+	std::promise<embvm::i2c::status> promise;
+	std::future<embvm::i2c::status> future = promise.get_future();
+
+	embvm::i2c::master::cb_t callback()
+	{
+		return [this](embvm::i2c::op_t, embvm::i2c::status s) { promise.set_value(s); };
+	}
+
+	embvm::i2c::status wait()
+	{
+		if(future.wait_for(TRANSFER_TIMEOUT) != std::future_status::ready)
+		{
+			return embvm::i2c::status::unknown;
+		}
+
+		return future.get();
+	}
+};
+
+/// A transaction failing twice recovers on its third attempt.
+bool runRecovery(aardvarkI2CMaster& i2c, const embvm::i2c::op_t& op)
+{
+	aardvarkI2CRetryPolicy policy{};
+	policy.max_attempts = 3;
+	policy.backoff = std::chrono::milliseconds(5);
+	policy.backoff_multiplier = 2;
+
+	auto before = i2c.retryStats();
+	auto start = steady_clock::now();
+
+	pending p;
+	aa_sim_fail_next(2);
+	i2c.transfer(op, policy, p.callback());
+
+	bool ok = check(p.wait() == embvm::i2c::status::ok, "recovered transaction status");
+
+	// 5 ms before the first retry, 10 ms before the second
+	ok = check(steady_clock::now() - start >= std::chrono::milliseconds(15), "retry backoff") &&
+		 ok;
+
+	auto after = i2c.retryStats();
+	ok = check(after.retries - before.retries == 2, "retries of a recovered transaction") && ok;
+	ok = check(after.recovered - before.recovered == 1, "recovered count") && ok;
+	ok = check(after.exhausted == before.exhausted, "recovered transaction not exhausted") && ok;
+	ok = check(after.bus_clears - before.bus_clears == 2, "bus clear before each retry") && ok;
+
+	return ok;
+}
+
+/// A transaction failing on every attempt is reported failed.
+bool runExhaustion(aardvarkI2CMaster& i2c, const embvm::i2c::op_t& op)
+{
+	aardvarkI2CRetryPolicy policy{};
+	policy.max_attempts = 2;
+	policy.bus_clear = false;
+
+	auto before = i2c.retryStats();
+
+	pending p;
+	aa_sim_fail_next(2);
+	i2c.transfer(op, policy, p.callback());
+
+	bool ok = check(p.wait() == embvm::i2c::status::bus, "exhausted transaction status");
+
+	auto after = i2c.retryStats();
+	ok = check(after.retries - before.retries == 1, "retries of an exhausted transaction") && ok;
+	ok = check(after.exhausted - before.exhausted == 1, "exhausted count") && ok;
+	ok = check(after.recovered == before.recovered, "exhausted transaction not recovered") && ok;
+	ok = check(after.bus_clears == before.bus_clears, "bus clear disabled by the policy") && ok;
+
+	// The default policy does not retry
+	before = after;
+
+	pending once;
+	aa_sim_fail_next(1);
+	i2c.transfer(op, once.callback());
+
+	ok = check(once.wait() == embvm::i2c::status::bus, "failure without a retry policy") && ok;
+	ok = check(i2c.retryStats().retries == before.retries, "no retry by default") && ok;
+
+	return ok;
+}
+
+/// A critical transaction overtakes a retry waiting out its backoff.
+bool runOvertake(aardvarkI2CMaster& i2c, const embvm::i2c::op_t& op)
+{
+	aardvarkI2CRetryPolicy policy{};
+	policy.max_attempts = 2;
+	policy.backoff = std::chrono::milliseconds(200);
+
+	std::atomic<unsigned> order{0};
+	unsigned retried_rank = 0;
+	unsigned critical_rank = 0;
+
+	auto retries = i2c.retryStats().retries;
+
+	std::promise<void> retried_done;
+	aa_sim_fail_next(1);
+	i2c.transfer(op, policy, [&](embvm::i2c::op_t, embvm::i2c::status) {
+		retried_rank = ++order;
+		retried_done.set_value();
+	});
+
+	// Wait for the first attempt to fail and the retry to be deferred
+	auto limit = steady_clock::now() + TRANSFER_TIMEOUT;
+	while(i2c.retryStats().retries == retries && steady_clock::now() < limit)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	std::promise<void> critical_done;
+	auto start = steady_clock::now();
+	i2c.transfer(op, aardvarkSchedule{aardvarkPriority::critical},
+				 [&](embvm::i2c::op_t, embvm::i2c::status) {
+					 critical_rank = ++order;
+					 critical_done.set_value();
+				 });
+
+	bool ok = check(critical_done.get_future().wait_for(TRANSFER_TIMEOUT) ==
+						std::future_status::ready,
+					"critical transaction completion");
+	auto latency = steady_clock::now() - start;
+	ok = check(retried_done.get_future().wait_for(TRANSFER_TIMEOUT) == std::future_status::ready,
+			   "retried transaction completion") &&
+		 ok;
+
+	ok = check(critical_rank == 1 && retried_rank == 2, "critical transaction overtakes retry") &&
+		 ok;
+	ok = check(latency < policy.backoff, "critical transaction not held by the backoff") && ok;
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+	aa_sim_i2c_target(TARGET_ADDRESS, 1);
+
+	aardvarkAdapter adapter{aardvarkMode::GpioI2C};
+	aardvarkI2CMaster i2c{adapter};
+	i2c.start();
+
+	std::array<uint8_t, 3> write{0x10, 0x5a, 0xa5};
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::write;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = write.data();
+	op.tx_size = write.size();
+
+	bool ok = runRecovery(i2c, op);
+	ok = runExhaustion(i2c, op) && ok;
+	ok = runOvertake(i2c, op) && ok;
+
+	i2c.stop();
+
+	printf("%s\n", ok ? "aardvark_retry: ok" : "aardvark_retry: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
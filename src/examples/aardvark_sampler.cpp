@@ -0,0 +1,163 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_sampler: periodic register sampling example, run against the simulated adapter
+ * (src/sim)
+ *
+ * Usage: aardvark_sampler
+ *
+ * Three channels sample registers every 2, 4 and 10 ms. The example doubles as the test of
+ * aardvarkI2CSampler:
+ *
+ *  1. The periods are aligned on a 2 ms tick, and each channel is sampled on every tick that
+ *     is a multiple of its divisor, with the register contents it read.
+ *  2. A read failed with aa_sim_fail_next() costs only that channel's sample: the other
+ *     channels due on the same tick are still sampled.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/i2c.hpp>
+#include <aardvark/i2c_sampler.hpp>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace embdrv;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+namespace
+{
+constexpr uint8_t TARGET_ADDRESS = 0x50;
+
+/// Samples kept per channel: enough for the whole run, so none are dropped.
+constexpr size_t DEPTH = 1024;
+
+/// Channel settings
+struct channel
+{
+	uint8_t reg;
+	uint8_t length;
+	milliseconds period;
+	uint32_t divisor;
+};
+
+constexpr std::array<channel, 3> CHANNELS{{
+	{0x10, 4, milliseconds(2), 1},
+	{0x40, 2, milliseconds(4), 2},
+	{0x80, 1, milliseconds(10), 5},
+}};
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Check a channel's samples and counters.
+bool checkChannel(aardvarkI2CSampler& sampler, size_t id, const channel& ch)
+{
+	auto stats = sampler.statistics(id);
+
+	bool ok = check(stats.period == ch.period, "channel period aligned on the tick");
+	ok = check(stats.samples > 0 && stats.dropped == 0, "channel sampled") && ok;
+
+	std::vector<aardvarkSample> samples(DEPTH);
+	auto n = sampler.read(id, samples.data(), samples.size());
+	ok = check(n == stats.samples, "every sample read") && ok;
+
+	bool ticks = true;
+	bool data = true;
+	uint32_t gaps = 0;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		const auto& s = samples[i];
+		ticks = ticks && (s.tick % ch.divisor) == 0;
+
+		for(uint8_t b = 0; b < ch.length; b++)
+		{
+			data = data && s.length == ch.length && s.data[b] == ch.reg + b;
+		}
+
+		if(i > 0 && s.tick - samples[i - 1].tick != ch.divisor)
+		{
+			gaps++;
+		}
+	}
+
+	ok = check(ticks, "samples taken on the channel's ticks") && ok;
+	ok = check(data, "sample data") && ok;
+
+	// Every missing sample is accounted for by a failed read or an overrun of this channel
+	ok = check(gaps == stats.errors + stats.overruns, "missing samples accounted for") && ok;
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+	aa_sim_i2c_target(TARGET_ADDRESS, 1);
+
+	auto* registers = aa_sim_i2c_registers(TARGET_ADDRESS);
+	for(unsigned i = 0; i < 256; i++)
+	{
+		registers[i] = static_cast<uint8_t>(i);
+	}
+
+	aardvarkAdapter adapter{aardvarkMode::GpioI2C};
+	aardvarkI2CMaster i2c{adapter};
+	i2c.start();
+
+	bool ok = true;
+
+	{
+		aardvarkI2CSampler sampler{i2c};
+
+		std::array<size_t, CHANNELS.size()> ids{};
+		for(size_t i = 0; i < CHANNELS.size(); i++)
+		{
+			const auto& ch = CHANNELS[i];
+			ids[i] = sampler.add({TARGET_ADDRESS, ch.reg, ch.length,
+								  std::chrono::duration_cast<microseconds>(ch.period), DEPTH});
+		}
+
+		sampler.start();
+		std::this_thread::sleep_for(milliseconds(100));
+		aa_sim_fail_next(1);
+		std::this_thread::sleep_for(milliseconds(100));
+		sampler.stop();
+
+		auto stats = sampler.statistics();
+		ok = check(stats.tick == milliseconds(2), "common tick") && ok;
+		ok = check(stats.ticks > 0, "ticks issued") && ok;
+
+		uint32_t errors = 0;
+		for(size_t i = 0; i < CHANNELS.size(); i++)
+		{
+			errors += sampler.statistics(ids[i]).errors;
+			ok = checkChannel(sampler, ids[i], CHANNELS[i]) && ok;
+		}
+
+		ok = check(errors == 1, "the failed read is the only error") && ok;
+	}
+
+	i2c.stop();
+
+	printf("%s\n", ok ? "aardvark_sampler: ok" : "aardvark_sampler: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
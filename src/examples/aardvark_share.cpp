@@ -0,0 +1,300 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_share: adapter sharing example, run against the simulated adapter (src/sim)
+ *
+ * Usage: aardvark_share
+ *
+ * The example runs an aardvarkShareServer and two aardvarkShareClient connections in one
+ * process, and doubles as the test of the sharing server:
+ *
+ *  1. Both clients issue I2C and SPI transfers at the same time, through staged and
+ *     shared-memory buffers, and every transfer must complete with the expected data.
+ *  2. Malformed requests are rejected with an error response, and the server keeps serving
+ *     both clients afterwards.
+ *  3. With the adapter switched to GPIO mode, toggles from either client invert the shared
+ *     output level.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/i2c.hpp>
+#include <aardvark/share_client.hpp>
+#include <aardvark/share_server.hpp>
+#include <aardvark/spi.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+
+using namespace embdrv;
+
+namespace
+{
+constexpr uint8_t TARGET_ADDRESS = 0x50;
+
+/// Transfers issued by each client in the concurrent phase.
+constexpr unsigned TRANSFER_COUNT = 200;
+
+/// Longest time the transfers are given to finish.
+constexpr auto TRANSFER_TIMEOUT = std::chrono::seconds(10);
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Wait until count reaches target.
+bool wait(const std::atomic<unsigned>& count, unsigned target)
+{
+	auto limit = std::chrono::steady_clock::now() + TRANSFER_TIMEOUT;
+
+	while(count < target && std::chrono::steady_clock::now() < limit)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return count >= target;
+}
+
+/// Client 1: write registers, then read them back into a staged and a shared-memory buffer.
+bool runI2C(aardvarkShareClient& client)
+{
+	aardvarkRemoteI2CMaster i2c{client};
+	i2c.start();
+
+	std::array<uint8_t, 5> write{0x20, 0xde, 0xad, 0xbe, 0xef};
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::write;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = write.data();
+	op.tx_size = write.size();
+
+	std::atomic<unsigned> done = 0;
+	std::atomic<unsigned> failed = 0;
+	auto count = [&](embvm::i2c::op_t, embvm::i2c::status s) {
+		failed += (s != embvm::i2c::status::ok) ? 1 : 0;
+		done++;
+	};
+
+	for(unsigned i = 0; i < TRANSFER_COUNT; i++)
+	{
+		while(i2c.transfer(op, count) != embvm::i2c::status::enqueued)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	bool ok = check(wait(done, TRANSFER_COUNT), "I2C transfer completion");
+	ok = check(failed == 0, "I2C transfer status") && ok;
+
+	uint8_t reg = 0x20;
+	std::array<uint8_t, 4> staged{};
+	uint8_t* shared = client.allocate(4);
+	ok = check(shared != nullptr, "shared-memory allocation") && ok;
+
+	op.op = embvm::i2c::operation::writeRead;
+	op.tx_buffer = &reg;
+	op.tx_size = 1;
+	op.rx_buffer = staged.data();
+	op.rx_size = staged.size();
+	done = 0;
+	i2c.transfer(op, count);
+
+	op.rx_buffer = shared;
+	i2c.transfer(op, count);
+
+	ok = check(wait(done, 2), "I2C read completion") && ok;
+	ok = check(failed == 0, "I2C read status") && ok;
+	ok = check(staged[0] == 0xde && staged[3] == 0xef, "I2C read data (staged buffer)") && ok;
+	ok = check(shared != nullptr && shared[0] == 0xde && shared[3] == 0xef,
+			   "I2C read data (shared buffer)") &&
+		 ok;
+
+	client.deallocate(shared);
+	i2c.stop();
+
+	return ok;
+}
+
+/// Client 2: SPI loopback transfers.
+bool runSPI(aardvarkShareClient& client)
+{
+	aardvarkRemoteSPIMaster spi{client};
+	spi.start();
+
+	std::array<uint8_t, 16> tx{};
+	for(size_t i = 0; i < tx.size(); i++)
+	{
+		tx[i] = static_cast<uint8_t>(i * 3);
+	}
+
+	std::array<std::array<uint8_t, 16>, TRANSFER_COUNT> rx{};
+	std::atomic<unsigned> done = 0;
+	std::atomic<unsigned> failed = 0;
+
+	for(unsigned i = 0; i < TRANSFER_COUNT; i++)
+	{
+		embvm::spi::op_t op;
+		op.tx_buffer = tx.data();
+		op.rx_buffer = rx[i].data();
+		op.length = tx.size();
+
+		while(spi.transfer(op, [&](embvm::spi::op_t, embvm::comm::status s) {
+			failed += (s != embvm::comm::status::ok) ? 1 : 0;
+			done++;
+		}) != embvm::comm::status::enqueued)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	bool ok = check(wait(done, TRANSFER_COUNT), "SPI transfer completion");
+	ok = check(failed == 0, "SPI transfer status") && ok;
+
+	bool data = true;
+	for(const auto& r : rx)
+	{
+		data = data && (r == tx);
+	}
+	ok = check(data, "SPI loopback data") && ok;
+
+	spi.stop();
+
+	return ok;
+}
+
+/// Send requests the server must reject, then check the connection still works.
+bool runMalformed(aardvarkShareClient& client)
+{
+	aardvarkShareRequest req{};
+
+	// Not an embvm::gpio::mode the adapter supports
+	req.command = aardvarkShareCommand::gpioMode;
+	req.pin = 3;
+	req.arg = 2;
+	bool ok = check(client.call(req) < 0, "invalid GPIO mode rejected");
+
+	// Below the adapter's bitrate range
+	req = {};
+	req.command = aardvarkShareCommand::i2cBaudrate;
+	req.arg = 0;
+	ok = check(client.call(req) < 0, "zero I2C bitrate rejected") && ok;
+
+	// Unknown command
+	req = {};
+	req.command = static_cast<aardvarkShareCommand>(0xff);
+	ok = check(client.call(req) < 0, "unknown command rejected") && ok;
+
+	// The connection is still usable
+	req = {};
+	req.command = aardvarkShareCommand::spiBaudrate;
+	req.arg = 1000000;
+	uint32_t baud = 0;
+	ok = check(client.call(req, &baud) >= 0 && baud == 1000000, "server still serving") && ok;
+
+	return ok;
+}
+/// Toggle a pin from both clients: each toggle inverts the level the other one left.
+bool runGPIO(aardvarkShareClient& client1, aardvarkShareClient& client2)
+{
+	constexpr uint8_t pin = 3;
+
+	aardvarkRemoteGPIO gpio1{client1, pin, embvm::gpio::mode::output};
+	aardvarkRemoteGPIO gpio2{client2, pin, embvm::gpio::mode::output};
+	gpio1.start();
+	gpio2.start();
+
+	gpio1.set(false);
+	gpio1.toggle();
+	bool ok = check(gpio2.get(), "GPIO toggle");
+
+	gpio2.toggle();
+	ok = check(!gpio1.get(), "GPIO toggle from the other client") && ok;
+
+	gpio1.toggle();
+	ok = check(gpio1.get() && gpio2.get(), "GPIO toggle of the shared level") && ok;
+
+	gpio2.stop();
+	gpio1.stop();
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+	aa_sim_i2c_target(TARGET_ADDRESS, 1);
+
+	aardvarkAdapter adapter{aardvarkMode::SpiI2C};
+	aardvarkI2CMaster i2c{adapter};
+	aardvarkSPIMaster spi{adapter};
+	i2c.start();
+	spi.start();
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/aardvark_share-%d.sock", static_cast<int>(getpid()));
+
+	bool ok = true;
+
+	{
+		aardvarkShareServer server{adapter, &i2c, &spi};
+		if(!check(server.listen(path), "server listen"))
+		{
+			return EXIT_FAILURE;
+		}
+
+		std::thread runner([&server] { server.run(); });
+
+		aardvarkShareClient client1;
+		aardvarkShareClient client2;
+		ok = check(client1.connect(path) && client2.connect(path), "client connection") && ok;
+
+		if(ok)
+		{
+			bool i2c_ok = false;
+			bool spi_ok = false;
+			std::thread t1([&] { i2c_ok = runI2C(client1); });
+			std::thread t2([&] { spi_ok = runSPI(client2); });
+			t1.join();
+			t2.join();
+
+			ok = i2c_ok && spi_ok;
+			ok = runMalformed(client2) && ok;
+			ok = runI2C(client1) && ok;
+
+			// Free pins 2-5 for GPIO. The SPI master is stopped first, as it owns them.
+			spi.stop();
+			adapter.mode(aardvarkMode::GpioI2C);
+			ok = runGPIO(client1, client2) && ok;
+
+			auto stats = server.statistics();
+			ok = check(stats.clients == 2 && stats.connections == 2, "client accounting") && ok;
+			ok = check(stats.rejected == 3, "rejected request count") && ok;
+		}
+
+		client1.disconnect();
+		client2.disconnect();
+		server.stop();
+		runner.join();
+	}
+
+	spi.stop();
+	i2c.stop();
+
+	printf("%s\n", ok ? "aardvark_share: ok" : "aardvark_share: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
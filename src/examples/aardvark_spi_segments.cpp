@@ -0,0 +1,183 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_spi_segments: scatter-gather SPI example, run against the simulated adapter (src/sim)
+ *
+ * Usage: aardvark_spi_segments
+ *
+ * The simulated adapter loops MOSI back to MISO, so every segment receives the bytes it
+ * transmitted. The example doubles as the test of scatter-gather transfers:
+ *
+ *  1. A command header, a payload and a read-only tail are gathered into a single adapter
+ *     transaction, and the received bytes are scattered back to the right segments.
+ *  2. Segments without a tx buffer transmit zeroes, and segments without an rx buffer
+ *     discard what they receive.
+ *  3. Segments adding up to more than one adapter transaction are rejected up front.
+ *
+ * The example exits with an error if any check fails.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/spi.hpp>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <vector>
+
+using namespace embdrv;
+
+namespace
+{
+/// Longest time a transfer is given to complete.
+constexpr auto TRANSFER_TIMEOUT = std::chrono::seconds(10);
+
+bool check(bool condition, const char* what)
+{
+	if(!condition)
+	{
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+
+	return condition;
+}
+
+/// Result of a scatter-gather transfer
+struct result
+{
+	embvm::comm::status status = embvm::comm::status::unknown;
+	size_t length = 0;
+};
+
+/// Perform a scatter-gather transfer and wait for it.
+result transfer(aardvarkSPIMaster& spi, const aardvarkSPISegment* segments, size_t count)
+{
+	std::promise<result> done;
+	auto future = done.get_future();
+
+	auto r = spi.transfer(segments, count, [&done](embvm::comm::status s, size_t length) {
+		done.set_value({s, length});
+	});
+
+	if(r != embvm::comm::status::enqueued ||
+	   future.wait_for(TRANSFER_TIMEOUT) != std::future_status::ready)
+	{
+		return {r, 0};
+	}
+
+	return future.get();
+}
+
+/// Header, payload and tail in one transaction.
+bool runGatherScatter(aardvarkSPIMaster& spi)
+{
+	std::array<uint8_t, 2> header{0x9f, 0x01};
+	std::array<uint8_t, 4> payload{0xde, 0xad, 0xbe, 0xef};
+	std::array<uint8_t, 4> payload_rx{};
+	std::array<uint8_t, 3> tail_rx{0xff, 0xff, 0xff};
+
+	std::array<aardvarkSPISegment, 3> segments{{
+		{header.data(), nullptr, header.size()},
+		{payload.data(), payload_rx.data(), payload.size()},
+		{nullptr, tail_rx.data(), tail_rx.size()},
+	}};
+
+	auto before = aa_sim_stats().spi_transactions;
+	auto r = transfer(spi, segments.data(), segments.size());
+
+	bool ok = check(r.status == embvm::comm::status::ok, "scatter-gather status");
+	ok = check(r.length == header.size() + payload.size() + tail_rx.size(),
+			   "scatter-gather length") &&
+		 ok;
+	ok = check(aa_sim_stats().spi_transactions - before == 1, "single adapter transaction") &&
+		 ok;
+	ok = check(payload_rx == payload, "payload scattered to its rx buffer") && ok;
+	ok = check(tail_rx == std::array<uint8_t, 3>{}, "zeroes clocked out without a tx buffer") &&
+		 ok;
+
+	return ok;
+}
+
+/// Many small segments keep their order.
+bool runManySegments(aardvarkSPIMaster& spi)
+{
+	constexpr size_t count = 64;
+
+	std::vector<uint8_t> tx(count * 2);
+	std::vector<uint8_t> rx(count * 2, 0);
+	std::vector<aardvarkSPISegment> segments(count);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		tx[i * 2] = static_cast<uint8_t>(i);
+		tx[i * 2 + 1] = static_cast<uint8_t>(~i);
+
+		// Reverse the rx layout so a misplaced scatter shows up
+		segments[i] = {&tx[i * 2], &rx[(count - 1 - i) * 2], 2};
+	}
+
+	auto r = transfer(spi, segments.data(), segments.size());
+	bool ok = check(r.status == embvm::comm::status::ok && r.length == tx.size(),
+					"many segments status");
+
+	bool data = true;
+	for(size_t i = 0; i < count; i++)
+	{
+		data = data && rx[(count - 1 - i) * 2] == tx[i * 2] &&
+			   rx[(count - 1 - i) * 2 + 1] == tx[i * 2 + 1];
+	}
+
+	return check(data, "many segments data") && ok;
+}
+
+/// Segments beyond one adapter transaction are rejected.
+bool runOversize(aardvarkSPIMaster& spi)
+{
+	std::vector<uint8_t> buffer(UINT16_MAX);
+	std::array<aardvarkSPISegment, 2> segments{{
+		{buffer.data(), nullptr, buffer.size()},
+		{nullptr, nullptr, 1},
+	}};
+
+	bool called = false;
+	auto before = aa_sim_stats().spi_transactions;
+	auto r = spi.transfer(segments.data(), segments.size(),
+						  [&called](embvm::comm::status, size_t) { called = true; });
+
+	bool ok = check(r == embvm::comm::status::error, "oversize transfer rejected");
+	ok = check(!called && aa_sim_stats().spi_transactions == before,
+			   "oversize transfer not performed") &&
+		 ok;
+
+	// One byte less fits
+	segments[1].length = 0;
+	ok = check(transfer(spi, segments.data(), segments.size()).status ==
+				   embvm::comm::status::ok,
+			   "largest transfer") &&
+		 ok;
+
+	return ok;
+}
+} // namespace
+
+int main()
+{
+	aa_sim_reset();
+
+	aardvarkAdapter adapter{aardvarkMode::SpiGpio};
+	aardvarkSPIMaster spi{adapter};
+	spi.start();
+
+	bool ok = runGatherScatter(spi);
+	ok = runManySegments(spi) && ok;
+	ok = runOversize(spi) && ok;
+
+	spi.stop();
+
+	printf("%s\n", ok ? "aardvark_spi_segments: ok" : "aardvark_spi_segments: FAILED");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,601 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "aardvark_sim.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_UNIQUE_ID 2237000001u
+#define SIM_I2C_TARGETS 128
+#define SIM_I2C_REGISTERS 256
+#define SIM_I2C_MAX_KHZ 800
+#define SIM_SPI_MIN_KHZ 125
+#define SIM_SPI_MAX_KHZ 8000
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct
+{
+	/// Handle of the open adapter, or 0 if closed.
+	Aardvark handle;
+	/// Last handle issued.
+	Aardvark generation;
+	/// True after aa_sim_disconnect() until the adapter is reopened.
+	int disconnected;
+	/// Current AardvarkConfig.
+	int mode;
+	u08 target_power;
+	u08 i2c_pullups;
+	int i2c_khz;
+	u16 i2c_timeout_ms;
+	int spi_khz;
+	u08 gpio_direction;
+	u08 gpio_pullup;
+	u08 gpio_output;
+	u08 gpio_input;
+	u32 fail_next;
+	int bus_time;
+	u08 present[SIM_I2C_TARGETS];
+	u08 pointer[SIM_I2C_TARGETS];
+	u08 registers[SIM_I2C_TARGETS][SIM_I2C_REGISTERS];
+	AardvarkSimStats stats;
+} sim = {.mode = AA_CONFIG_SPI_I2C, .i2c_khz = 100, .i2c_timeout_ms = 200, .spi_khz = 1000};
+
+/// Check a handle. Must be called with sim_lock held.
+static int check_handle(Aardvark aardvark)
+{
+	if(sim.disconnected)
+	{
+		return AA_COMMUNICATION_ERROR;
+	}
+
+	if(aardvark <= 0 || aardvark != sim.handle)
+	{
+		return AA_INVALID_HANDLE;
+	}
+
+	return AA_OK;
+}
+
+/// Sleep for the wire time of a transfer. Must be called with sim_lock held, since the
+/// adapter serializes transactions.
+static void wire_time(u32 bits, int khz)
+{
+	if(!sim.bus_time || khz <= 0 || bits == 0)
+	{
+		return;
+	}
+
+	unsigned long long ns = (unsigned long long)bits * 1000000ull / (unsigned long long)khz;
+	struct timespec t = {(time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull)};
+	nanosleep(&t, NULL);
+}
+
+/// Consume an injected fault. Must be called with sim_lock held.
+static int take_fault(void)
+{
+	if(sim.fail_next)
+	{
+		sim.fail_next--;
+		return 1;
+	}
+
+	return 0;
+}
+
+void aa_sim_reset(void)
+{
+	pthread_mutex_lock(&sim_lock);
+	memset(sim.present, 0, sizeof(sim.present));
+	memset(sim.pointer, 0, sizeof(sim.pointer));
+	memset(sim.registers, 0, sizeof(sim.registers));
+	memset(&sim.stats, 0, sizeof(sim.stats));
+	sim.fail_next = 0;
+	sim.bus_time = 0;
+	sim.gpio_input = 0;
+	sim.disconnected = 0;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void aa_sim_i2c_target(u16 address, int present)
+{
+	if(address < SIM_I2C_TARGETS)
+	{
+		pthread_mutex_lock(&sim_lock);
+		sim.present[address] = present ? 1 : 0;
+		pthread_mutex_unlock(&sim_lock);
+	}
+}
+
+u08* aa_sim_i2c_registers(u16 address)
+{
+	return (address < SIM_I2C_TARGETS) ? sim.registers[address] : NULL;
+}
+
+void aa_sim_fail_next(u32 count)
+{
+	pthread_mutex_lock(&sim_lock);
+	sim.fail_next = count;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void aa_sim_disconnect(void)
+{
+	pthread_mutex_lock(&sim_lock);
+	if(sim.handle > 0)
+	{
+		sim.disconnected = 1;
+		sim.handle = 0;
+
+		// The adapter powers up with its default settings when it comes back
+		sim.mode = AA_CONFIG_SPI_I2C;
+		sim.target_power = 0;
+		sim.i2c_pullups = 0;
+		sim.i2c_khz = 100;
+		sim.i2c_timeout_ms = 200;
+		sim.spi_khz = 1000;
+		sim.gpio_direction = 0;
+		sim.gpio_pullup = 0;
+		sim.gpio_output = 0;
+	}
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void aa_sim_gpio_input(u08 mask)
+{
+	pthread_mutex_lock(&sim_lock);
+	sim.gpio_input = mask;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void aa_sim_bus_time(int enable)
+{
+	pthread_mutex_lock(&sim_lock);
+	sim.bus_time = enable;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+AardvarkSimStats aa_sim_stats(void)
+{
+	pthread_mutex_lock(&sim_lock);
+	AardvarkSimStats stats = sim.stats;
+	pthread_mutex_unlock(&sim_lock);
+
+	return stats;
+}
+
+/*=========================================================================
+| Simulated aardvark.h API
+ ========================================================================*/
+
+int aa_find_devices_ext(int num_devices, u16* devices, int num_ids, u32* unique_ids)
+{
+	pthread_mutex_lock(&sim_lock);
+	if(num_devices > 0 && devices)
+	{
+		devices[0] = (u16)(sim.handle > 0 ? AA_PORT_NOT_FREE : 0);
+	}
+	if(num_ids > 0 && unique_ids)
+	{
+		unique_ids[0] = SIM_UNIQUE_ID;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return 1;
+}
+
+Aardvark aa_open(int port_number)
+{
+	Aardvark r;
+
+	pthread_mutex_lock(&sim_lock);
+	if(port_number != 0 || sim.handle > 0)
+	{
+		r = AA_UNABLE_TO_OPEN;
+	}
+	else
+	{
+		sim.handle = ++sim.generation;
+		sim.disconnected = 0;
+		sim.stats.opens++;
+		r = sim.handle;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_close(Aardvark aardvark)
+{
+	pthread_mutex_lock(&sim_lock);
+	if(aardvark > 0 && aardvark == sim.handle)
+	{
+		sim.handle = 0;
+		sim.stats.closes++;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return 1;
+}
+
+u32 aa_unique_id(Aardvark aardvark)
+{
+	pthread_mutex_lock(&sim_lock);
+	u32 id = (check_handle(aardvark) == AA_OK) ? SIM_UNIQUE_ID : 0;
+	pthread_mutex_unlock(&sim_lock);
+
+	return id;
+}
+
+int aa_configure(Aardvark aardvark, AardvarkConfig config)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		if(config != AA_CONFIG_QUERY)
+		{
+			sim.mode = config & (AA_CONFIG_SPI_MASK | AA_CONFIG_I2C_MASK);
+			sim.stats.config_commands++;
+		}
+		r = sim.mode;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_target_power(Aardvark aardvark, u08 power_mask)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		if(power_mask != AA_TARGET_POWER_QUERY)
+		{
+			sim.target_power = power_mask & AA_TARGET_POWER_BOTH;
+			sim.stats.config_commands++;
+		}
+		r = sim.target_power;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_i2c_pullup(Aardvark aardvark, u08 pullup_mask)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		if(pullup_mask != AA_I2C_PULLUP_QUERY)
+		{
+			sim.i2c_pullups = pullup_mask & AA_I2C_PULLUP_BOTH;
+			sim.stats.config_commands++;
+		}
+		r = sim.i2c_pullups;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_i2c_bitrate(Aardvark aardvark, int bitrate_khz)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		if(bitrate_khz > 0)
+		{
+			sim.i2c_khz = bitrate_khz > SIM_I2C_MAX_KHZ ? SIM_I2C_MAX_KHZ : bitrate_khz;
+			sim.stats.config_commands++;
+		}
+		r = sim.i2c_khz;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_i2c_bus_timeout(Aardvark aardvark, u16 timeout_ms)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		if(timeout_ms > 0)
+		{
+			sim.i2c_timeout_ms = timeout_ms;
+			sim.stats.config_commands++;
+		}
+		r = sim.i2c_timeout_ms;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_i2c_free_bus(Aardvark aardvark)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK && !(sim.mode & AA_CONFIG_I2C_MASK))
+	{
+		r = AA_I2C_NOT_ENABLED;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+/// Start an I2C transaction. Must be called with sim_lock held.
+/// Returns AA_OK, a negative AardvarkStatus, or a positive AardvarkI2cStatus.
+static int i2c_begin(Aardvark aardvark, u16 slave_addr)
+{
+	int r = check_handle(aardvark);
+	if(r != AA_OK)
+	{
+		return r;
+	}
+
+	if(!(sim.mode & AA_CONFIG_I2C_MASK))
+	{
+		return AA_I2C_NOT_ENABLED;
+	}
+
+	sim.stats.i2c_transactions++;
+
+	if(take_fault())
+	{
+		return AA_I2C_STATUS_BUS_ERROR;
+	}
+
+	if(slave_addr >= SIM_I2C_TARGETS || !sim.present[slave_addr])
+	{
+		wire_time(9, sim.i2c_khz);
+		return AA_I2C_STATUS_SLA_NACK;
+	}
+
+	return AA_OK;
+}
+
+/// Write to an I2C target. Must be called with sim_lock held.
+static void i2c_write(u16 slave_addr, u16 num_bytes, const u08* data_out)
+{
+	if(num_bytes > 0)
+	{
+		sim.pointer[slave_addr] = data_out[0];
+	}
+
+	for(u16 i = 1; i < num_bytes; i++)
+	{
+		sim.registers[slave_addr][sim.pointer[slave_addr]++] = data_out[i];
+	}
+
+	wire_time(9u * (num_bytes + 1u), sim.i2c_khz);
+}
+
+/// Read from an I2C target. Must be called with sim_lock held.
+static void i2c_read(u16 slave_addr, u16 num_bytes, u08* data_in)
+{
+	for(u16 i = 0; i < num_bytes; i++)
+	{
+		data_in[i] = sim.registers[slave_addr][sim.pointer[slave_addr]++];
+	}
+
+	wire_time(9u * (num_bytes + 1u), sim.i2c_khz);
+}
+
+int aa_i2c_write_ext(Aardvark aardvark, u16 slave_addr, AardvarkI2cFlags flags, u16 num_bytes,
+					 const u08* data_out, u16* num_written)
+{
+	(void)flags;
+
+	pthread_mutex_lock(&sim_lock);
+	int r = i2c_begin(aardvark, slave_addr);
+	u16 written = 0;
+	if(r == AA_OK)
+	{
+		i2c_write(slave_addr, num_bytes, data_out);
+		written = num_bytes;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	if(num_written)
+	{
+		*num_written = written;
+	}
+
+	return r;
+}
+
+int aa_i2c_read_ext(Aardvark aardvark, u16 slave_addr, AardvarkI2cFlags flags, u16 num_bytes,
+					u08* data_in, u16* num_read)
+{
+	(void)flags;
+
+	pthread_mutex_lock(&sim_lock);
+	int r = i2c_begin(aardvark, slave_addr);
+	u16 read = 0;
+	if(r == AA_OK)
+	{
+		i2c_read(slave_addr, num_bytes, data_in);
+		read = num_bytes;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	if(num_read)
+	{
+		*num_read = read;
+	}
+
+	return r;
+}
+
+int aa_i2c_write_read(Aardvark aardvark, u16 slave_addr, AardvarkI2cFlags flags, u16 out_num_bytes,
+					  const u08* out_data, u16* num_written, u16 in_num_bytes, u08* in_data,
+					  u16* num_read)
+{
+	(void)flags;
+
+	pthread_mutex_lock(&sim_lock);
+	int r = i2c_begin(aardvark, slave_addr);
+	u16 written = 0;
+	u16 read = 0;
+	if(r == AA_OK)
+	{
+		i2c_write(slave_addr, out_num_bytes, out_data);
+		i2c_read(slave_addr, in_num_bytes, in_data);
+		written = out_num_bytes;
+		read = in_num_bytes;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	if(num_written)
+	{
+		*num_written = written;
+	}
+	if(num_read)
+	{
+		*num_read = read;
+	}
+
+	// The read status is reported in bits 8-15 and the write status in bits 0-7
+	return (r > 0) ? ((r << 8) | r) : r;
+}
+
+int aa_spi_bitrate(Aardvark aardvark, int bitrate_khz)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		if(bitrate_khz > 0)
+		{
+			// The adapter divides its clock down, so report the nearest rate at or below the request
+			int khz = SIM_SPI_MAX_KHZ;
+			while(khz > bitrate_khz && khz > SIM_SPI_MIN_KHZ)
+			{
+				khz /= 2;
+			}
+			sim.spi_khz = khz;
+			sim.stats.config_commands++;
+		}
+		r = sim.spi_khz;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_spi_configure(Aardvark aardvark, AardvarkSpiPolarity polarity, AardvarkSpiPhase phase,
+					 AardvarkSpiBitorder bitorder)
+{
+	(void)polarity;
+	(void)phase;
+	(void)bitorder;
+
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		sim.stats.config_commands++;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_spi_write(Aardvark aardvark, u16 out_num_bytes, const u08* data_out, u16 in_num_bytes,
+				 u08* data_in)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK && !(sim.mode & AA_CONFIG_SPI_MASK))
+	{
+		r = AA_SPI_NOT_ENABLED;
+	}
+	if(r == AA_OK)
+	{
+		sim.stats.spi_transactions++;
+
+		if(take_fault())
+		{
+			r = AA_SPI_WRITE_ERROR;
+		}
+		else
+		{
+			u16 length = out_num_bytes > in_num_bytes ? out_num_bytes : in_num_bytes;
+			for(u16 i = 0; i < in_num_bytes; i++)
+			{
+				data_in[i] = (i < out_num_bytes) ? data_out[i] : 0;
+			}
+			wire_time(8u * length, sim.spi_khz);
+			r = in_num_bytes;
+		}
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_gpio_direction(Aardvark aardvark, u08 direction_mask)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		sim.gpio_direction = direction_mask;
+		sim.stats.config_commands++;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_gpio_pullup(Aardvark aardvark, u08 pullup_mask)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		sim.gpio_pullup = pullup_mask;
+		sim.stats.config_commands++;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_gpio_get(Aardvark aardvark)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		sim.stats.gpio_commands++;
+		r = (sim.gpio_output & sim.gpio_direction) | (sim.gpio_input & ~sim.gpio_direction);
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+int aa_gpio_set(Aardvark aardvark, u08 value)
+{
+	pthread_mutex_lock(&sim_lock);
+	int r = check_handle(aardvark);
+	if(r == AA_OK)
+	{
+		sim.stats.gpio_commands++;
+		sim.gpio_output = value;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
@@ -0,0 +1,76 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+#ifndef AARDVARK_SIM_H_
+#define AARDVARK_SIM_H_
+
+/*
+ * Simulated Aardvark backend
+ *
+ * Link aardvark_sim_native in place of aardvark_vendor_native to run the drivers without an
+ * adapter. The simulation implements the subset of aardvark.h used by the drivers for a single
+ * adapter on port 0:
+ *
+ *	- I2C targets are 256-byte register files. The first byte of a write sets the register
+ *	  pointer, the remaining bytes are stored from there. Reads continue from the pointer.
+ *	- SPI is looped back: MISO returns the bytes clocked out on MOSI.
+ *	- GPIO inputs read the value set with aa_sim_gpio_input(), outputs read back their latch.
+ *
+ * The functions below control the simulation. They are thread-safe.
+ */
+
+#include "aardvark.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Counters of the calls made into the simulated adapter
+typedef struct
+{
+	/// Successful aa_open() calls.
+	u32 opens;
+	/// aa_close() calls that closed the open handle.
+	u32 closes;
+	/// Configuration commands (mode, power, pullups, bitrates, timeouts, SPI and GPIO setup).
+	u32 config_commands;
+	/// I2C transactions, including failed ones.
+	u32 i2c_transactions;
+	/// SPI transactions, including failed ones.
+	u32 spi_transactions;
+	/// GPIO reads and writes.
+	u32 gpio_commands;
+} AardvarkSimStats;
+
+/// Restore the power-on state: no targets, no faults, zeroed counters, zero bus time.
+void aa_sim_reset(void);
+
+/// Add (present != 0) or remove an I2C target at a 7-bit address.
+void aa_sim_i2c_target(u16 address, int present);
+
+/// Access the register file of an I2C target.
+/// Returns a pointer to 256 bytes, valid until the simulation is reset.
+u08* aa_sim_i2c_registers(u16 address);
+
+/// Make the next count I2C or SPI transactions fail with a bus error.
+void aa_sim_fail_next(u32 count);
+
+/// Simulate a USB disconnect: the open handle becomes invalid until the adapter is reopened,
+/// and the adapter comes back with its power-on settings.
+void aa_sim_disconnect(void);
+
+/// Set the levels read on GPIO pins configured as inputs.
+void aa_sim_gpio_input(u08 mask);
+
+/// Make transactions take the time they would take on the wire at the configured bitrate.
+/// Disabled by default, so transactions complete immediately.
+void aa_sim_bus_time(int enable);
+
+/// Get a snapshot of the call counters.
+AardvarkSimStats aa_sim_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AARDVARK_SIM_H_
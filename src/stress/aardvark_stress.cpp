@@ -0,0 +1,622 @@
+// Copyright 2020 Embedded Artistry LLC
+// SPDX-License-Identifier: MIT
+
+/*
+ * aardvark_stress: concurrency stress and scaling harness for a shared Aardvark adapter
+ *
+ * Usage: aardvark_stress [-m spi-i2c|spi-gpio|gpio-i2c|gpio] [-n clients] [-d ms] [-c cycles]
+ *                        [-s seed] [-w]
+ *
+ * The harness runs against the simulated adapter (src/sim) in two phases:
+ *
+ *  1. Churn: several threads start and stop their own I2C, SPI and GPIO drivers on the
+ *     shared adapter in random order, some also attaching to it directly, and perform one
+ *     operation while started. Every started driver must hold an adapter reference, and
+ *     afterwards the adapter must have been opened and closed the same number of times and
+ *     must never have been closed under a running driver.
+ *
+ *  2. Scaling: for 1, 2, 4, ... clients per driver type, closed-loop client threads share
+ *     one I2C master, one SPI master, and the GPIO pins the mode leaves free. Each step
+ *     reports the aggregate throughput, the latency distribution, the fairness between
+ *     clients (least served / most served), and the bus arbitration it took. Steps where
+ *     most bus transfers wait for the adapter in arbitration and throughput stops scaling
+ *     are flagged as convoys; steps where a client receives less than a quarter of the
+ *     service of another are flagged as starvation.
+ *
+ * Correctness failures make the harness exit with an error. Build with
+ * -Db_sanitize=thread to have ThreadSanitizer check for data races as well.
+ */
+
+#include "aardvark_sim.h"
+#include <aardvark/base.hpp>
+#include <aardvark/gpio.hpp>
+#include <aardvark/i2c.hpp>
+#include <aardvark/mode_option.hpp>
+#include <aardvark/spi.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace embdrv;
+using std::chrono::steady_clock;
+
+namespace
+{
+constexpr uint8_t TARGET_ADDRESS = 0x50;
+
+/// Latency histogram bucket width is 1 us; the last bucket collects everything slower.
+constexpr size_t HISTOGRAM_BUCKETS = 10000;
+
+/// A step is a convoy when more than this share of bus transfers waits in arbitration...
+constexpr double CONVOY_CONTENTION = 0.5;
+/// ...and doubling the clients improves throughput by less than this factor.
+constexpr double CONVOY_SCALING = 1.1;
+
+/// Options other than -m, for the usage message.
+constexpr const char* STRESS_OPTIONS = "[-n clients] [-d ms] [-c cycles] [-s seed] [-w]";
+
+/// A step starves a client when it receives less than this share of the best-served client.
+constexpr double STARVATION_FAIRNESS = 0.25;
+
+struct histogram
+{
+	std::array<uint32_t, HISTOGRAM_BUCKETS> buckets{};
+	uint64_t count = 0;
+	uint32_t max_us = 0;
+
+	void record(steady_clock::duration d) noexcept
+	{
+		auto us = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+		buckets[std::min<size_t>(us, HISTOGRAM_BUCKETS - 1)]++;
+		count++;
+		max_us = std::max(max_us, us);
+	}
+
+	void merge(const histogram& other) noexcept
+	{
+		for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			buckets[i] += other.buckets[i];
+		}
+
+		count += other.count;
+		max_us = std::max(max_us, other.max_us);
+	}
+
+	uint32_t percentile(double p) const noexcept
+	{
+		auto target = static_cast<uint64_t>(p * static_cast<double>(count));
+		uint64_t seen = 0;
+
+		for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			seen += buckets[i];
+			if(seen > target)
+			{
+				return static_cast<uint32_t>(i);
+			}
+		}
+
+		return max_us;
+	}
+};
+
+/// Results of one closed-loop client thread
+struct client
+{
+	histogram latency;
+	uint64_t ops = 0;
+	uint64_t failures = 0;
+};
+
+/// Wait for an asynchronous completion
+class completion
+{
+  public:
+	void signal() noexcept
+	{
+		// Notify with the lock held: the waiter may destroy the completion once it returns
+		std::lock_guard<std::mutex> lock(lock_);
+		done_ = true;
+		cv_.notify_one();
+	}
+
+	void wait() noexcept
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+		cv_.wait(lock, [this] { return done_; });
+		done_ = false;
+	}
+
+  private:
+	std::mutex lock_;
+	std::condition_variable cv_;
+	bool done_ = false;
+};
+
+struct options
+{
+	aardvarkMode mode = aardvarkMode::SpiI2C;
+	size_t max_clients = 16;
+	std::chrono::milliseconds duration{500};
+	unsigned cycles = 200;
+	unsigned seed = 1;
+	bool wire_time = false;
+};
+
+bool hasI2C(aardvarkMode m)
+{
+	return (static_cast<int>(m) & static_cast<int>(aardvarkMode::GpioI2C)) != 0;
+}
+
+bool hasSPI(aardvarkMode m)
+{
+	return (static_cast<int>(m) & static_cast<int>(aardvarkMode::SpiGpio)) != 0;
+}
+
+/// GPIO pins left free by a mode: SCL/SDA unless I2C is enabled, the SPI pins unless SPI is.
+std::vector<uint8_t> gpioPins(aardvarkMode m)
+{
+	std::vector<uint8_t> pins;
+
+	for(uint8_t pin = 0; pin < AARDVARK_IO_COUNT; pin++)
+	{
+		if((pin < 2) ? !hasI2C(m) : !hasSPI(m))
+		{
+			pins.push_back(pin);
+		}
+	}
+
+	return pins;
+}
+
+embvm::i2c::status i2cRead(aardvarkI2CMaster& i2c, uint8_t reg, uint8_t* rx, size_t length)
+{
+	embvm::i2c::op_t op;
+	op.op = embvm::i2c::operation::writeRead;
+	op.address = TARGET_ADDRESS;
+	op.tx_buffer = &reg;
+	op.tx_size = 1;
+	op.rx_buffer = rx;
+	op.rx_size = length;
+
+	completion done;
+	auto result = embvm::i2c::status::unknown;
+
+	i2c.transfer(op, [&](embvm::i2c::op_t, embvm::i2c::status status) {
+		result = status;
+		done.signal();
+	});
+	done.wait();
+
+	return result;
+}
+
+embvm::comm::status spiTransfer(aardvarkSPIMaster& spi, const uint8_t* tx, uint8_t* rx,
+								size_t length)
+{
+	embvm::spi::op_t op;
+	op.tx_buffer = tx;
+	op.rx_buffer = rx;
+	op.length = length;
+
+	completion done;
+	auto result = embvm::comm::status::unknown;
+
+	spi.transfer(op, [&](embvm::spi::op_t, embvm::comm::status status) {
+		result = status;
+		done.signal();
+	});
+	done.wait();
+
+	return result;
+}
+
+void runI2C(aardvarkI2CMaster& i2c, client& c, uint8_t id, const std::atomic<bool>& stop)
+{
+	std::array<uint8_t, 4> rx{};
+
+	while(!stop.load(std::memory_order_relaxed))
+	{
+		auto start = steady_clock::now();
+		auto status = i2cRead(i2c, id, rx.data(), rx.size());
+		c.latency.record(steady_clock::now() - start);
+
+		c.ops++;
+		if(status != embvm::i2c::status::ok || rx[0] != id)
+		{
+			c.failures++;
+		}
+	}
+}
+
+void runSPI(aardvarkSPIMaster& spi, client& c, uint8_t id, const std::atomic<bool>& stop)
+{
+	std::array<uint8_t, 16> tx{};
+	std::array<uint8_t, 16> rx{};
+	tx.fill(id);
+
+	while(!stop.load(std::memory_order_relaxed))
+	{
+		auto start = steady_clock::now();
+		auto status = spiTransfer(spi, tx.data(), rx.data(), tx.size());
+		c.latency.record(steady_clock::now() - start);
+
+		c.ops++;
+		// The simulated adapter loops MOSI back to MISO
+		if(status != embvm::comm::status::ok || rx != tx)
+		{
+			c.failures++;
+		}
+	}
+}
+
+void runGPIO(aardvarkGPIO& gpio, client& c, const std::atomic<bool>& stop)
+{
+	while(!stop.load(std::memory_order_relaxed))
+	{
+		auto start = steady_clock::now();
+		gpio.toggle();
+		(void)gpio.get();
+		c.latency.record(steady_clock::now() - start);
+
+		c.ops++;
+	}
+}
+
+/// Phase 1: random start/stop ordering of client drivers that share the adapter
+bool churn(aardvarkAdapter& adapter, const options& opt)
+{
+	const auto pins = gpioPins(opt.mode);
+	const size_t threads = std::max<size_t>(2, std::min<size_t>(opt.max_clients, 8));
+	std::atomic<uint64_t> failures{0};
+	std::atomic<uint64_t> miscounted{0};
+
+	auto before = aa_sim_stats();
+	auto reconnects = adapter.reconnectStats().reconnects;
+
+	std::vector<std::thread> workers;
+	for(size_t t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&, t] {
+			std::mt19937 rng(opt.seed + static_cast<unsigned>(t));
+			aardvarkI2CMaster i2c{adapter};
+			aardvarkSPIMaster spi{adapter};
+			std::unique_ptr<aardvarkGPIO> gpio;
+
+			std::vector<embvm::DriverBase*> drivers;
+			if(hasI2C(opt.mode))
+			{
+				drivers.push_back(&i2c);
+			}
+			if(hasSPI(opt.mode))
+			{
+				drivers.push_back(&spi);
+			}
+			if(!pins.empty())
+			{
+				gpio = std::make_unique<aardvarkGPIO>(adapter, pins[t % pins.size()],
+													  embvm::gpio::mode::output);
+				drivers.push_back(gpio.get());
+			}
+
+			std::array<uint8_t, 4> buffer{};
+
+			for(unsigned cycle = 0; cycle < opt.cycles; cycle++)
+			{
+				// Half of the cycles also hold a direct reference, as a tool using the adapter
+				// outside of a driver would
+				bool direct = (rng() & 1) != 0;
+				if(direct)
+				{
+					adapter.attach();
+				}
+
+				std::shuffle(drivers.begin(), drivers.end(), rng);
+				for(auto* d : drivers)
+				{
+					d->start();
+				}
+
+				// Every started driver holds its own reference, whatever the other threads do
+				auto held = static_cast<int>(drivers.size()) + (direct ? 1 : 0);
+				if(adapter.attached() < held)
+				{
+					miscounted++;
+				}
+
+				if(hasI2C(opt.mode) &&
+				   i2cRead(i2c, 0, buffer.data(), buffer.size()) != embvm::i2c::status::ok)
+				{
+					failures++;
+				}
+				if(hasSPI(opt.mode) &&
+				   spiTransfer(spi, buffer.data(), buffer.data(), buffer.size()) !=
+					   embvm::comm::status::ok)
+				{
+					failures++;
+				}
+				if(gpio)
+				{
+					gpio->toggle();
+				}
+
+				std::shuffle(drivers.begin(), drivers.end(), rng);
+				for(auto* d : drivers)
+				{
+					d->stop();
+				}
+
+				if(direct)
+				{
+					adapter.detach();
+				}
+			}
+		});
+	}
+
+	for(auto& w : workers)
+	{
+		w.join();
+	}
+
+	auto after = aa_sim_stats();
+	auto opens = after.opens - before.opens;
+	auto closes = after.closes - before.closes;
+	auto lost = adapter.reconnectStats().reconnects - reconnects;
+
+	bool ok = (failures == 0) && (miscounted == 0) && (opens == closes) && (lost == 0) &&
+			  (adapter.handle() == 0) && (adapter.attached() == 0);
+
+	printf("churn: %zu threads x %u cycles, %u opens, %u closes, %u reconnects, %llu failed "
+		   "operations: %s\n",
+		   threads, opt.cycles, opens, closes, static_cast<unsigned>(lost),
+		   static_cast<unsigned long long>(failures.load()), ok ? "ok" : "FAILED");
+
+	if(miscounted != 0 || adapter.attached() != 0)
+	{
+		printf("  the adapter reference count did not match the started drivers\n");
+	}
+
+	if(opens != closes || adapter.handle() != 0)
+	{
+		printf("  the adapter was left open or closed more often than opened\n");
+	}
+	if(lost != 0)
+	{
+		printf("  the adapter was closed while a client driver was still started\n");
+	}
+
+	return ok;
+}
+
+/// Phase 2: closed-loop clients per driver type, for 1, 2, 4, ... clients
+bool scale(aardvarkAdapter& adapter, const options& opt)
+{
+	const auto pins = gpioPins(opt.mode);
+	aardvarkI2CMaster i2c{adapter};
+	aardvarkSPIMaster spi{adapter};
+	bool ok = true;
+
+	if(hasI2C(opt.mode))
+	{
+		i2c.start();
+	}
+	if(hasSPI(opt.mode))
+	{
+		spi.start();
+	}
+
+	printf("\n%7s %10s %7s %7s %8s %8s %9s %10s %8s %8s  %s\n", "clients", "ops/s", "p50 us",
+		   "p99 us", "p999 us", "max us", "fairness", "arbitrated", "wait/op", "waiters",
+		   "flags");
+
+	double previous_rate = 0.0;
+
+	for(size_t n = 1; n <= opt.max_clients; n *= 2)
+	{
+		std::vector<std::unique_ptr<client>> i2c_clients;
+		std::vector<std::unique_ptr<client>> spi_clients;
+		std::vector<std::unique_ptr<client>> gpio_clients;
+		std::vector<std::unique_ptr<aardvarkGPIO>> gpios;
+		std::vector<std::thread> workers;
+		std::atomic<bool> stop{false};
+
+		for(size_t i = 0; i < n; i++)
+		{
+			auto id = static_cast<uint8_t>(i);
+
+			if(hasI2C(opt.mode))
+			{
+				i2c_clients.push_back(std::make_unique<client>());
+				auto& c = *i2c_clients.back();
+				workers.emplace_back([&, id] { runI2C(i2c, c, id, stop); });
+			}
+			if(hasSPI(opt.mode))
+			{
+				spi_clients.push_back(std::make_unique<client>());
+				auto& c = *spi_clients.back();
+				workers.emplace_back([&, id] { runSPI(spi, c, id, stop); });
+			}
+			if(!pins.empty())
+			{
+				gpios.push_back(std::make_unique<aardvarkGPIO>(adapter, pins[i % pins.size()],
+															   embvm::gpio::mode::output));
+				gpios.back()->start();
+				gpio_clients.push_back(std::make_unique<client>());
+				auto& c = *gpio_clients.back();
+				auto& g = *gpios.back();
+				workers.emplace_back([&] { runGPIO(g, c, stop); });
+			}
+		}
+
+		auto lock_before = adapter.lockStats();
+		auto start = steady_clock::now();
+
+		std::this_thread::sleep_for(opt.duration);
+		stop = true;
+
+		for(auto& w : workers)
+		{
+			w.join();
+		}
+
+		auto elapsed = std::chrono::duration<double>(steady_clock::now() - start).count();
+		auto lock_after = adapter.lockStats();
+
+		for(auto& g : gpios)
+		{
+			g->stop();
+		}
+
+		histogram total;
+		uint64_t failures = 0;
+		uint64_t bus_ops = 0;
+		double fairness = 1.0;
+
+		for(const auto* group : {&i2c_clients, &spi_clients, &gpio_clients})
+		{
+			if(group->empty())
+			{
+				continue;
+			}
+
+			uint64_t least = UINT64_MAX;
+			uint64_t most = 0;
+
+			for(const auto& c : *group)
+			{
+				// GPIO operations take the adapter lock directly; only bus transfers are arbitrated
+				bus_ops += (group != &gpio_clients) ? c->ops : 0;
+				total.merge(c->latency);
+				failures += c->failures;
+				least = std::min(least, c->ops);
+				most = std::max(most, c->ops);
+			}
+
+			if(most > 0)
+			{
+				fairness = std::min(fairness, static_cast<double>(least) / static_cast<double>(most));
+			}
+		}
+
+		// Bus transfers are serialized by the arbiter before they take the adapter lock, so the
+		// lock itself is rarely contended: a convoy shows up as arbitration waits
+		auto waits = lock_after.arbitration_waits - lock_before.arbitration_waits;
+		auto wait_us = lock_after.arbitration_wait_us - lock_before.arbitration_wait_us;
+		double contention =
+			bus_ops ? static_cast<double>(waits) / static_cast<double>(bus_ops) : 0.0;
+		double rate = static_cast<double>(total.count) / elapsed;
+
+		std::string flags;
+		if(contention > CONVOY_CONTENTION && previous_rate > 0.0 &&
+		   rate < previous_rate * CONVOY_SCALING)
+		{
+			flags += "convoy ";
+		}
+		if(fairness < STARVATION_FAIRNESS)
+		{
+			flags += "starvation ";
+		}
+		if(failures > 0)
+		{
+			flags += "FAILED ";
+			ok = false;
+		}
+
+		printf("%7zu %10.0f %7u %7u %8u %8u %9.2f %9.1f%% %8.2f %8u  %s\n", n, rate,
+			   total.percentile(0.5), total.percentile(0.99), total.percentile(0.999),
+			   total.max_us, fairness, contention * 100.0,
+			   bus_ops ? static_cast<double>(wait_us) / static_cast<double>(bus_ops) : 0.0,
+			   lock_after.max_waiters, flags.c_str());
+
+		previous_rate = rate;
+	}
+
+	if(hasSPI(opt.mode))
+	{
+		spi.stop();
+	}
+	if(hasI2C(opt.mode))
+	{
+		i2c.stop();
+	}
+
+	return ok;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	options opt;
+
+	int c;
+	while((c = getopt(argc, argv, "m:n:d:c:s:wh")) != -1)
+	{
+		switch(c)
+		{
+			case 'm':
+				if(!aardvarkParseMode(optarg, opt.mode))
+				{
+					aardvarkUsage(argv[0], STRESS_OPTIONS);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				opt.max_clients = std::max<size_t>(1, strtoul(optarg, nullptr, 0));
+				break;
+			case 'd':
+				opt.duration = std::chrono::milliseconds(strtoul(optarg, nullptr, 0));
+				break;
+			case 'c':
+				opt.cycles = static_cast<unsigned>(strtoul(optarg, nullptr, 0));
+				break;
+			case 's':
+				opt.seed = static_cast<unsigned>(strtoul(optarg, nullptr, 0));
+				break;
+			case 'w':
+				opt.wire_time = true;
+				break;
+			case 'h':
+			default:
+				aardvarkUsage(argv[0], STRESS_OPTIONS);
+				return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	aa_sim_reset();
+	aa_sim_bus_time(opt.wire_time ? 1 : 0);
+	aa_sim_i2c_target(TARGET_ADDRESS, 1);
+
+	// Each register holds its own address, so clients can check that they read their own
+	u08* registers = aa_sim_i2c_registers(TARGET_ADDRESS);
+	for(int i = 0; i < 256; i++)
+	{
+		registers[i] = static_cast<u08>(i);
+	}
+
+	aardvarkAdapter adapter{opt.mode};
+
+	bool ok = churn(adapter, opt);
+	ok = scale(adapter, opt) && ok;
+
+	auto lock = adapter.lockStats();
+	printf("\nadapter lock: %u acquisitions, %u contended, max wait %u us; arbitration: %u waits, "
+		   "%llu us total, max wait %u us, max %u waiters\n",
+		   lock.acquisitions, lock.contended, lock.max_wait_us, lock.arbitration_waits,
+		   static_cast<unsigned long long>(lock.arbitration_wait_us), lock.max_arbitration_wait_us,
+		   lock.max_waiters);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}